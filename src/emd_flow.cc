@@ -1,78 +1,158 @@
+#include <algorithm>
 #include <vector>
 #include <cmath>
+#include <cstdarg>
 #include <cstdio>
 #include <ctime>
 #include <memory>
 #include <string>
 #include <limits>
 
+#include <sys/time.h>
+
 #include "emd_flow_network.h"
 #include "emd_flow_network_factory.h"
+#include "emd_flow_parallel.h"
+#include "emd_flow_parametric.h"
 #include "emd_flow.h"
 
 using namespace std;
 
 const int kOutputBufferSize = 10000;
-char output_buffer[kOutputBufferSize];
+// Number of times increase_lambda (decrease_lambda) doubles (halves) lambda
+// before going to the bound from compute_lambda_bounds with bisection. The
+// secant and hybrid policies go to the bound right after the initial guess.
+const int kMaxDoublingSteps = 8;
+// relative tolerance for a secant step finding a better solution
+const double kSecantTolerance = 1e-10;
+
+// A lambda probed during the search and its solution
+struct search_point {
+  double lambda;
+  int emd_cost;
+  double amp_sum;
+
+  search_point(double _lambda) : lambda(_lambda), emd_cost(0), amp_sum(0.0) { }
+};
+
+// Wall-clock time in seconds (clock() adds up the time of all threads).
+double get_wall_time();
+
+// Format a message and pass it to args.output_function. Each call uses its
+// own buffer, so emd_flow can run in several threads at once.
+void output(const emd_flow_args& args, const char* format, ...);
+
+// Build the flow network for the arguments. Returns NULL if the arguments are
+// invalid.
+auto_ptr<EMDFlowNetwork> create_network(const emd_flow_args& args);
+
+// True if the networks for both arguments have the same graph, i.e., they
+// differ at most in the amplitudes.
+bool same_graph(const emd_flow_args& args, const emd_flow_args& other);
+
+// emd_flow with networks that are kept between calls: if reuse_networks is
+// true, the networks in *networks have the same graph as the network for args
+// (see same_graph) and only their amplitudes are updated. Otherwise (or if
+// the networks do not support updating the amplitudes), they are built
+// again. Copies for the parallel search over lambda are added or removed to
+// match args.num_search_threads. The copies are built and run on pool (if
+// pool is NULL and there are copies, the call starts its own threads).
+void emd_flow(const emd_flow_args& args, emd_flow_result* result,
+    auto_ptr<EMDFlowParallelSolver>* networks, bool reuse_networks,
+    EMDFlowThreadPool* pool);
+
+// Add num_copies more networks for the arguments to the solver. The networks
+// are built in parallel on pool.
+void add_network_copies(const emd_flow_args& args, int num_copies,
+    EMDFlowThreadPool* pool, EMDFlowParallelSolver* solver);
+
+// Run the flow and count the call in the result.
+void run_flow(double emd_lambda, double signal_lambda, EMDFlowNetwork* network,
+    emd_flow_result* result);
+
+// Run the flow for point->lambda and store the solution in point.
+void solve(search_point* point, EMDFlowNetwork* network,
+    emd_flow_result* result);
+
+// Run the flow for (*points)[ii].lambda on network ii of the solver (in
+// parallel) and store the solutions in points.
+void solve(vector<search_point>* points, EMDFlowParallelSolver* solver,
+    emd_flow_result* result);
+
+// Number of doubling (halving) steps in increase_lambda (decrease_lambda)
+// before going to the bound from compute_lambda_bounds.
+int get_max_doubling_steps(const emd_flow_args& args);
+
+// Returns the largest u such that all EMD costs are integer multiples of u
+// (up to rounding errors), or 0 if there is no such u of reasonable size.
+double get_emd_cost_unit(const vector<double>& emd_costs);
+
+// Compute bounds on lambda from the instance: for lambda >= lambda_max, the
+// solution has the smallest possible EMD cost. lambda_max is infinite if the
+// EMD costs have no common unit (see get_emd_cost_unit). lambda_min is only a
+// guess: for lambda <= lambda_min, the solution usually has the largest
+// possible amplitude sum (this is checked in decrease_lambda).
+void compute_lambda_bounds(const emd_flow_args& args, double* lambda_min,
+    double* lambda_max);
 
 // Make lambda larger until we find a solution that fits into the EMD budget.
-// Returns true if we find a solution in [emd_bound_low, emd_bound_high].
-bool increase_lambda(const emd_flow_args& args, emd_flow_result* result,
-    EMDFlowNetwork* network, double* lambda_high);
+// Returns true if we find a solution in [emd_bound_low, emd_bound_high]. If
+// the initial guess for lambda_high does not fit into the EMD budget, it is
+// returned in low and found_lambda_low is set to true. Otherwise,
+// result->support contains the support of the solution for high.
+bool increase_lambda(const emd_flow_args& args, double lambda_max,
+    emd_flow_result* result, EMDFlowParallelSolver* solver,
+    search_point* high, search_point* low, bool* found_lambda_low);
 
 // Make lambda smaller until we find a solution that does not fit into the
 // EMD budget. Return true if we find a solution in
-// [emd_bound_low, emd_bound_high].
-bool decrease_lambda(const emd_flow_args& args, double current_lambda_high,
-    emd_flow_result* result, EMDFlowNetwork* network, double* lambda_low);
-
-// Binary search over lambda
-void binary_search_lambda(const emd_flow_args& args, double lambda_low,
-    double lambda_high, emd_flow_result* result, EMDFlowNetwork* network);
+// [emd_bound_low, emd_bound_high]. Feasible solutions found on the way become
+// the new high and their supports are stored in result->support.
+bool decrease_lambda(const emd_flow_args& args, double lambda_min,
+    emd_flow_result* result, EMDFlowParallelSolver* solver, search_point* low,
+    search_point* high);
+
+// Search over lambda between low (EMD cost above the budget) and high (EMD
+// cost within the budget) with args.search_policy. result->support must
+// contain the support of the solution for high. With several networks in
+// the solver, each round tries one lambda per network.
+void binary_search_lambda(const emd_flow_args& args, search_point low,
+    search_point high, emd_flow_result* result, EMDFlowParallelSolver* solver);
+
+// Find the breakpoint over lambda with the largest EMD cost that fits into the
+// EMD budget and return its solution.
+void parametric_search(const emd_flow_args& args, emd_flow_result* result,
+    EMDFlowNetwork* network);
 
 // Set the result struct to values indicating an error.
 void clear_result(emd_flow_result* result);
 
 
-// Main routine for computing the EMD flow.
-void emd_flow(const emd_flow_args& args, emd_flow_result* result) {
-  clock_t total_time_begin = clock();
-
-  int r = args.x.size();
-  int c = args.x[0].size();
-
-  if (args.verbose) {
-    snprintf(output_buffer, kOutputBufferSize, "r = %d,  c = %d,  s = %d,  "
-        "emd_bound_low = %d, emd_bound_high = %d\n", r, c, args.s,
-        args.emd_bound_low, args.emd_bound_high);
-    args.output_function(output_buffer);
-    snprintf(output_buffer, kOutputBufferSize, "lambda_low = %e, "
-        "lambda_high = %e, num_search_iterations = %d\n", args.lambda_low,
-        args.lambda_high, args.num_search_iterations);
-    args.output_function(output_buffer);
-  }
-
-  /*for (size_t ii = 0; ii < r; ++ii) {
-    for (size_t jj = 0; jj < c; ++jj) {
-      printf("%lf ", args.x[ii][jj]);
-    }
-    printf("\n");
-  }
-  printf("\n");*/
+double get_wall_time() {
+  timeval time;
+  gettimeofday(&time, NULL);
+  return time.tv_sec + time.tv_usec * 1e-6;
+}
 
-  // build graph
-  clock_t graph_construction_time_begin = clock();
+void output(const emd_flow_args& args, const char* format, ...) {
+  char buffer[kOutputBufferSize];
+  va_list arguments;
+  va_start(arguments, format);
+  vsnprintf(buffer, kOutputBufferSize, format, arguments);
+  va_end(arguments);
+  args.output_function(buffer, args.output_context);
+}
 
+auto_ptr<EMDFlowNetwork> create_network(const emd_flow_args& args) {
+  int r = args.x.get_num_rows();
   int outdegree_vertical_distance = args.outdegree_vertical_distance;
   if (outdegree_vertical_distance == -1) {
     outdegree_vertical_distance = r - 1;
   } else if (outdegree_vertical_distance < -1) {
-    snprintf(output_buffer, kOutputBufferSize, "Error: "
+    output(args, "Error: "
         "outdegree_vertical_distance cannot be less than -1, given value is %d"
         ".\n", outdegree_vertical_distance);
-    args.output_function(output_buffer);
-    clear_result(result);
-    return;
+    return auto_ptr<EMDFlowNetwork>();
   }
 
   vector<double> emd_costs = args.emd_costs;
@@ -82,104 +162,534 @@ void emd_flow(const emd_flow_args& args, emd_flow_result* result) {
     }
   } else if (static_cast<int>(emd_costs.size())
       != outdegree_vertical_distance + 1) {
-    snprintf(output_buffer, kOutputBufferSize, "Error: "
+    output(args, "Error: "
         "the emd_costs vector has an incorrect number of entries: %lu entries, "
         " should be %d\n", emd_costs.size(), outdegree_vertical_distance + 1);
-    args.output_function(output_buffer);
-    clear_result(result);
-    return;
+    return auto_ptr<EMDFlowNetwork>();
   }
 
   auto_ptr<EMDFlowNetwork> network =
       EMDFlowNetworkFactory::create_EMD_flow_network(args.x,
       outdegree_vertical_distance, emd_costs, args.alg_type);
   network->set_sparsity(args.s);
+  network->set_warm_start(args.warm_start);
+  return network;
+}
+
+emd_flow_search_policy parse_search_policy(const string& name) {
+  if (name == "bisection") {
+    return kBisectionSearch;
+  } else if (name == "secant") {
+    return kSecantSearch;
+  } else if (name == "hybrid") {
+    return kHybridSearch;
+  } else {
+    return kUnknownSearchPolicy;
+  }
+}
+
+bool same_graph(const emd_flow_args& args, const emd_flow_args& other) {
+  return args.x.get_num_rows() == other.x.get_num_rows()
+      && args.x.get_num_columns() == other.x.get_num_columns()
+      && args.outdegree_vertical_distance == other.outdegree_vertical_distance
+      && args.emd_costs == other.emd_costs
+      && args.alg_type == other.alg_type;
+}
+
+void run_flow(double emd_lambda, double signal_lambda, EMDFlowNetwork* network,
+    emd_flow_result* result) {
+  network->run_flow(emd_lambda, signal_lambda);
+  ++result->num_run_flow_calls;
+}
+
+void solve(search_point* point, EMDFlowNetwork* network,
+    emd_flow_result* result) {
+  run_flow(point->lambda, 1.0, network, result);
+  point->emd_cost = network->get_EMD_used();
+  point->amp_sum = network->get_supported_amplitude_sum();
+}
+
+void solve(vector<search_point>* points, EMDFlowParallelSolver* solver,
+    emd_flow_result* result) {
+  if (points->size() == 1) {
+    solve(&(*points)[0], solver->get_network(0), result);
+    return;
+  }
+  vector<double> lambdas(points->size());
+  for (size_t ii = 0; ii < points->size(); ++ii) {
+    lambdas[ii] = (*points)[ii].lambda;
+  }
+  solver->run_flows(lambdas);
+  result->num_run_flow_calls += points->size();
+  for (size_t ii = 0; ii < points->size(); ++ii) {
+    EMDFlowNetwork* network = solver->get_network(ii);
+    (*points)[ii].emd_cost = network->get_EMD_used();
+    (*points)[ii].amp_sum = network->get_supported_amplitude_sum();
+  }
+}
+
+// context of create_network_task
+struct create_network_context {
+  const emd_flow_args* args;
+  vector<EMDFlowNetwork*> networks;
+};
+
+void create_network_task(int index, void* raw_context) {
+  create_network_context* context =
+      static_cast<create_network_context*>(raw_context);
+  context->networks[index] = create_network(*context->args).release();
+}
+
+void add_network_copies(const emd_flow_args& args, int num_copies,
+    EMDFlowThreadPool* pool, EMDFlowParallelSolver* solver) {
+  create_network_context context;
+  context.args = &args;
+  context.networks.resize(num_copies, NULL);
+  pool->run(num_copies, create_network_task, &context);
+  for (int ii = 0; ii < num_copies; ++ii) {
+    solver->add_network(auto_ptr<EMDFlowNetwork>(context.networks[ii]));
+  }
+}
+
+// Main routine for computing the EMD flow.
+void emd_flow(const emd_flow_args& args, emd_flow_result* result) {
+  auto_ptr<EMDFlowParallelSolver> networks;
+  emd_flow(args, result, &networks, false, NULL);
+}
+
+void emd_flow(const emd_flow_args& args, emd_flow_result* result,
+    auto_ptr<EMDFlowParallelSolver>* networks, bool reuse_networks,
+    EMDFlowThreadPool* pool) {
+  clock_t total_time_begin = clock();
+  double wall_time_begin = get_wall_time();
+  result->num_run_flow_calls = 0;
+
+  int r = args.x.get_num_rows();
+  int c = args.x.get_num_columns();
+
+  if (args.verbose) {
+    output(args, "r = %d,  c = %d,  s = %d,  "
+        "emd_bound_low = %d, emd_bound_high = %d\n", r, c, args.s,
+        args.emd_bound_low, args.emd_bound_high);
+    output(args, "lambda_low = %e, "
+        "lambda_high = %e, num_search_iterations = %d\n", args.lambda_low,
+        args.lambda_high, args.num_search_iterations);
+  }
+
+  /*for (size_t ii = 0; ii < r; ++ii) {
+    for (size_t jj = 0; jj < c; ++jj) {
+      printf("%lf ", args.x(ii, jj));
+    }
+    printf("\n");
+  }
+  printf("\n");*/
+
+  // build graph (or update the amplitudes of the previous ones)
+  clock_t graph_construction_time_begin = clock();
+
+  bool reused_networks = (reuse_networks && networks->get() != NULL
+      && (*networks)->set_amplitudes(args.x));
+  if (reused_networks) {
+    (*networks)->set_sparsity(args.s);
+    (*networks)->set_warm_start(args.warm_start);
+  } else {
+    networks->reset();
+    auto_ptr<EMDFlowNetwork> new_network = create_network(args);
+    if (new_network.get() == NULL) {
+      clear_result(result);
+      result->total_time = get_wall_time() - wall_time_begin;
+      return;
+    }
+    networks->reset(new EMDFlowParallelSolver(new_network));
+  }
+  EMDFlowParallelSolver* solver = networks->get();
+  EMDFlowNetwork* network = solver->get_network(0);
 
   clock_t graph_construction_time = clock() - graph_construction_time_begin;
 
   if (args.verbose) {
-    snprintf(output_buffer, kOutputBufferSize, "The graph has %d nodes and %d "
+    if (reused_networks) {
+      output(args, "Updated the amplitudes of the previous graph.\n");
+    }
+    output(args, "The graph has %d nodes and %d "
         "edges.\n", network->get_num_nodes(), network->get_num_edges());
-    args.output_function(output_buffer);
-    snprintf(output_buffer, kOutputBufferSize, "Total construction time: %f "
+    output(args, "Total construction time: %f "
         "s\n ", static_cast<double>(graph_construction_time) / CLOCKS_PER_SEC);
-    args.output_function(output_buffer);
   }
 
-  double lambda_high = args.lambda_high;
-  double lambda_low = args.lambda_low;
+  search_point high(args.lambda_high);
+  search_point low(args.lambda_low);
+  bool found_lambda_low = false;
+
+  if (args.parametric) {
+    parametric_search(args, result, network);
+  } else {
+    double lambda_min, lambda_max;
+    compute_lambda_bounds(args, &lambda_min, &lambda_max);
+    if (args.verbose) {
+      output(args, "lambda_min = %e, "
+          "lambda_max = %e\n", lambda_min, lambda_max);
+    }
+
+    // The threads of the search are started once per call (or kept by the
+    // caller), not once per round.
+    int num_networks = max(1, args.num_search_threads);
+    auto_ptr<EMDFlowThreadPool> call_pool;
+    if (pool == NULL && num_networks > 1) {
+      call_pool.reset(new EMDFlowThreadPool(num_networks));
+      pool = call_pool.get();
+    }
+    solver->set_thread_pool(pool);
+    solver->remove_networks(num_networks);
+    int num_copies = num_networks - solver->get_num_networks();
+    if (num_copies > 0) {
+      add_network_copies(args, num_copies, pool, solver);
+      if (args.verbose) {
+        output(args, "Built %d copies of the network for the parallel "
+            "search.\n", num_copies);
+      }
+    }
 
-  if (!increase_lambda(args, result, network.get(), &lambda_high)) {
-    if (!decrease_lambda(args, lambda_high, result, network.get(),
-        &lambda_low)) {
-      binary_search_lambda(args, lambda_low, lambda_high, result,
-          network.get());
+    // With the secant and hybrid policies, a guess that doubling proved
+    // infeasible is the lower end of the search, so decrease_lambda is
+    // skipped. Bisection keeps the bracket from decrease_lambda, which
+    // finds the same solutions as earlier versions.
+    if (!increase_lambda(args, lambda_max, result, solver, &high, &low,
+        &found_lambda_low)) {
+      bool skip_decrease = (found_lambda_low
+          && args.search_policy != kBisectionSearch);
+      if (skip_decrease || !decrease_lambda(args, lambda_min, result,
+          solver, &low, &high)) {
+        binary_search_lambda(args, low, high, result, solver);
+      }
     }
   }
 
   if (args.verbose) {
-    snprintf(output_buffer, kOutputBufferSize, "Final l: %e, amp sum: %e, "
-        "EMD cost: %d\n", lambda_high, result->amp_sum, result->emd_cost);
-    args.output_function(output_buffer);
+    output(args, "Final l: %e, amp sum: %e, "
+        "EMD cost: %d, run_flow calls: %d\n", result->final_lambda_high,
+        result->amp_sum, result->emd_cost, result->num_run_flow_calls);
   }
 
+  result->total_time = get_wall_time() - wall_time_begin;
   clock_t total_time = clock() - total_time_begin;
   if (args.verbose) {
-    snprintf(output_buffer, kOutputBufferSize, "Total time %f s\n",
+    output(args, "Total time %f s\n",
         static_cast<double>(total_time) / CLOCKS_PER_SEC);
-    args.output_function(output_buffer);
 
     string performance_diagnostics;
     network->get_performance_diagnostics(&performance_diagnostics);
-    snprintf(output_buffer, kOutputBufferSize, "Performance diagnostics:\n%s\n",
+    output(args, "Performance diagnostics:\n%s\n",
         performance_diagnostics.c_str());
-    args.output_function(output_buffer);
   }
 
   return;
 }
 
-void binary_search_lambda(const emd_flow_args& args, double lambda_low,
-    double lambda_high, emd_flow_result* result, EMDFlowNetwork* network) {
+EMDFlowSolver::EMDFlowSolver(const emd_flow_args& args) : options_(args) {
+  auto_ptr<EMDFlowNetwork> network = create_network(args);
+  if (network.get() != NULL) {
+    networks_.reset(new EMDFlowParallelSolver(network));
+  }
+  if (args.num_search_threads > 1 && !args.parametric) {
+    pool_.reset(new EMDFlowThreadPool(args.num_search_threads));
+  }
+}
+
+bool EMDFlowSolver::set_amplitudes(const AmplitudeMatrix& x) {
+  if (x.get_num_rows() != options_.x.get_num_rows()
+      || x.get_num_columns() != options_.x.get_num_columns()) {
+    return false;
+  }
+  options_.x = x;
+  return true;
+}
+
+void EMDFlowSolver::solve(int emd_bound_low, int emd_bound_high,
+    emd_flow_result* result) {
+  emd_flow_args args(options_);
+  args.emd_bound_low = emd_bound_low;
+  args.emd_bound_high = emd_bound_high;
+  emd_flow(args, result, &networks_, true, pool_.get());
+}
+
+void emd_flow_batch(const vector<const emd_flow_args*>& args,
+    const vector<emd_flow_result*>& results, int num_threads) {
+  EMDFlowBatchSolver solver(num_threads);
+  solver.solve(args, results);
+}
+
+EMDFlowBatchSolver::EMDFlowBatchSolver(int num_threads)
+    : num_threads_(max(1, num_threads)), pool_(num_threads_),
+      networks_(num_threads_, NULL),
+      network_args_(num_threads_, emd_flow_args(AmplitudeMatrix())),
+      args_(NULL), results_(NULL) { }
+
+EMDFlowBatchSolver::~EMDFlowBatchSolver() {
+  for (size_t ii = 0; ii < networks_.size(); ++ii) {
+    delete networks_[ii];
+  }
+}
+
+void EMDFlowBatchSolver::solve(const vector<const emd_flow_args*>& args,
+    const vector<emd_flow_result*>& results) {
+  args_ = &args;
+  results_ = &results;
+  run_work_stealing(args.size(), &pool_, solve_task, this);
+  args_ = NULL;
+  results_ = NULL;
+}
+
+void EMDFlowBatchSolver::solve(int worker, const emd_flow_args& args,
+    emd_flow_result* result) {
+  auto_ptr<EMDFlowParallelSolver> networks(networks_[worker]);
+  bool reuse_networks = (networks.get() != NULL
+      && same_graph(args, network_args_[worker]));
+  emd_flow(args, result, &networks, reuse_networks, &pool_);
+  networks_[worker] = networks.release();
+  network_args_[worker] = args;
+}
+
+void EMDFlowBatchSolver::run_workers(void (*function)(int, void*),
+    void* context) {
+  pool_.run(num_threads_, function, context);
+}
+
+void EMDFlowBatchSolver::solve_task(int item, int worker,
+    void* raw_solver) {
+  EMDFlowBatchSolver* solver = static_cast<EMDFlowBatchSolver*>(raw_solver);
+  solver->solve(worker, *(*solver->args_)[item], (*solver->results_)[item]);
+}
+
+void emd_flow_frontier(const emd_flow_args& args,
+    emd_flow_frontier_result* result) {
+  clock_t total_time_begin = clock();
+  result->points.clear();
+  result->network = create_network(args);
+  if (result->network.get() == NULL) {
+    return;
+  }
+
+  EMDFlowParametricSolver solver(result->network.get());
+  solver.compute_breakpoints();
+  result->points = solver.get_breakpoints();
+
+  if (args.verbose) {
+    for (size_t ii = 0; ii < result->points.size(); ++ii) {
+      output(args, "l: [%e, %e]  EMD: %d  "
+          "amp sum: %e\n", result->points[ii].lambda_low,
+          result->points[ii].lambda_high, result->points[ii].emd_cost,
+          result->points[ii].amp_sum);
+    }
+    clock_t total_time = clock() - total_time_begin;
+    output(args, "%lu points, %d run_flow "
+        "calls, total time %f s\n", result->points.size(),
+        solver.get_num_run_flow_calls(),
+        static_cast<double>(total_time) / CLOCKS_PER_SEC);
+  }
+}
+
+void emd_flow_frontier_support(emd_flow_frontier_result* result, int index,
+    vector<vector<bool> >* support) {
+  EMDFlowParametricSolver solver(result->network.get());
+  solver.solve_at_breakpoint(result->points[index]);
+  result->network->get_support(support);
+}
+
+void emd_flow_sparsity_sweep(const emd_flow_args& args, double lambda,
+    vector<emd_flow_augmentation>* steps) {
+  steps->clear();
+  auto_ptr<EMDFlowNetwork> network = create_network(args);
+  if (network.get() == NULL) {
+    return;
+  }
+
+  network->set_record_augmentations(true);
+  network->run_flow(lambda, 1.0);
+  if (!network->get_augmentations(steps)) {
+    output(args, "Error: the flow algorithm "
+        "does not support sparsity sweeps.\n");
+    return;
+  }
+
+  if (args.verbose) {
+    for (size_t ii = 0; ii < steps->size(); ++ii) {
+      output(args, "s: %lu  EMD: %d  amp sum: "
+          "%e\n", ii + 1, (*steps)[ii].emd_cost, (*steps)[ii].amp_sum);
+    }
+  }
+}
+
+void emd_flow_sparsity_support(const vector<emd_flow_augmentation>& steps,
+    int s, int rows, int cols, vector<vector<bool> >* support) {
+  support->assign(rows, vector<bool>(cols, false));
+  for (int ii = 0; ii < s && ii < static_cast<int>(steps.size()); ++ii) {
+    for (size_t jj = 0; jj < steps[ii].added.size(); ++jj) {
+      (*support)[steps[ii].added[jj].first][steps[ii].added[jj].second] = true;
+    }
+    for (size_t jj = 0; jj < steps[ii].removed.size(); ++jj) {
+      (*support)[steps[ii].removed[jj].first][steps[ii].removed[jj].second] =
+          false;
+    }
+  }
+}
+
+void binary_search_lambda(const emd_flow_args& args, search_point low,
+    search_point high, emd_flow_result* result, EMDFlowParallelSolver* solver) {
 
   // binary search on lambda
   if (args.verbose) {
-    snprintf(output_buffer, kOutputBufferSize, "Binary search on lambda ...\n");
-    args.output_function(output_buffer);
+    output(args, "Binary search on lambda ...\n");
   }
 
-  int cur_emd_cost = 0;
-  double cur_amp_sum = 0;
-  int current_iteration = 1;
+  // With a lower EMD bound of at most 0, every solution for high is good.
+  bool found = (args.emd_bound_low <= 0);
+  // A round with k lambdas counts as log2(k + 1) iterations because it
+  // narrows the interval as much as that many bisection steps.
+  double current_iteration = 1.0;
+  bool bisect = (args.search_policy == kBisectionSearch);
+  double tolerance = kSecantTolerance * max(1.0, low.amp_sum);
+  int num_networks = solver->get_num_networks();
+  vector<search_point> points;
+
+  while (current_iteration <= args.num_search_iterations && !found) {
+    // The solutions at both ends are equally good for the slope between
+    // them. This lambda is between the two ends unless there are rounding
+    // errors.
+    double secant_lambda = (low.amp_sum - high.amp_sum)
+        / (low.emd_cost - high.emd_cost);
+    bool secant_step = (!bisect && secant_lambda > low.lambda
+        && secant_lambda < high.lambda);
+    points.clear();
+    if (secant_step) {
+      points.push_back(search_point(secant_lambda));
+    }
+    // The other lambdas split the interval into equal parts. With the secant
+    // and hybrid policies, wide brackets from compute_lambda_bounds are split
+    // geometrically.
+    int num_parts = num_networks - points.size() + 1;
+    for (int ii = 1; ii < num_parts; ++ii) {
+      double fraction = static_cast<double>(ii) / num_parts;
+      if (args.search_policy != kBisectionSearch && low.lambda > 0.0
+          && high.lambda > 4.0 * low.lambda) {
+        points.push_back(search_point(
+            low.lambda * pow(high.lambda / low.lambda, fraction)));
+      } else {
+        points.push_back(search_point(
+            low.lambda + fraction * (high.lambda - low.lambda)));
+      }
+    }
+    solve(&points, solver, result);
+    current_iteration += max(1.0, log(points.size() + 1.0) / log(2.0));
+
+    // Take the solution with the largest amplitude sum in the EMD budget if
+    // there is one. Otherwise, the solutions with the smallest lambda above
+    // the budget and the largest lambda below it become the new ends.
+    int emd_gap = low.emd_cost - high.emd_cost;
+    int best = -1;
+    int new_high = -1;
+    for (size_t ii = 0; ii < points.size(); ++ii) {
+      if (args.verbose) {
+        output(args, "l_cur: %e  (l_low: %e, "
+            "l_high: %e)  EMD: %d  amp sum: %e%s\n", points[ii].lambda,
+            low.lambda, high.lambda, points[ii].emd_cost, points[ii].amp_sum,
+            (secant_step && ii == 0) ? "  (secant)" : "");
+      }
+      if (points[ii].emd_cost > args.emd_bound_high) {
+        continue;
+      }
+      if (points[ii].emd_cost >= args.emd_bound_low
+          && (best == -1 || points[ii].amp_sum > points[best].amp_sum)) {
+        best = ii;
+      }
+      if (new_high == -1 || points[ii].lambda < points[new_high].lambda) {
+        new_high = ii;
+      }
+    }
+    if (best != -1) {
+      high = points[best];
+      solver->get_network(best)->get_support(result->support);
+      found = true;
+      break;
+    }
 
-  while (current_iteration <= args.num_search_iterations
-      && (cur_emd_cost < args.emd_bound_low
-      || cur_emd_cost > args.emd_bound_high)) {
-    ++current_iteration;
-    double cur_lambda = (lambda_high + lambda_low) / 2;
-    network->run_flow(cur_lambda, 1.0);
-    cur_emd_cost = network->get_EMD_used();
-    cur_amp_sum = network->get_supported_amplitude_sum();
+    const search_point& secant = points[0];
+    if (secant_step && secant.amp_sum - secant_lambda * secant.emd_cost
+        <= high.amp_sum - secant_lambda * high.emd_cost + tolerance) {
+      // The two ends are neighbors on the tradeoff curve, so no lambda gives
+      // an EMD cost in between.
+      if (args.verbose) {
+        output(args, "No solution with EMD cost "
+            "between %d and %d.\n", high.emd_cost, low.emd_cost);
+      }
+      break;
+    }
 
-    if (args.verbose) {
-      snprintf(output_buffer, kOutputBufferSize, "l_cur: %e  (l_low: %e, "
-          "l_high: %e)  EMD: %d  amp sum: %e\n", cur_lambda, lambda_low,
-          lambda_high, cur_emd_cost, cur_amp_sum);
-      args.output_function(output_buffer);
+    if (new_high != -1) {
+      high = points[new_high];
+      solver->get_network(new_high)->get_support(result->support);
     }
+    for (size_t ii = 0; ii < points.size(); ++ii) {
+      if (points[ii].emd_cost > args.emd_bound_high
+          && points[ii].lambda > low.lambda
+          && points[ii].lambda < high.lambda) {
+        low = points[ii];
+      }
+    }
+    if (args.search_policy == kHybridSearch) {
+      bisect = (secant_step && 2 * (low.emd_cost - high.emd_cost) > emd_gap);
+    }
+  }
 
-    if (cur_emd_cost <= args.emd_bound_high) {
-      lambda_high = cur_lambda;
+  // The support of the solution for high was stored when it was found.
+  result->final_lambda_low = low.lambda;
+  result->final_lambda_high = high.lambda;
+  result->emd_cost = high.emd_cost;
+  result->amp_sum = high.amp_sum;
+}
+
+void parametric_search(const emd_flow_args& args, emd_flow_result* result,
+    EMDFlowNetwork* network) {
+  if (args.verbose) {
+    output(args,
+        "Finding the breakpoint over lambda for the EMD budget ...\n");
+  }
+
+  EMDFlowParametricSolver solver(network);
+  emd_flow_breakpoint breakpoint;
+  if (!solver.compute_breakpoint(args.emd_bound_high, &breakpoint)) {
+    output(args, "Cannot satisfy the upper EMD "
+        "bound regardless of the signal approximation: the smallest feasible "
+        "EMD cost is %d while the upper EMD bound is %d. Consider changing the "
+        "EMD bounds or the edge EMD costs.", breakpoint.emd_cost,
+        args.emd_bound_high);
+    clear_result(result);
+    result->num_run_flow_calls = solver.get_num_run_flow_calls();
+    return;
+  }
+
+  if (args.verbose) {
+    output(args, "l: [%e, %e]  EMD: %d  "
+        "amp sum: %e  (%d run_flow calls)\n", breakpoint.lambda_low,
+        breakpoint.lambda_high, breakpoint.emd_cost, breakpoint.amp_sum,
+        solver.get_num_run_flow_calls());
+  }
+
+  if (breakpoint.emd_cost < args.emd_bound_low) {
+    if (breakpoint.lambda_low == 0.0) {
+      output(args, "Found a solution with lambda "
+          "= 0, so the solution does not satisfy the lower EMD bound.");
     } else {
-      lambda_low = cur_lambda;
+      output(args, "No breakpoint has an EMD cost in [%d, %d], returning the "
+          "solution with EMD cost %d.", args.emd_bound_low,
+          args.emd_bound_high, breakpoint.emd_cost);
     }
   }
 
-  // TODO: don't rerun flow here?
-  // run with final lambda
-  network->run_flow(lambda_high, 1.0);
-  result->final_lambda_low = lambda_low;
-  result->final_lambda_high = lambda_high;
+  solver.solve_at_breakpoint(breakpoint);
+  result->num_run_flow_calls = solver.get_num_run_flow_calls();
+  result->final_lambda_low = breakpoint.lambda_low;
+  result->final_lambda_high = breakpoint.lambda_high;
   result->emd_cost = network->get_EMD_used();
   result->amp_sum = network->get_supported_amplitude_sum();
   network->get_support(result->support);
@@ -188,60 +698,86 @@ void binary_search_lambda(const emd_flow_args& args, double lambda_low,
 // Increase lambda until we find a lambda such that the EMD cost is smaller
 // than the lower EMD bound. If we find a feasible solution during the process,
 // we return true. Otherwise we return false.
-bool increase_lambda(const emd_flow_args& args, emd_flow_result* result,
-    EMDFlowNetwork* network, double* lambda_high) {
+bool increase_lambda(const emd_flow_args& args, double lambda_max,
+    emd_flow_result* result, EMDFlowParallelSolver* solver,
+    search_point* high, search_point* low, bool* found_lambda_low) {
   if (args.verbose) {
-    snprintf(output_buffer, kOutputBufferSize,
-        "Finding large enough value of lambda ...\n");
-    args.output_function(output_buffer);
+    output(args, "Finding large enough value of lambda ...\n");
   }
 
   // Check what the cheapest flow is (ignoring node costs). If even the
   // cheapest flow costs more than the upper EMD bound, we cannot satisfy it.
-  network->run_flow(1.0, 0.0);
+  EMDFlowNetwork* network = solver->get_network(0);
+  run_flow(1.0, 0.0, network, result);
   int cur_emd_cost = network->get_EMD_used();
   double cur_amp_sum = network->get_supported_amplitude_sum();
 
   if (args.verbose) {
-    snprintf(output_buffer, kOutputBufferSize, "l_EMD: 1.0  l_signal: 0.0  "
+    output(args, "l_EMD: 1.0  l_signal: 0.0  "
         "EMD: %d  amp sum: %e\n", cur_emd_cost, cur_amp_sum);
-    args.output_function(output_buffer);
   }
 
   if (cur_emd_cost > args.emd_bound_high) {
-    snprintf(output_buffer, kOutputBufferSize, "Cannot satisfy the upper EMD "
+    output(args, "Cannot satisfy the upper EMD "
         "bound regardless of the signal approximation: the smallest feasible "
         "EMD cost is %d while the upper EMD bound is %d. Consider changing the "
         "EMD bounds or the edge EMD costs.", cur_emd_cost, args.emd_bound_high);
-    args.output_function(output_buffer);
     clear_result(result);
     return true;
   }
 
+  // Double lambda a few times (see get_max_doubling_steps). If that is not
+  // enough, the initial guess was bad and we go to lambda_max directly. With
+  // several networks, the next lambdas of this sequence are tried in
+  // parallel.
+  int max_steps = get_max_doubling_steps(args);
+  int num_steps = 0;
+  double next_lambda = high->lambda;
+  bool next_at_lambda_max = false;
+  vector<search_point> points;
+  vector<bool> at_lambda_max;
   while (true) {
-    network->run_flow(*lambda_high, 1.0);
-    cur_emd_cost = network->get_EMD_used();
-    cur_amp_sum = network->get_supported_amplitude_sum();
-
-    if (args.verbose) {
-      snprintf(output_buffer, kOutputBufferSize, "l: %e  EMD: %d  amp sum: %e"
-          "\n", *lambda_high, cur_emd_cost, cur_amp_sum);
-      args.output_function(output_buffer);
+    points.clear();
+    at_lambda_max.clear();
+    for (int ii = 0; ii < solver->get_num_networks(); ++ii) {
+      points.push_back(search_point(next_lambda));
+      at_lambda_max.push_back(next_at_lambda_max);
+      ++num_steps;
+      if (num_steps > max_steps && next_lambda < lambda_max
+          && lambda_max < numeric_limits<double>::infinity()) {
+        next_lambda = lambda_max;
+        next_at_lambda_max = true;
+      } else {
+        next_lambda = next_lambda * 2;
+        next_at_lambda_max = false;
+      }
     }
+    solve(&points, solver, result);
 
-    if (cur_emd_cost <= args.emd_bound_high) {
-      if (cur_emd_cost >= args.emd_bound_low) {
-        result->final_lambda_low = args.lambda_low;
-        result->final_lambda_high = *lambda_high;
-        result->emd_cost = cur_emd_cost;
-        result->amp_sum = cur_amp_sum;
-        network->get_support(result->support);
-        return true;
+    for (size_t ii = 0; ii < points.size(); ++ii) {
+      *high = points[ii];
+      if (args.verbose) {
+        output(args, "l: %e  EMD: %d  amp sum: "
+            "%e\n", high->lambda, high->emd_cost, high->amp_sum);
+      }
+
+      if (high->emd_cost <= args.emd_bound_high) {
+        solver->get_network(ii)->get_support(result->support);
+        // The solution for lambda_max has the smallest EMD cost, so it only
+        // serves as the upper end of the search.
+        if (high->emd_cost >= args.emd_bound_low && !at_lambda_max[ii]) {
+          result->final_lambda_low = args.lambda_low;
+          result->final_lambda_high = high->lambda;
+          result->emd_cost = high->emd_cost;
+          result->amp_sum = high->amp_sum;
+          return true;
+        } else {
+          return false;
+        }
       } else {
-        return false;
+        *low = *high;
+        *found_lambda_low = true;
       }
-    } else {
-      *lambda_high = *lambda_high * 2;
     }
   }
 }
@@ -249,72 +785,188 @@ bool increase_lambda(const emd_flow_args& args, emd_flow_result* result,
 // Decrease lambda until we find a lambda such that the EMD cost is larger
 // than the upper EMD bound. If we find a feasible solution during the process,
 // we return true. Otherwise we return false.
-bool decrease_lambda(const emd_flow_args& args, double current_lambda_high,
-    emd_flow_result* result, EMDFlowNetwork* network, double* lambda_low) {
+bool decrease_lambda(const emd_flow_args& args, double lambda_min,
+    emd_flow_result* result, EMDFlowParallelSolver* solver, search_point* low,
+    search_point* high) {
   if (args.verbose) {
-    snprintf(output_buffer, kOutputBufferSize,
-        "Finding small enough value of lambda ...\n");
-    args.output_function(output_buffer);
+    output(args, "Finding small enough value of lambda ...\n");
   }
 
   // Calculate the best approximation that satisfies only s-sparsity in
   // each column. This allows us to end early in case the EMD bounds are
   // larger than what we need for a perfect approximation.
-  *lambda_low = 0.0;
-  network->run_flow(*lambda_low, 1.0);
-  int cur_emd_cost = network->get_EMD_used();
-  double cur_amp_sum = network->get_supported_amplitude_sum();
+  EMDFlowNetwork* network = solver->get_network(0);
+  low->lambda = 0.0;
+  solve(low, network, result);
+  double max_amp_sum = low->amp_sum;
   if (args.verbose) {
-    snprintf(output_buffer, kOutputBufferSize, "l: %e  EMD: %d  amp sum: %e"
-        "\n", *lambda_low, cur_emd_cost, cur_amp_sum);
-    args.output_function(output_buffer);
+    output(args, "l: %e  EMD: %d  amp sum: %e"
+        "\n", low->lambda, low->emd_cost, low->amp_sum);
   }
 
   // In this case, the final EMD cost might be less than emd_bound_low.
   // But we are running with lambda=0, so we cannot use more EMD.
-  if (cur_emd_cost < args.emd_bound_high) {
+  if (low->emd_cost < args.emd_bound_high) {
     if (args.emd_bound_low < args.emd_bound_high
-        && cur_emd_cost < args.emd_bound_low) {
-      snprintf(output_buffer, kOutputBufferSize, "Found a solution with lambda "
+        && low->emd_cost < args.emd_bound_low) {
+      output(args, "Found a solution with lambda "
           "= 0, so the solution does not satisfy the lower EMD bound.");
-      args.output_function(output_buffer);
     }
 
-    result->final_lambda_low = *lambda_low;
-    result->final_lambda_high = current_lambda_high;
-    result->emd_cost = cur_emd_cost;
-    result->amp_sum = cur_amp_sum;
+    result->final_lambda_low = low->lambda;
+    result->final_lambda_high = high->lambda;
+    result->emd_cost = low->emd_cost;
+    result->amp_sum = low->amp_sum;
     network->get_support(result->support);
     return true;
   }
 
-  *lambda_low = args.lambda_low;
+  // Halve lambda a few times (see get_max_doubling_steps), then go to
+  // lambda_min directly. With several networks, the next lambdas of this
+  // sequence are tried in parallel.
+  int max_steps = get_max_doubling_steps(args);
+  int num_steps = 0;
+  double next_lambda = args.lambda_low;
+  vector<search_point> points;
   while (true) {
-    network->run_flow(*lambda_low, 1.0);
-    cur_emd_cost = network->get_EMD_used();
-    cur_amp_sum = network->get_supported_amplitude_sum();
-
-    if (args.verbose) {
-      snprintf(output_buffer, kOutputBufferSize, "l: %e  EMD: %d  amp sum: %e"
-          "\n", *lambda_low, cur_emd_cost, cur_amp_sum);
-      args.output_function(output_buffer);
+    points.clear();
+    for (int ii = 0; ii < solver->get_num_networks(); ++ii) {
+      points.push_back(search_point(next_lambda));
+      ++num_steps;
+      if (num_steps > max_steps && next_lambda > lambda_min) {
+        next_lambda = lambda_min;
+      } else {
+        next_lambda = next_lambda / 2;
+      }
     }
+    solve(&points, solver, result);
 
-    if (cur_emd_cost > args.emd_bound_high) {
-      break;
-    } else {
-      if (cur_emd_cost >= args.emd_bound_low) {
-        result->final_lambda_low = *lambda_low;
-        result->final_lambda_high = current_lambda_high;
-        result->emd_cost = cur_emd_cost;
-        result->amp_sum = cur_amp_sum;
-        network->get_support(result->support);
+    for (size_t ii = 0; ii < points.size(); ++ii) {
+      *low = points[ii];
+      if (args.verbose) {
+        output(args, "l: %e  EMD: %d  amp sum: "
+            "%e\n", low->lambda, low->emd_cost, low->amp_sum);
+      }
+
+      if (low->emd_cost > args.emd_bound_high) {
+        return false;
+      }
+      // If the solution has the largest amplitude sum, it is also the
+      // solution for all smaller lambdas, so we cannot use more EMD.
+      solver->get_network(ii)->get_support(result->support);
+      bool max_amp = (low->amp_sum >= max_amp_sum * (1.0 - 1e-12));
+      if (low->emd_cost >= args.emd_bound_low || max_amp) {
+        if (low->emd_cost < args.emd_bound_low) {
+          output(args, "Found a solution with "
+              "the largest amplitude sum, so the solution does not satisfy the "
+              "lower EMD bound.");
+        }
+        result->final_lambda_low = low->lambda;
+        result->final_lambda_high = high->lambda;
+        result->emd_cost = low->emd_cost;
+        result->amp_sum = low->amp_sum;
         return true;
       }
-      *lambda_low = *lambda_low / 2;
+      *high = *low;
     }
   }
-  return false;
+}
+
+// Bisection keeps the doubling steps so that it finds the same solutions as
+// earlier versions. The other policies narrow the bracket from the bounds
+// quickly, so a bad guess costs only one flow computation.
+int get_max_doubling_steps(const emd_flow_args& args) {
+  return (args.search_policy == kBisectionSearch ? kMaxDoublingSteps : 0);
+}
+
+double get_emd_cost_unit(const vector<double>& emd_costs) {
+  double max_emd_cost = 0.0;
+  for (size_t ii = 0; ii < emd_costs.size(); ++ii) {
+    max_emd_cost = max(max_emd_cost, emd_costs[ii]);
+  }
+  double tolerance = 1e-9 * max_emd_cost;
+  // Euclid's algorithm, where remainders up to the tolerance count as 0
+  double unit = 0.0;
+  for (size_t ii = 0; ii < emd_costs.size(); ++ii) {
+    double a = max(unit, emd_costs[ii]);
+    double b = min(unit, emd_costs[ii]);
+    while (b > tolerance) {
+      double remainder = fmod(a, b);
+      a = b;
+      b = (b - remainder <= tolerance ? 0.0 : remainder);
+    }
+    unit = a;
+  }
+  // A tiny unit would give a useless bound (and is most likely caused by
+  // costs that are not multiples of a common unit at all).
+  return (unit > 100.0 * tolerance ? unit : 0.0);
+}
+
+// The EMD cost of a solution is a sum of edge EMD costs. If all edge costs
+// are integer multiples of a unit u, the EMD costs of two different solutions
+// differ by a multiple of u, i.e., by 0 or at least u. The difference between
+// their amplitude sums is at most the largest amplitude sum A. So for lambda >
+// A / u, no increase of the amplitude sum can pay for more EMD. Similarly, if
+// the amplitude sums of two solutions differ by at least the smallest gap g
+// between amplitudes in the same column, lambda < g / E (where E is the
+// largest possible EMD cost) prefers the larger amplitude sum. This does not
+// hold for all instances because amplitude differences in several columns can
+// partially cancel, so lambda_min is only a guess.
+void compute_lambda_bounds(const emd_flow_args& args, double* lambda_min,
+    double* lambda_max) {
+  int r = args.x.get_num_rows();
+  int c = args.x.get_num_columns();
+  int num_paths = min(args.s, r);
+
+  vector<double> emd_costs = args.emd_costs;
+  if (emd_costs.size() == 0) {
+    int outdegree_vertical_distance = args.outdegree_vertical_distance;
+    if (outdegree_vertical_distance == -1) {
+      outdegree_vertical_distance = r - 1;
+    }
+    for (int ii = 0; ii <= outdegree_vertical_distance; ++ii) {
+      emd_costs.push_back(ii);
+    }
+  }
+  double max_emd_cost = 0.0;
+  for (size_t ii = 0; ii < emd_costs.size(); ++ii) {
+    max_emd_cost = max(max_emd_cost, emd_costs[ii]);
+  }
+
+  double max_amp_sum = 0.0;
+  double min_gap = numeric_limits<double>::infinity();
+  vector<double> column(r);
+  for (int col = 0; col < c; ++col) {
+    for (int row = 0; row < r; ++row) {
+      column[row] = abs(args.x(row, col));
+    }
+    sort(column.begin(), column.end());
+    for (int row = 0; row < r; ++row) {
+      if (row >= r - num_paths) {
+        max_amp_sum += column[row];
+      }
+      if (row > 0 && column[row] > column[row - 1]) {
+        min_gap = min(min_gap, column[row] - column[row - 1]);
+      }
+    }
+  }
+
+  if (max_amp_sum == 0.0) {
+    *lambda_max = 1.0;
+  } else if (max_emd_cost == 0.0) {
+    // All solutions have EMD cost 0.
+    *lambda_max = 2.0 * max_amp_sum;
+  } else {
+    double emd_cost_unit = get_emd_cost_unit(emd_costs);
+    *lambda_max = (emd_cost_unit > 0.0 ? 2.0 * max_amp_sum / emd_cost_unit
+                                       : numeric_limits<double>::infinity());
+  }
+  double max_emd = static_cast<double>(num_paths) * (c - 1) * max_emd_cost;
+  if (max_emd > 0.0 && min_gap < numeric_limits<double>::infinity()) {
+    *lambda_min = min(min_gap / (2.0 * max_emd), *lambda_max);
+  } else {
+    *lambda_min = *lambda_max;
+  }
 }
 
 void clear_result(emd_flow_result* result) {
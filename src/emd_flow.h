@@ -1,13 +1,39 @@
 #ifndef __EMD_FLOW_H__
 #define __EMD_FLOW_H__
 
+#include <cstddef>
+#include <memory>
+#include <string>
 #include <vector>
 
+#include "emd_flow_matrix.h"
+#include "emd_flow_network.h"
 #include "emd_flow_network_factory.h"
+#include "emd_flow_parallel.h"
+#include "emd_flow_parametric.h"
+
+// Strategy for choosing the next lambda in the search over lambda.
+enum emd_flow_search_policy {
+  // Bisect the current interval of lambdas.
+  kBisectionSearch,
+  // Choose the lambda for which the solutions at both ends of the interval
+  // are equally good. If the solution for this lambda is not better, no
+  // solution has an EMD cost between the two ends and the search stops.
+  kSecantSearch,
+  // Secant steps, but bisect after a secant step that did not halve the
+  // difference between the EMD costs at the two ends.
+  kHybridSearch,
+  kUnknownSearchPolicy
+};
+
+// Returns the policy for "bisection", "secant" or "hybrid" and
+// kUnknownSearchPolicy otherwise.
+emd_flow_search_policy parse_search_policy(const std::string& name);
 
 struct emd_flow_args {
-  // input amplitudes (will not be squared)
-  const std::vector<std::vector<double> >& x;
+  // input amplitudes (will not be squared). The entries are not copied, so
+  // they must stay valid while args is used.
+  AmplitudeMatrix x;
   // sparsity per column
   int s;
   // Bounds on the EMD budget. If we find a solution with EMD cost
@@ -32,12 +58,32 @@ struct emd_flow_args {
   std::vector<double> emd_costs;
   // The internal flow algorithm to use
   EMDFlowNetworkFactory::EMDFlowNetworkType alg_type;
-  // The output function
-  void (*output_function)(const char*);
+  // The output function. It receives each message and output_context.
+  void (*output_function)(const char*, void*);
+  // User data passed to output_function. Default: NULL.
+  void* output_context;
   // Verbose output?
   bool verbose; 
+  // Start each flow computation in the lambda search from the flow of the
+  // previous one (if supported by the flow algorithm). Default: false.
+  bool warm_start;
+  // Search the breakpoints of the EMD cost as a function of lambda instead
+  // of bisecting over lambda (see emd_flow_parametric.h). The lambda guesses
+  // and num_search_iterations are then ignored. Default: false.
+  bool parametric;
+  // How to choose lambda in the search over lambda (ignored with parametric
+  // search). The secant and hybrid policies also split wide intervals of
+  // lambdas geometrically. Default: kBisectionSearch.
+  emd_flow_search_policy search_policy;
+  // Number of lambdas tried at once in the search over lambda, each in its
+  // own thread and on its own copy of the flow network (so the memory grows
+  // by the same factor). EMDFlowSolver and EMDFlowBatchSolver keep the
+  // copies between calls. Ignored with parametric search. Default: 1.
+  int num_search_threads;
 
-  emd_flow_args(const std::vector<std::vector<double> >& x_): x(x_) { }
+  emd_flow_args(const AmplitudeMatrix& x_)
+      : x(x_), output_context(NULL), warm_start(false), parametric(false),
+        search_policy(kBisectionSearch), num_search_threads(1) { }
 };
 
 struct emd_flow_result {
@@ -47,13 +93,164 @@ struct emd_flow_result {
   int emd_cost;
   // Absolute amplitude sum of the solution
   double amp_sum;
-  // Final values of bounds on lambda
+  // Final values of bounds on lambda. With parametric search, the solution
+  // is optimal exactly for the lambdas in [final_lambda_low,
+  // final_lambda_high].
   double final_lambda_low;
   double final_lambda_high;
+  // Number of flow computations
+  int num_run_flow_calls;
+  // Wall-clock time of the computation in seconds
+  double total_time;
 };
 
 void emd_flow(
     const emd_flow_args& args,
     emd_flow_result* result);
 
+// Solves the instance args[ii] and stores the solution in *results[ii] (as in
+// emd_flow, results[ii]->support must be set) for all ii. The instances are
+// distributed over num_threads threads. Each thread keeps its flow network
+// and only updates the amplitudes if the next instance has the same size,
+// outdegree_vertical_distance, emd_costs and alg_type, so consecutive
+// instances of the same shape are cheaper. The output functions can be
+// called from several threads at once.
+void emd_flow_batch(
+    const std::vector<const emd_flow_args*>& args,
+    const std::vector<emd_flow_result*>& results,
+    int num_threads);
+
+// emd_flow_batch for a stream of batches (e.g., instances read in chunks).
+// The threads are started once in the constructor and joined in the
+// destructor, and the flow network of each thread is kept between solve
+// calls, so a stream of instances of the same shape builds each network only
+// once. The threads also run the lambdas of the parallel search over lambda
+// (see num_search_threads) when solve is called for a single instance.
+class EMDFlowBatchSolver {
+ public:
+  explicit EMDFlowBatchSolver(int num_threads);
+  ~EMDFlowBatchSolver();
+
+  // Solves the instances as emd_flow_batch does.
+  void solve(const std::vector<const emd_flow_args*>& args,
+             const std::vector<emd_flow_result*>& results);
+
+  // Solves a single instance with the network of the given worker (0 <=
+  // worker < num_threads). Calls for different workers can run in parallel,
+  // e.g., when the caller runs its own threads.
+  void solve(int worker, const emd_flow_args& args, emd_flow_result* result);
+
+  // Calls function(worker, context) once for each worker, each call in one of
+  // the threads of the solver (worker 0 in the calling thread). Returns after
+  // all calls have finished. For callers that feed solve(worker, ...)
+  // themselves, e.g., from a stream.
+  void run_workers(void (*function)(int, void*), void* context);
+
+ private:
+  int num_threads_;
+  EMDFlowThreadPool pool_;
+  // networks of the last instance of each thread (or NULL) and the arguments
+  // they were built for (only their shape is used, so the amplitudes need
+  // not be valid anymore)
+  std::vector<EMDFlowParallelSolver*> networks_;
+  std::vector<emd_flow_args> network_args_;
+  // arguments of the current solve call
+  const std::vector<const emd_flow_args*>* args_;
+  const std::vector<emd_flow_result*>* results_;
+
+  static void solve_task(int item, int worker, void* solver);
+
+  // no copying
+  EMDFlowBatchSolver(const EMDFlowBatchSolver&);
+  EMDFlowBatchSolver& operator=(const EMDFlowBatchSolver&);
+};
+
+// Solves a sequence of instances that differ only in the amplitudes, the
+// sparsity and the EMD bounds, e.g., the frames of a video. The flow network
+// (and its copies for num_search_threads > 1) is built once. For each new set
+// of amplitudes, only the node costs of the networks are updated (if the flow
+// algorithm supports it; otherwise the networks are rebuilt).
+class EMDFlowSolver {
+ public:
+  // Builds the network for args. All other options in args are used for the
+  // solve calls as well.
+  explicit EMDFlowSolver(const emd_flow_args& args);
+
+  // Sets the amplitudes for the next solve calls. x must have the same
+  // dimensions as args.x and its entries must stay valid while it is used.
+  // Returns false (and keeps the previous amplitudes) if the dimensions
+  // differ.
+  bool set_amplitudes(const AmplitudeMatrix& x);
+
+  void set_sparsity(int s) {
+    options_.s = s;
+  }
+
+  // Computes the solution for the current amplitudes with an EMD cost
+  // in [emd_bound_low, emd_bound_high] as emd_flow does.
+  void solve(int emd_bound_low, int emd_bound_high, emd_flow_result* result);
+
+  void solve(int emd_budget, emd_flow_result* result) {
+    solve(emd_budget, emd_budget, result);
+  }
+
+ private:
+  // options for emd_flow (options_.x holds the current amplitudes)
+  emd_flow_args options_;
+  // the network and its copies for the parallel search over lambda, and the
+  // threads that run the copies
+  std::auto_ptr<EMDFlowParallelSolver> networks_;
+  std::auto_ptr<EMDFlowThreadPool> pool_;
+
+  // no copying
+  EMDFlowSolver(const EMDFlowSolver&);
+  EMDFlowSolver& operator=(const EMDFlowSolver&);
+};
+
+struct emd_flow_frontier_result {
+  // Vertices of the upper convex hull of the achievable (EMD cost, amplitude
+  // sum) pairs in order of increasing EMD cost, together with the range of
+  // lambdas for which each vertex is optimal. For an EMD budget B, the best
+  // solution of the Lagrangian relaxation is the last point with
+  // emd_cost <= B.
+  std::vector<emd_flow_breakpoint> points;
+  // Flow network used for computing the supports on demand
+  std::auto_ptr<EMDFlowNetwork> network;
+};
+
+// Computes the full tradeoff curve between EMD cost and amplitude sum with
+// one graph construction. The EMD bounds, lambda guesses and
+// num_search_iterations in args are ignored. If the arguments are invalid,
+// result->points is empty.
+void emd_flow_frontier(
+    const emd_flow_args& args,
+    emd_flow_frontier_result* result);
+
+// Computes the support of result->points[index] with one flow computation.
+void emd_flow_frontier_support(
+    emd_flow_frontier_result* result,
+    int index,
+    std::vector<std::vector<bool> >* support);
+
+// Computes the optimal solutions of the Lagrangian relaxation with the given
+// lambda for all sparsities 1, ..., args.s with one flow computation:
+// (*steps)[k - 1] contains the EMD cost and amplitude sum of the solution for
+// sparsity k and the change of the support compared to sparsity k - 1. The
+// EMD bounds, lambda guesses, num_search_iterations and warm_start in args
+// are ignored. If the arguments are invalid or the flow algorithm does not
+// support the sweep, steps is empty.
+void emd_flow_sparsity_sweep(
+    const emd_flow_args& args,
+    double lambda,
+    std::vector<emd_flow_augmentation>* steps);
+
+// Computes the support for sparsity s from the steps of
+// emd_flow_sparsity_sweep.
+void emd_flow_sparsity_support(
+    const std::vector<emd_flow_augmentation>& steps,
+    int s,
+    int rows,
+    int cols,
+    std::vector<std::vector<bool> >* support);
+
 #endif
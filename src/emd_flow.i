@@ -1,17 +1,93 @@
 %module emd_flow
 %{
 #define SWIG_FILE_WITH_INIT
-#include "python_helpers.h"
 %}
 
 %include "numpy.i"
+%include "typemaps.i"
+
+%{
+#include "python_helpers.h"
+%}
 
 %init %{
 import_array();
 %}
 
+%exception {
+  try {
+    $action
+  } catch (const std::invalid_argument& e) {
+    SWIG_exception_fail(SWIG_ValueError, e.what());
+  }
+}
+
 %apply (double* IN_ARRAY1, int DIM1) {(const double* emd_costs, int num_emd_costs)};
 %apply (double* IN_ARRAY2, int DIM1, int DIM2) {(const double* data, int rows, int cols)};
 %apply (double* INPLACE_ARRAY2, int DIM1, int DIM2) {(double* support, int output_rows, int output_cols)}
 
+// emd_flow and emd_flow_batch read the amplitudes and write the support in
+// place, so the arrays can have any memory order but are not converted.
+%typemap(in) const AmplitudeMatrix& amplitudes (AmplitudeMatrix matrix) {
+  if (!get_amplitude_matrix($input, &matrix)) {
+    SWIG_exception_fail(SWIG_TypeError, "amplitudes have to be a "
+        "two-dimensional float64 or float32 array in native byte order.");
+  }
+  $1 = &matrix;
+}
+%typemap(in) const support_matrix& support (support_matrix matrix) {
+  if (!get_support_matrix($input, &matrix)) {
+    SWIG_exception_fail(SWIG_TypeError, "support has to be a writable "
+        "two-dimensional uint8 or bool array.");
+  }
+  $1 = &matrix;
+}
+%typemap(in) const std::vector<AmplitudeMatrix>& amplitudes
+    (std::vector<AmplitudeMatrix> matrices) {
+  if (!get_amplitude_stack($input, &matrices)) {
+    SWIG_exception_fail(SWIG_TypeError, "amplitudes have to be a "
+        "three-dimensional float64 or float32 array in native byte order.");
+  }
+  $1 = &matrices;
+}
+%typemap(in) const std::vector<support_matrix>& support
+    (std::vector<support_matrix> matrices) {
+  if (!get_support_stack($input, &matrices)) {
+    SWIG_exception_fail(SWIG_TypeError, "support has to be a writable "
+        "three-dimensional uint8 or bool array.");
+  }
+  $1 = &matrices;
+}
+%typemap(in) const std::vector<double>& emd_costs (std::vector<double> costs) {
+  if (!get_emd_costs($input, &costs)) {
+    SWIG_exception_fail(SWIG_TypeError, "emd_costs has to be a "
+        "one-dimensional array of numbers.");
+  }
+  $1 = &costs;
+}
+%apply int* OUTPUT {int* emd_cost};
+%apply double* OUTPUT {double* amp_sum, double* final_lambda_low,
+                       double* final_lambda_high};
+
+%ignore support_matrix;
+%ignore is_usable_array;
+%ignore is_amplitude_array;
+%ignore is_support_array;
+%ignore get_amplitude_view;
+%ignore get_support_view;
+%ignore get_amplitude_matrix;
+%ignore get_amplitude_stack;
+%ignore get_support_matrix;
+%ignore get_support_stack;
+%ignore get_emd_costs;
+%ignore get_emd_bounds;
+%ignore create_array;
+%ignore write_to_stdout;
+%ignore write_support;
+%ignore set_options;
+%feature("kwargs") solve_emd_flow;
+%feature("kwargs") solve_emd_flow_batch;
+%rename(emd_flow) solve_emd_flow;
+%rename(emd_flow_batch) solve_emd_flow_batch;
+
 %include "python_helpers.h"
@@ -0,0 +1,318 @@
+#include "emd_flow_io.h"
+
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace std;
+
+const char kNpyMagic[] = "\x93NUMPY";
+const size_t kNpyMagicLength = 6;
+const char kRawMagic[] = "EMDF";
+const char kPackedMagic[] = "EMDS";
+const size_t kRawHeaderLength = 16;
+
+bool is_little_endian() {
+  uint16_t one = 1;
+  return *reinterpret_cast<unsigned char*>(&one) == 1;
+}
+
+uint32_t read_uint32(const unsigned char* data) {
+  return data[0] | (data[1] << 8) | (data[2] << 16)
+      | (static_cast<uint32_t>(data[3]) << 24);
+}
+
+void write_uint32(uint32_t value, FILE* file) {
+  unsigned char bytes[4];
+  for (int ii = 0; ii < 4; ++ii) {
+    bytes[ii] = (value >> (8 * ii)) & 0xff;
+  }
+  fwrite(bytes, 1, 4, file);
+}
+
+// Returns the value of key in the header dictionary of a .npy file (the text
+// between "'key':" and the next comma at bracket depth 0).
+string get_npy_header_value(const string& header, const string& key) {
+  size_t pos = header.find("'" + key + "'");
+  if (pos == string::npos) {
+    return "";
+  }
+  pos = header.find(':', pos);
+  if (pos == string::npos) {
+    return "";
+  }
+  int depth = 0;
+  size_t end = pos + 1;
+  for (; end < header.size(); ++end) {
+    if (header[end] == '(') {
+      ++depth;
+    } else if (header[end] == ')') {
+      --depth;
+    } else if ((header[end] == ',' && depth == 0) || header[end] == '}') {
+      break;
+    }
+  }
+  size_t begin = header.find_first_not_of(" ", pos + 1);
+  if (begin == string::npos || begin >= end) {
+    return "";
+  }
+  return header.substr(begin, header.find_last_not_of(" ", end - 1) - begin
+                              + 1);
+}
+
+AmplitudeFile::AmplitudeFile() : data_(NULL), size_(0) { }
+
+AmplitudeFile::~AmplitudeFile() {
+  close();
+}
+
+void AmplitudeFile::close() {
+  if (data_ != NULL) {
+    munmap(data_, size_);
+  }
+  data_ = NULL;
+  size_ = 0;
+  matrix_ = AmplitudeMatrix();
+}
+
+bool AmplitudeFile::open(const string& name, string* error) {
+  close();
+  if (!is_little_endian()) {
+    *error = "binary input is only supported on little-endian machines";
+    return false;
+  }
+  int fd = ::open(name.c_str(), O_RDONLY);
+  if (fd == -1) {
+    *error = "cannot open " + name;
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+    ::close(fd);
+    *error = "cannot read " + name;
+    return false;
+  }
+  size_ = file_stat.st_size;
+  data_ = mmap(NULL, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data_ == MAP_FAILED) {
+    data_ = NULL;
+    size_ = 0;
+    *error = "cannot map " + name;
+    return false;
+  }
+
+  bool success;
+  if (size_ >= kNpyMagicLength
+      && memcmp(data_, kNpyMagic, kNpyMagicLength) == 0) {
+    success = parse_npy(error);
+  } else if (size_ >= kRawHeaderLength && memcmp(data_, kRawMagic, 4) == 0) {
+    success = parse_raw(error);
+  } else {
+    *error = name + " is neither a .npy file nor a raw amplitude file";
+    success = false;
+  }
+  if (!success) {
+    close();
+  }
+  return success;
+}
+
+bool AmplitudeFile::parse_npy(string* error) {
+  const unsigned char* data = static_cast<const unsigned char*>(data_);
+  // magic, version (2 bytes), header length (2 bytes in version 1, 4 bytes
+  // afterwards)
+  size_t header_begin = (data[6] == 1 ? 10 : 12);
+  if (size_ < header_begin) {
+    *error = "truncated .npy header";
+    return false;
+  }
+  size_t header_length = (data[6] == 1 ? data[8] | (data[9] << 8)
+                                       : read_uint32(data + 8));
+  if (size_ < header_begin + header_length) {
+    *error = "truncated .npy header";
+    return false;
+  }
+  string header(reinterpret_cast<const char*>(data) + header_begin,
+                header_length);
+
+  string descr = get_npy_header_value(header, "descr");
+  int element_size;
+  if (descr == "'<f8'") {
+    element_size = 8;
+  } else if (descr == "'<f4'") {
+    element_size = 4;
+  } else {
+    *error = "unsupported .npy element type " + descr
+        + " (expected little-endian float64 or float32)";
+    return false;
+  }
+
+  string fortran_order = get_npy_header_value(header, "fortran_order");
+  if (fortran_order != "True" && fortran_order != "False") {
+    *error = "invalid fortran_order in .npy header";
+    return false;
+  }
+
+  string shape = get_npy_header_value(header, "shape");
+  long long rows = 0;
+  long long cols = 0;
+  char end = 0;
+  if (sscanf(shape.c_str(), "(%lld ,%lld %c", &rows, &cols, &end) != 3
+      || end != ')') {
+    *error = "the .npy file does not contain a two-dimensional array";
+    return false;
+  }
+  return set_matrix(header_begin + header_length, element_size, rows, cols,
+                    fortran_order == "True", error);
+}
+
+bool AmplitudeFile::parse_raw(string* error) {
+  const unsigned char* data = static_cast<const unsigned char*>(data_);
+  uint32_t element_size = read_uint32(data + 4);
+  if (element_size != 8 && element_size != 4) {
+    *error = "unsupported element size in raw amplitude file";
+    return false;
+  }
+  return set_matrix(kRawHeaderLength, element_size, read_uint32(data + 8),
+                    read_uint32(data + 12), false, error);
+}
+
+bool AmplitudeFile::set_matrix(size_t offset, int element_size,
+    long long rows, long long cols, bool fortran_order, string* error) {
+  if (rows <= 0 || cols <= 0) {
+    *error = "the amplitude matrix is empty";
+    return false;
+  }
+  if (rows > INT_MAX || cols > INT_MAX) {
+    *error = "the amplitude matrix has more than INT_MAX rows or columns";
+    return false;
+  }
+  // rows * cols * element_size must fit into size_t before it is compared
+  // with the file size.
+  if (static_cast<size_t>(cols) > numeric_limits<size_t>::max()
+                                  / element_size / static_cast<size_t>(rows)) {
+    *error = "the amplitude matrix is too large";
+    return false;
+  }
+  size_t matrix_size = static_cast<size_t>(rows) * cols * element_size;
+  if (size_ < offset || size_ - offset < matrix_size) {
+    *error = "the file is shorter than the amplitude matrix";
+    return false;
+  }
+  if (offset % element_size != 0) {
+    *error = "the amplitudes are not aligned in the file";
+    return false;
+  }
+  ptrdiff_t row_stride = (fortran_order ? 1 : cols);
+  ptrdiff_t col_stride = (fortran_order ? rows : 1);
+  int num_rows = rows;
+  int num_cols = cols;
+  const char* entries = static_cast<const char*>(data_) + offset;
+  if (element_size == 8) {
+    matrix_ = AmplitudeMatrix(reinterpret_cast<const double*>(entries),
+                              num_rows, num_cols, row_stride, col_stride);
+  } else {
+    matrix_ = AmplitudeMatrix(reinterpret_cast<const float*>(entries),
+                              num_rows, num_cols, row_stride, col_stride);
+  }
+  return true;
+}
+
+bool write_support_text(const string& name,
+    const vector<vector<bool> >& support) {
+  FILE* file = fopen(name.c_str(), "w");
+  if (file == NULL) {
+    return false;
+  }
+  write_support_text(support, file);
+  return fclose(file) == 0;
+}
+
+void write_support_text(const vector<vector<bool> >& support, FILE* file) {
+  string line;
+  for (size_t ii = 0; ii < support.size(); ++ii) {
+    line.clear();
+    for (size_t jj = 0; jj < support[ii].size(); ++jj) {
+      line += (support[ii][jj] ? "1 " : "0 ");
+    }
+    line += '\n';
+    fwrite(line.data(), 1, line.size(), file);
+  }
+}
+
+bool write_support_npy(const string& name,
+    const vector<vector<bool> >& support) {
+  FILE* file = fopen(name.c_str(), "wb");
+  if (file == NULL) {
+    return false;
+  }
+  size_t rows = support.size();
+  size_t cols = (rows > 0 ? support[0].size() : 0);
+  char shape[100];
+  snprintf(shape, sizeof(shape), "(%lu, %lu)",
+      static_cast<unsigned long>(rows), static_cast<unsigned long>(cols));
+  string header = string("{'descr': '|b1', 'fortran_order': False, "
+      "'shape': ") + shape + ", }";
+  // The magic, version, header length and header are padded to a multiple
+  // of 64 bytes, and the header ends with a newline.
+  size_t total_length = kNpyMagicLength + 4 + header.size() + 1;
+  header.append((64 - total_length % 64) % 64, ' ');
+  header += '\n';
+  fwrite(kNpyMagic, 1, kNpyMagicLength, file);
+  unsigned char version_and_length[4] = {1, 0,
+      static_cast<unsigned char>(header.size() & 0xff),
+      static_cast<unsigned char>(header.size() >> 8)};
+  fwrite(version_and_length, 1, 4, file);
+  fwrite(header.data(), 1, header.size(), file);
+
+  vector<unsigned char> row(cols);
+  for (size_t ii = 0; ii < rows; ++ii) {
+    for (size_t jj = 0; jj < cols; ++jj) {
+      row[jj] = support[ii][jj];
+    }
+    if (cols > 0) {
+      fwrite(&row[0], 1, cols, file);
+    }
+  }
+  return fclose(file) == 0;
+}
+
+bool write_support_packed(const string& name,
+    const vector<vector<bool> >& support) {
+  FILE* file = fopen(name.c_str(), "wb");
+  if (file == NULL) {
+    return false;
+  }
+  write_support_packed(support, file);
+  return fclose(file) == 0;
+}
+
+void write_support_packed(const vector<vector<bool> >& support, FILE* file) {
+  size_t rows = support.size();
+  size_t cols = (rows > 0 ? support[0].size() : 0);
+  fwrite(kPackedMagic, 1, 4, file);
+  write_uint32(rows, file);
+  write_uint32(cols, file);
+
+  vector<unsigned char> bits((rows * cols + 7) / 8, 0);
+  size_t index = 0;
+  for (size_t ii = 0; ii < rows; ++ii) {
+    for (size_t jj = 0; jj < cols; ++jj, ++index) {
+      if (support[ii][jj]) {
+        bits[index / 8] |= 0x80 >> (index % 8);
+      }
+    }
+  }
+  if (!bits.empty()) {
+    fwrite(&bits[0], 1, bits.size(), file);
+  }
+}
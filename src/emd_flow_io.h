@@ -0,0 +1,74 @@
+#ifndef __EMD_FLOW_IO_H__
+#define __EMD_FLOW_IO_H__
+
+#include <cstddef>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "emd_flow_matrix.h"
+
+// Amplitude matrix in a binary file. The file is memory-mapped, so the
+// entries are not parsed or copied. Supported formats (little-endian data
+// only):
+// - .npy files with a two-dimensional float64 or float32 array in C or
+//   Fortran order.
+// - raw files: the 4 bytes "EMDF", then the element size (8 for float64 or
+//   4 for float32), the number of rows and the number of columns as 32-bit
+//   unsigned integers, followed by the entries in row-major order.
+class AmplitudeFile {
+ public:
+  AmplitudeFile();
+  ~AmplitudeFile();
+
+  // Maps the file with the given name. Returns false and sets *error if the
+  // file cannot be read or has an unsupported format.
+  bool open(const std::string& name, std::string* error);
+
+  // Valid until the object is destroyed or open is called again.
+  const AmplitudeMatrix& get_matrix() const {
+    return matrix_;
+  }
+
+ private:
+  void* data_;
+  size_t size_;
+  AmplitudeMatrix matrix_;
+
+  void close();
+  bool parse_npy(std::string* error);
+  bool parse_raw(std::string* error);
+  // Sets matrix_ to the entries starting offset bytes into the file. The
+  // dimensions come from the file header and are checked here.
+  bool set_matrix(size_t offset, int element_size, long long rows,
+      long long cols, bool fortran_order, std::string* error);
+
+  // no copying
+  AmplitudeFile(const AmplitudeFile&);
+  AmplitudeFile& operator=(const AmplitudeFile&);
+};
+
+// Writes the support matrix as text, one row per line with "0 " or "1 " for
+// each entry.
+bool write_support_text(const std::string& name,
+    const std::vector<std::vector<bool> >& support);
+void write_support_text(const std::vector<std::vector<bool> >& support,
+    FILE* file);
+
+// Writes the support matrix as a .npy file with a two-dimensional bool array
+// (one byte per entry, C order).
+bool write_support_npy(const std::string& name,
+    const std::vector<std::vector<bool> >& support);
+
+// Writes the support matrix bit-packed: the 4 bytes "EMDS", the number of
+// rows and the number of columns as 32-bit little-endian unsigned integers,
+// followed by the entries in row-major order with eight entries per byte
+// (the first entry in the most significant bit, as numpy.packbits does). The
+// last byte is padded with zeros. Each matrix starts with its own header, so
+// several matrices can be written to the same file.
+bool write_support_packed(const std::string& name,
+    const std::vector<std::vector<bool> >& support);
+void write_support_packed(const std::vector<std::vector<bool> >& support,
+    FILE* file);
+
+#endif
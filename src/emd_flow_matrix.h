@@ -0,0 +1,76 @@
+#ifndef __EMD_FLOW_MATRIX_H__
+#define __EMD_FLOW_MATRIX_H__
+
+#include <cstddef>
+#include <vector>
+
+// Read-only view of an amplitude matrix. The view does not copy the entries,
+// so the underlying data must stay valid while the view is used.
+// For a strided view, entry (row, col) is data[row * row_stride +
+// col * col_stride] (strides are given in elements). So a row-major array
+// (e.g., numpy) has strides (cols, 1) and a column-major array (e.g.,
+// MATLAB) has strides (1, rows).
+class AmplitudeMatrix {
+ public:
+  // empty matrix
+  AmplitudeMatrix()
+      : type_(kDouble), rows_(0), cols_(0), row_stride_(0), col_stride_(0),
+        double_data_(NULL), float_data_(NULL), nested_data_(NULL) { }
+
+  // Not explicit, so nested vectors can be passed wherever an amplitude
+  // matrix is expected. All rows must have the same length.
+  AmplitudeMatrix(const std::vector<std::vector<double> >& data)
+      : type_(kNested), rows_(data.size()),
+        cols_(data.empty() ? 0 : data[0].size()), row_stride_(0),
+        col_stride_(0), double_data_(NULL), float_data_(NULL),
+        nested_data_(&data) { }
+
+  AmplitudeMatrix(const double* data, int rows, int cols,
+                  std::ptrdiff_t row_stride, std::ptrdiff_t col_stride)
+      : type_(kDouble), rows_(rows), cols_(cols), row_stride_(row_stride),
+        col_stride_(col_stride), double_data_(data), float_data_(NULL),
+        nested_data_(NULL) { }
+
+  AmplitudeMatrix(const float* data, int rows, int cols,
+                  std::ptrdiff_t row_stride, std::ptrdiff_t col_stride)
+      : type_(kFloat), rows_(rows), cols_(cols), row_stride_(row_stride),
+        col_stride_(col_stride), double_data_(NULL), float_data_(data),
+        nested_data_(NULL) { }
+
+  int get_num_rows() const {
+    return rows_;
+  }
+
+  int get_num_columns() const {
+    return cols_;
+  }
+
+  double operator()(int row, int col) const {
+    switch (type_) {
+      case kDouble:
+        return double_data_[row * row_stride_ + col * col_stride_];
+      case kFloat:
+        return float_data_[row * row_stride_ + col * col_stride_];
+      default:
+        return (*nested_data_)[row][col];
+    }
+  }
+
+ private:
+  enum ElementType {
+    kDouble,
+    kFloat,
+    kNested
+  };
+
+  ElementType type_;
+  int rows_;
+  int cols_;
+  std::ptrdiff_t row_stride_;
+  std::ptrdiff_t col_stride_;
+  const double* double_data_;
+  const float* float_data_;
+  const std::vector<std::vector<double> >* nested_data_;
+};
+
+#endif
@@ -3,12 +3,33 @@
 
 #include <vector>
 #include <string>
+#include <utility>
+
+#include "emd_flow_matrix.h"
+
+// Change of the flow caused by one augmenting path in run_flow (see
+// EMDFlowNetwork::set_record_augmentations).
+struct emd_flow_augmentation {
+  // EMD cost and amplitude sum of the flow after the augmentation
+  int emd_cost;
+  double amp_sum;
+  // Entries (row, column) entering and leaving the support. An augmenting
+  // path can reroute earlier paths, so entries can also leave the support.
+  std::vector<std::pair<int, int> > added;
+  std::vector<std::pair<int, int> > removed;
+};
 
 class EMDFlowNetwork {
  public:
   EMDFlowNetwork() { }
   // sparsity per column
   virtual void set_sparsity(int s) = 0;
+  // Replaces the amplitudes by a matrix of the same size and keeps the rest
+  // of the graph. Returns false (and changes nothing) if the network does
+  // not support this.
+  virtual bool set_amplitudes(const AmplitudeMatrix& /*amplitudes*/) {
+    return false;
+  }
   virtual void run_flow(double EMD_lambda, double signal_lambda) = 0;
   virtual int get_EMD_used() = 0;
   virtual double get_supported_amplitude_sum() = 0;
@@ -18,6 +39,20 @@ class EMDFlowNetwork {
   virtual int get_num_columns() = 0;
   virtual int get_num_rows() = 0;
   virtual void get_performance_diagnostics(std::string* s) { *s = "";}
+  // If enabled, run_flow may start from the optimal flow of the previous call
+  // (with the same sparsity) instead of computing a flow from scratch.
+  virtual void set_warm_start(bool /*warm_start*/) { }
+  // If enabled, run_flow records the change of the flow after each augmenting
+  // path. The flow after k augmentations is optimal for sparsity k, so one
+  // run_flow call gives the solutions for all sparsities up to the current
+  // one. Recording disables warm starts.
+  virtual void set_record_augmentations(bool /*record*/) { }
+  // Augmentations of the last run_flow call. Returns false if the network
+  // does not record augmentations.
+  virtual bool get_augmentations(
+      std::vector<emd_flow_augmentation>* /*augmentations*/) {
+    return false;
+  }
   virtual ~EMDFlowNetwork() { }
 };
 
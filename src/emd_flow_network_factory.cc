@@ -14,8 +14,25 @@
 
 using namespace std;
 
+// Uses 32-bit node and edge indices if the graph is small enough.
+template <template <typename> class Queue>
+auto_ptr<EMDFlowNetwork> create_SAP_network(
+    const AmplitudeMatrix& amplitudes,
+    int outdegree_vertical_distance,
+    const std::vector<double>& emd_costs) {
+  if (EMDFlowNetworkSAP<uint32_t>::index_type_suffices(
+      amplitudes.get_num_rows(), amplitudes.get_num_columns(),
+      outdegree_vertical_distance, emd_costs)) {
+    return auto_ptr<EMDFlowNetwork>(new EMDFlowNetworkSAP<uint32_t, Queue>(
+        amplitudes, outdegree_vertical_distance, emd_costs));
+  } else {
+    return auto_ptr<EMDFlowNetwork>(new EMDFlowNetworkSAP<uint64_t, Queue>(
+        amplitudes, outdegree_vertical_distance, emd_costs));
+  }
+}
+
 auto_ptr<EMDFlowNetwork> EMDFlowNetworkFactory::create_EMD_flow_network(
-        const vector<vector<double> >& amplitudes,
+        const AmplitudeMatrix& amplitudes,
         int outdegree_vertical_distance,
         const std::vector<double>& emd_costs,
         EMDFlowNetworkType type) {
@@ -36,8 +53,14 @@ auto_ptr<EMDFlowNetwork> EMDFlowNetworkFactory::create_EMD_flow_network(
   #endif
 
   if (type == kShortestAugmentingPath) {
-    return auto_ptr<EMDFlowNetwork>(new EMDFlowNetworkSAP(amplitudes,
-        outdegree_vertical_distance, emd_costs));
+    return create_SAP_network<LazyBinaryHeap>(amplitudes,
+        outdegree_vertical_distance, emd_costs);
+  } else if (type == kShortestAugmentingPathFourAryHeap) {
+    return create_SAP_network<IndexedFourAryHeap>(amplitudes,
+        outdegree_vertical_distance, emd_costs);
+  } else if (type == kShortestAugmentingPathRadixHeap) {
+    return create_SAP_network<RadixHeap>(amplitudes,
+        outdegree_vertical_distance, emd_costs);
   } else {
     return auto_ptr<EMDFlowNetwork>();
   }
@@ -53,6 +76,10 @@ EMDFlowNetworkFactory::EMDFlowNetworkType EMDFlowNetworkFactory::parse_type(
     return kLemonCapacityScaling;
   } else if (name == "sap" || name == "shortest-augmenting-path") {
     return kShortestAugmentingPath;
+  } else if (name == "sap-4ary-heap") {
+    return kShortestAugmentingPathFourAryHeap;
+  } else if (name == "sap-radix-heap") {
+    return kShortestAugmentingPathRadixHeap;
   } else {
     return kUnknownType;
   }
@@ -1,6 +1,7 @@
 #ifndef __EMD_FLOW_NETWORK_FACTORY_H__
 #define __EMD_FLOW_NETWORK_FACTORY_H__
 
+#include "emd_flow_matrix.h"
 #include "emd_flow_network.h"
 
 #include <string>
@@ -13,11 +14,14 @@ class EMDFlowNetworkFactory {
     kLemonNetworkSimplex,
     kLemonCapacityScaling,
     kShortestAugmentingPath,
+    // shortest augmenting path with a different priority queue in Dijkstra
+    kShortestAugmentingPathFourAryHeap,
+    kShortestAugmentingPathRadixHeap,
     kUnknownType
   };
 
   static std::auto_ptr<EMDFlowNetwork> create_EMD_flow_network(
-      const std::vector<std::vector<double> >& amplitudes,
+      const AmplitudeMatrix& amplitudes,
       int outdegree_vertical_distance,
       const std::vector<double>& emd_costs,
       EMDFlowNetworkType type);
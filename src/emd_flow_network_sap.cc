@@ -4,357 +4,850 @@
 #include <cstdio>
 #include <algorithm>
 #include <limits>
-#include <queue>
 #include <map>
 
 using namespace std;
 
-EMDFlowNetworkSAP::EMDFlowNetworkSAP(
-    const std::vector<std::vector<double> >& amplitudes,
+// Appends value to *v and counts a reallocation of v in *num_allocations.
+template <typename T>
+void push_back_counted(const T& value, vector<T>* v,
+    long long* num_allocations) {
+  size_t old_capacity = v->capacity();
+  v->push_back(value);
+  if (v->capacity() != old_capacity) {
+    ++*num_allocations;
+  }
+}
+
+template <typename IndexType, template <typename> class Queue>
+const double EMDFlowNetworkSAP<IndexType, Queue>::kRepairTolerance = 1e-10;
+
+template <typename IndexType, template <typename> class Queue>
+EMDFlowNetworkSAP<IndexType, Queue>::EMDFlowNetworkSAP(
+    const AmplitudeMatrix& amplitudes,
     int outdegree_vertical_distance,
     const vector<double>& emd_costs)
-      : a_(amplitudes),
-        outdegree_vertical_distance_(outdegree_vertical_distance),
+      : outdegree_vertical_distance_(outdegree_vertical_distance),
         emd_costs_(emd_costs),
         total_inner_iterations(0),
         checking_inner_iterations(0),
-        updating_inner_iterations(0) {
-  r_ = amplitudes.size();
-  c_ = amplitudes[0].size();
-
-  a_.resize(r_);
+        updating_inner_iterations(0),
+        nodes_not_settled(0),
+        run_flow_calls(0),
+        warm_starts(0),
+        warm_start_fallbacks(0),
+        cancelled_cycles(0),
+        repair_edge_scans(0),
+        workspace_allocations(0) {
+  r_ = amplitudes.get_num_rows();
+  c_ = amplitudes.get_num_columns();
+  a_.resize(r_ * c_);
   for (int row = 0; row < r_; ++row) {
-    a_[row].resize(c_);
     for (int col = 0; col < c_; ++col) {
-      a_[row][col] = amplitudes[row][col];
+      a_[row * c_ + col] = abs(amplitudes(row, col));
     }
   }
 
+  use_chain_ = (outdegree_vertical_distance_ >= r_ - 1)
+      && emd_costs_are_affine(emd_costs_, &chain_offset_, &chain_step_);
+  emd_costs_convex_ = emd_costs_are_convex(emd_costs_);
+  emd_lambda_ = 0.0;
+  signal_lambda_ = 1.0;
+  envelope_source_.resize(r_);
+  envelope_start_.resize(r_);
+
   // source and sink
   s_ = 0;
   t_ = 1;
 
   // potentials
   int num_nodes = 2 + 2 * r_ * c_;
-  outgoing_edges_.resize(num_nodes);
-  potential_.resize(outgoing_edges_.size());
+  if (use_chain_) {
+    num_nodes += r_ * (c_ - 1);
+  }
+  potential_.resize(num_nodes);
+
+  // The adjacency structure is stored in compressed sparse row format. First
+  // count the edges leaving each node, then place every edge into its node's
+  // range.
+  first_edge_.assign(num_nodes + 1, 0);
+  num_edge_pairs_ = 0;
+  add_all_edges();
+  for (int ii = 0; ii < num_nodes; ++ii) {
+    first_edge_[ii + 1] += first_edge_[ii];
+  }
+  out_.resize(first_edge_[num_nodes], OutgoingEdge(0, 0));
+  cost_.resize(num_edge_pairs_);
+  next_edge_ = first_edge_;
+  num_edge_pairs_ = 0;
+  add_all_edges();
+  vector<EdgeIndex>().swap(next_edge_);
+
+  flow_.resize(first_chain_pair_);
+  chain_flow_.resize(num_edge_pairs_ - first_chain_pair_);
+
+  dst_.resize(num_nodes, numeric_limits<double>::infinity());
+  visited_.resize(num_nodes, false);
+  edge_taken_to_.resize(num_nodes);
+  previous_node_.resize(num_nodes);
+  // every node is touched at most once per search
+  touched_nodes_.reserve(num_nodes);
+  queue_.reset(num_nodes);
+  // Each round of the warm start queues a node at most once (cancelled
+  // cycles can add nodes beyond that, which is rare).
+  repair_queue_.reserve(num_nodes);
+  next_repair_queue_.reserve(num_nodes);
+  potential_emd_.resize(num_nodes);
+  dst_emd_.resize(num_nodes);
+  walk_stamp_.resize(num_nodes, 0);
+  current_stamp_ = 0;
+
+  warm_start_ = false;
+  has_optimal_flow_ = false;
+  record_augmentations_ = false;
+
+  set_sparsity(0);
+}
 
+template <typename IndexType, template <typename> class Queue>
+void EMDFlowNetworkSAP<IndexType, Queue>::add_all_edges() {
   // add arcs from source to column 1
   for (int ii = 0; ii < r_; ++ii) {
-    EdgeIndex next_edge_index = e_.size();
-    Edge forward(innode_index(ii, 0), 1, 0.0, next_edge_index + 1);
-    Edge backward(s_, 0, 0.0, next_edge_index);
-    e_.push_back(forward);
-    e_.push_back(backward);
-    outgoing_edges_[s_].push_back(next_edge_index);
-    outgoing_edges_[innode_index(ii, 0)].push_back(next_edge_index + 1);
+    add_edge(s_, innode_index(ii, 0), 0.0);
   }
 
   // add arcs from column c to sink
   for (int ii = 0; ii < r_; ++ii) {
-    EdgeIndex next_edge_index = e_.size();
-    Edge forward(t_, 1, 0.0, next_edge_index + 1);
-    Edge backward(outnode_index(ii, c_ - 1), 0, 0.0, next_edge_index);
-    e_.push_back(forward);
-    e_.push_back(backward);
-    outgoing_edges_[outnode_index(ii, c_ - 1)].push_back(next_edge_index);
-    outgoing_edges_[t_].push_back(next_edge_index + 1);
+    add_edge(outnode_index(ii, c_ - 1), t_, 0.0);
   }
 
   // add arcs from innodes to outnodes
+  first_node_pair_ = num_edge_pairs_;
   node_edges_.resize(r_);
   for (int ii = 0; ii < r_; ++ii) {
     node_edges_[ii].resize(c_);
     for (int jj = 0; jj < c_; ++jj) {
-      EdgeIndex next_edge_index = e_.size();
-      Edge forward(outnode_index(ii, jj), 1, -abs(a_[ii][jj]),
-          next_edge_index + 1);
-      Edge backward(innode_index(ii, jj), 0, abs(a_[ii][jj]),
-          next_edge_index);
-      e_.push_back(forward);
-      e_.push_back(backward);
-      node_edges_[ii][jj] = next_edge_index;
-      outgoing_edges_[innode_index(ii, jj)].push_back(next_edge_index);
-      outgoing_edges_[outnode_index(ii, jj)].push_back(next_edge_index + 1);
+      node_edges_[ii][jj] = add_edge(innode_index(ii, jj),
+          outnode_index(ii, jj), -a_[ii * c_ + jj]);
     }
   }
 
   // add arcs between columns
+  first_emd_pair_ = num_edge_pairs_;
   emd_edges_.resize(r_);
-  for (int row = 0; row < r_; ++row) {
-    emd_edges_[row].resize(c_ - 1);
-    for (int col = 0; col < c_ - 1; ++col) {
-      size_t ndest = num_destinations(row);
-      int first_dest = first_destination(row);
-      emd_edges_[row][col].resize(ndest);
-      for (size_t idest = 0; idest < ndest; ++idest) {
-        EdgeIndex next_edge_index = e_.size();
-        Edge forward(innode_index(first_dest + idest, col + 1), 1, 0.0,
-            next_edge_index + 1);
-        Edge backward(outnode_index(row, col), 0, 0.0, next_edge_index);
-        e_.push_back(forward);
-        e_.push_back(backward);
-        emd_edges_[row][col][idest] = next_edge_index;
-        outgoing_edges_[outnode_index(row, col)].push_back(next_edge_index);
-        outgoing_edges_[innode_index(first_dest + idest, col + 1)].push_back(
-            next_edge_index + 1);
+  if (use_chain_) {
+    chain_exit_edges_.resize(r_);
+    for (int row = 0; row < r_; ++row) {
+      emd_edges_[row].resize(c_ - 1);
+      chain_exit_edges_[row].resize(c_ - 1);
+      for (int col = 0; col < c_ - 1; ++col) {
+        emd_edges_[row][col] = add_edge(outnode_index(row, col),
+            chainnode_index(row, col), chain_offset_);
+        chain_exit_edges_[row][col] = add_edge(chainnode_index(row, col),
+            innode_index(row, col + 1), 0.0);
       }
     }
-  }
-
-  set_sparsity(0);
-}
 
-void EMDFlowNetworkSAP::print_full_graph() {
-  printf("Node indices:\n");
-  printf("  Source: %lu, sink: %lu\n", s_, t_);
-  for (int col = 0; col < c_; ++col) {
+    // Each unit of flow passes through at most one chain edge per row, so
+    // these edges do not need a capacity.
+    first_chain_pair_ = num_edge_pairs_;
+    chain_down_edges_.resize(c_ - 1);
+    chain_up_edges_.resize(c_ - 1);
+    for (int col = 0; col < c_ - 1; ++col) {
+      chain_down_edges_[col].resize(r_ - 1);
+      chain_up_edges_[col].resize(r_ - 1);
+      for (int row = 0; row < r_ - 1; ++row) {
+        chain_down_edges_[col][row] = add_edge(chainnode_index(row, col),
+            chainnode_index(row + 1, col), chain_step_);
+        chain_up_edges_[col][row] = add_edge(chainnode_index(row + 1, col),
+            chainnode_index(row, col), chain_step_);
+      }
+    }
+  } else {
     for (int row = 0; row < r_; ++row) {
-      printf("  Entry %d,%d: innode: %lu, outnode: %lu\n", row, col,
-          innode_index(row, col), outnode_index(row, col));
+      emd_edges_[row].resize(c_ - 1);
+      for (int col = 0; col < c_ - 1; ++col) {
+        size_t ndest = num_destinations(row);
+        int first_dest = first_destination(row);
+        // The edges leaving an outnode are added consecutively, so the edge
+        // to destination idest is emd_edges_[row][col] + 2 * idest.
+        for (size_t idest = 0; idest < ndest; ++idest) {
+          EdgeIndex cur = add_edge(outnode_index(row, col),
+              innode_index(first_dest + idest, col + 1),
+              emd_costs_[abs(row - static_cast<int>(first_dest + idest))]);
+          if (idest == 0) {
+            emd_edges_[row][col] = cur;
+          }
+        }
+      }
     }
+    first_chain_pair_ = num_edge_pairs_;
   }
+}
 
-  printf("Edges:\n");
-  for (size_t ii = 0; ii < outgoing_edges_.size(); ++ii) {
-    for (size_t jj = 0; jj < outgoing_edges_[ii].size(); ++jj) {
-      EdgeIndex curi = outgoing_edges_[ii][jj];
-      Edge cur = e_[curi];
-      printf("  Edge %lu: from: %lu, to: %lu, cap: %d, cost: %f, "
-          "opposite: %lu\n", curi, ii, cur.to, cur.capacity, cur.cost,
-          cur.opposite);
+template <typename IndexType, template <typename> class Queue>
+bool EMDFlowNetworkSAP<IndexType, Queue>::index_type_suffices(int r, int c,
+    int outdegree_vertical_distance, const std::vector<double>& emd_costs) {
+  uint64_t num_nodes = 2 + 2 * static_cast<uint64_t>(r) * c;
+  uint64_t num_pairs = 2 * static_cast<uint64_t>(r)
+      + static_cast<uint64_t>(r) * c;
+  double offset, step;
+  if (outdegree_vertical_distance >= r - 1
+      && emd_costs_are_affine(emd_costs, &offset, &step)) {
+    num_nodes += static_cast<uint64_t>(r) * (c - 1);
+    num_pairs += (2 * static_cast<uint64_t>(r) + 2 * (r - 1)) * (c - 1);
+  } else {
+    for (int row = 0; row < r; ++row) {
+      num_pairs += num_destinations(row, r, outdegree_vertical_distance)
+          * static_cast<uint64_t>(c - 1);
     }
   }
-
-  printf("Potentials:\n");
-  for (size_t ii = 0; ii < potential_.size(); ++ii) {
-    printf("  Node %lu: potential %f\n", ii, potential_[ii]);
-  }
+  uint64_t max_index = numeric_limits<IndexType>::max();
+  return num_nodes < max_index && 2 * num_pairs < max_index;
 }
 
-void EMDFlowNetworkSAP::apply_EMD_lambda(double lambda) {
-  for (int row = 0; row < r_; ++row) {
-    for (int col = 0; col < c_ - 1; ++col) {
-      size_t ndest = num_destinations(row);
-      int first_dest = first_destination(row);
-      for (int idest = 0; idest < static_cast<int>(ndest); ++idest) {
-        EdgeIndex cur = emd_edges_[row][col][idest];
-        e_[cur].cost = lambda * emd_costs_[abs(row - (first_dest + idest))];
-        e_[e_[cur].opposite].cost =
-            -lambda * emd_costs_[abs(row - (first_dest + idest))];
-      }
+template <typename IndexType, template <typename> class Queue>
+bool EMDFlowNetworkSAP<IndexType, Queue>::emd_costs_are_affine(
+    const vector<double>& emd_costs, double* offset, double* step) {
+  if (emd_costs.size() == 0) {
+    return false;
+  }
+  *offset = emd_costs[0];
+  *step = (emd_costs.size() > 1 ? emd_costs[1] - emd_costs[0] : 0.0);
+  // A negative step would create negative cycles in the chain.
+  if (*step < 0.0) {
+    return false;
+  }
+  for (size_t ii = 2; ii < emd_costs.size(); ++ii) {
+    double expected = *offset + ii * (*step);
+    if (abs(emd_costs[ii] - expected) > 1e-12 * max(1.0, abs(expected))) {
+      return false;
     }
   }
+  return true;
 }
 
-void EMDFlowNetworkSAP::apply_signal_lambda(double lambda) {
-  for (int row = 0; row < r_; ++row) {
-    for (int col = 0; col < c_; ++col) {
-      EdgeIndex cur = node_edges_[row][col];
-      e_[cur].cost = lambda * -abs(a_[row][col]);
-      e_[e_[cur].opposite].cost = lambda * abs(a_[row][col]);
+template <typename IndexType, template <typename> class Queue>
+bool EMDFlowNetworkSAP<IndexType, Queue>::emd_costs_are_convex(
+    const vector<double>& emd_costs) {
+  if (emd_costs.size() < 2) {
+    return true;
+  }
+  // The cost of distance -1 is emd_costs[1], so the first step must not be
+  // decreasing.
+  double last_step = 0.0;
+  for (size_t ii = 1; ii < emd_costs.size(); ++ii) {
+    double step = emd_costs[ii] - emd_costs[ii - 1];
+    if (step < last_step) {
+      return false;
     }
+    last_step = step;
   }
+  return true;
 }
 
-void EMDFlowNetworkSAP::reset_flow() {
-  // edges from source to column 1
-  for (size_t ii = 0; ii < outgoing_edges_[s_].size(); ++ii) {
-    EdgeIndex cur = outgoing_edges_[s_][ii];
-    e_[cur].capacity = 1;
-    e_[e_[cur].opposite].capacity = 0;
+// Adds an edge pair and returns the index of the forward edge. In the
+// counting pass (next_edge_ is empty), only the number of edges leaving each
+// node is updated.
+template <typename IndexType, template <typename> class Queue>
+typename EMDFlowNetworkSAP<IndexType, Queue>::EdgeIndex
+EMDFlowNetworkSAP<IndexType, Queue>::add_edge(NodeIndex from, NodeIndex to,
+    double cost) {
+  EdgeIndex forward = 2 * num_edge_pairs_;
+  ++num_edge_pairs_;
+  if (next_edge_.empty()) {
+    ++first_edge_[from + 1];
+    ++first_edge_[to + 1];
+    return forward;
   }
+  out_[next_edge_[from]++] = OutgoingEdge(to, forward);
+  out_[next_edge_[to]++] = OutgoingEdge(from, forward ^ 1);
+  cost_[forward >> 1] = cost;
+  return forward;
+}
 
-  // edges from column c to sink
-  for (size_t ii = 0; ii < outgoing_edges_[t_].size(); ++ii) {
-    EdgeIndex cur = outgoing_edges_[t_][ii];
-    e_[cur].capacity = 0;
-    e_[e_[cur].opposite].capacity = 1;
+template <typename IndexType, template <typename> class Queue>
+void EMDFlowNetworkSAP<IndexType, Queue>::print_full_graph() {
+  printf("Node indices:\n");
+  printf("  Source: %lu, sink: %lu\n", static_cast<unsigned long>(s_),
+      static_cast<unsigned long>(t_));
+  for (int col = 0; col < c_; ++col) {
+    for (int row = 0; row < r_; ++row) {
+      printf("  Entry %d,%d: innode: %lu, outnode: %lu\n", row, col,
+          static_cast<unsigned long>(innode_index(row, col)),
+          static_cast<unsigned long>(outnode_index(row, col)));
+    }
   }
 
-  // edges from innodes to outnodes
-  for (int ii = 0; ii < r_; ++ii) {
-    for (int jj = 0; jj < c_; ++jj) {
-      EdgeIndex cur = node_edges_[ii][jj];
-      e_[cur].capacity = 1;
-      e_[e_[cur].opposite].capacity = 0;
+  printf("Edges:\n");
+  for (size_t ii = 0; ii + 1 < first_edge_.size(); ++ii) {
+    for (EdgeIndex jj = first_edge_[ii]; jj < first_edge_[ii + 1]; ++jj) {
+      EdgeIndex cur = out_[jj].edge;
+      printf("  Edge %lu: from: %lu, to: %lu, residual: %d, cost: %f\n",
+          static_cast<unsigned long>(cur), static_cast<unsigned long>(ii),
+          static_cast<unsigned long>(out_[jj].to), has_capacity(cur) ? 1 : 0,
+          edge_cost(cur));
     }
   }
 
-  // edges between columns
-  for (int row = 0; row < r_; ++row) {
-    for (int col = 0; col < c_ - 1; ++col) {
-      size_t ndest = num_destinations(row);
-      for (size_t idest = 0; idest < ndest; ++idest) {
-        EdgeIndex cur = emd_edges_[row][col][idest];
-        e_[cur].capacity = 1;
-        e_[e_[cur].opposite].capacity = 0;
-      }
-    }
+  printf("Potentials:\n");
+  for (size_t ii = 0; ii < potential_.size(); ++ii) {
+    printf("  Node %lu: potential %f\n", static_cast<unsigned long>(ii),
+        potential_[ii]);
   }
 }
 
-void EMDFlowNetworkSAP::compute_initial_potential() {
+template <typename IndexType, template <typename> class Queue>
+void EMDFlowNetworkSAP<IndexType, Queue>::reset_flow() {
+  fill(flow_.begin(), flow_.end(), false);
+  fill(chain_flow_.begin(), chain_flow_.end(), 0);
+}
+
+template <typename IndexType, template <typename> class Queue>
+void EMDFlowNetworkSAP<IndexType, Queue>::compute_initial_potential() {
   // initialize potentials (= distances) to largest possible value
   for (size_t ii = 0; ii < potential_.size(); ++ii) {
     potential_[ii] = numeric_limits<double>::infinity();
   }
 
   // source and first column have potential 0
-  potential_[s_] = 0.0;
+  set_potential(s_, 0.0, 0.0);
   for (int ii = 0; ii < r_; ++ii) {
-    potential_[innode_index(ii, 0)] = 0.0;
-    potential_[outnode_index(ii, 0)] = e_[node_edges_[ii][0]].cost;
+    set_potential(innode_index(ii, 0), 0.0, 0.0);
+    set_potential(outnode_index(ii, 0), edge_cost(node_edges_[ii][0]), 0.0);
   }
 
   // iteratively update next layer based on current layer
   for (int col = 0; col < c_ - 1; ++col) {
-    // across column
-    for (int row = 0; row < r_; ++row) {
-      NodeIndex from = outnode_index(row, col);
-      double cur_potential = potential_[from];
-      for (size_t ii = 0; ii < outgoing_edges_[from].size(); ++ii) {
-        NodeIndex to = e_[outgoing_edges_[from][ii]].to;
-        double edge_cost = e_[outgoing_edges_[from][ii]].cost;
-        potential_[to] = min(potential_[to], cur_potential + edge_cost);
+    if (use_chain_) {
+      // enter the chain, then two sweeps along the chain
+      for (int row = 0; row < r_; ++row) {
+        NodeIndex from = outnode_index(row, col);
+        set_potential(chainnode_index(row, col),
+            potential_[from] + edge_cost(emd_edges_[row][col]),
+            potential_emd_[from] + edge_emd_cost(emd_edges_[row][col]));
+      }
+      for (int row = 0; row < r_ - 1; ++row) {
+        lower_potential(chainnode_index(row + 1, col),
+            chainnode_index(row, col), chain_down_edges_[col][row]);
+      }
+      for (int row = r_ - 2; row >= 0; --row) {
+        lower_potential(chainnode_index(row, col),
+            chainnode_index(row + 1, col), chain_up_edges_[col][row]);
+      }
+      for (int row = 0; row < r_; ++row) {
+        NodeIndex from = chainnode_index(row, col);
+        set_potential(innode_index(row, col + 1), potential_[from],
+            potential_emd_[from]);
+      }
+    } else if (emd_costs_convex_) {
+      distance_transform(col);
+    } else {
+      // across column
+      for (int row = 0; row < r_; ++row) {
+        NodeIndex from = outnode_index(row, col);
+        for (EdgeIndex ii = first_edge_[from]; ii < first_edge_[from + 1];
+            ++ii) {
+          lower_potential(out_[ii].to, from, out_[ii].edge);
+        }
       }
     }
 
     // innode to outnode
     for (int row = 0; row < r_; ++row) {
-      potential_[outnode_index(row, col + 1)] =
-          potential_[innode_index(row, col + 1)]
-          + e_[node_edges_[row][col + 1]].cost;
+      NodeIndex from = innode_index(row, col + 1);
+      set_potential(outnode_index(row, col + 1),
+          potential_[from] + edge_cost(node_edges_[row][col + 1]),
+          potential_emd_[from]);
     }
   }
 
   // last column to sink
   for (int ii = 0; ii < r_; ++ii) {
-    potential_[t_] = min(potential_[t_], potential_[outnode_index(ii, c_ - 1)]);
+    NodeIndex from = outnode_index(ii, c_ - 1);
+    if (potential_[from] < potential_[t_]) {
+      set_potential(t_, potential_[from], potential_emd_[from]);
+    }
   }
 }
 
-void EMDFlowNetworkSAP::set_sparsity(int s) {
+// Potential of the innode in row to_row of column col + 1 if the path comes
+// from the outnode in row from_row of column col.
+template <typename IndexType, template <typename> class Queue>
+double EMDFlowNetworkSAP<IndexType, Queue>::transform_value(int from_row,
+    int to_row, int col) {
+  int distance = abs(from_row - to_row);
+  if (distance > outdegree_vertical_distance_) {
+    return numeric_limits<double>::infinity();
+  }
+  return potential_[outnode_index(from_row, col)]
+      + emd_lambda_ * emd_costs_[distance];
+}
+
+// Returns true if coming from new_row is at least as good as coming from
+// old_row (old_row < new_row) for the innode in row to_row. For convex EMD
+// costs this is monotone in to_row. Rows that neither of the two outnodes can
+// reach count as dominated only to the right of old_row's reach.
+template <typename IndexType, template <typename> class Queue>
+bool EMDFlowNetworkSAP<IndexType, Queue>::transform_dominates(int new_row,
+    int old_row, int to_row, int col) {
+  double new_value = transform_value(new_row, to_row, col);
+  if (new_value == numeric_limits<double>::infinity()) {
+    return to_row > old_row + outdegree_vertical_distance_;
+  }
+  return new_value <= transform_value(old_row, to_row, col);
+}
+
+// Computes the initial potentials of the innodes in column col + 1 from the
+// outnodes in column col via the lower envelope of the functions
+// potential(outnode) + lambda * emd_cost(distance). For convex EMD costs two
+// such functions cross at most once, so the envelope can be built with a
+// stack in one pass over the rows (plus a binary search for each crossing).
+template <typename IndexType, template <typename> class Queue>
+void EMDFlowNetworkSAP<IndexType, Queue>::distance_transform(int col) {
+  int num_segments = 0;
+  for (int row = 0; row < r_; ++row) {
+    while (num_segments > 0 && transform_dominates(row,
+        envelope_source_[num_segments - 1],
+        envelope_start_[num_segments - 1], col)) {
+      --num_segments;
+    }
+    if (num_segments == 0) {
+      envelope_source_[0] = row;
+      envelope_start_[0] = 0;
+      num_segments = 1;
+      continue;
+    }
+
+    // find the first row in which the new function dominates
+    int old_row = envelope_source_[num_segments - 1];
+    int lo = envelope_start_[num_segments - 1] + 1;
+    int hi = r_;
+    while (lo < hi) {
+      int mid = lo + (hi - lo) / 2;
+      if (transform_dominates(row, old_row, mid, col)) {
+        hi = mid;
+      } else {
+        lo = mid + 1;
+      }
+    }
+    if (lo < r_) {
+      envelope_source_[num_segments] = row;
+      envelope_start_[num_segments] = lo;
+      ++num_segments;
+    }
+  }
+
+  int cur_segment = 0;
+  for (int row = 0; row < r_; ++row) {
+    while (cur_segment + 1 < num_segments
+        && envelope_start_[cur_segment + 1] <= row) {
+      ++cur_segment;
+    }
+    int source = envelope_source_[cur_segment];
+    NodeIndex from = outnode_index(source, col);
+    set_potential(innode_index(row, col + 1),
+        transform_value(source, row, col),
+        potential_emd_[from] + emd_costs_[abs(source - row)]);
+  }
+}
+
+template <typename IndexType, template <typename> class Queue>
+void EMDFlowNetworkSAP<IndexType, Queue>::set_sparsity(int s) {
   sparsity_ = s;
+  has_optimal_flow_ = false;
+  failed_lambda_change_ = numeric_limits<double>::infinity();
+}
+
+template <typename IndexType, template <typename> class Queue>
+bool EMDFlowNetworkSAP<IndexType, Queue>::set_amplitudes(
+    const AmplitudeMatrix& amplitudes) {
+  if (amplitudes.get_num_rows() != r_
+      || amplitudes.get_num_columns() != c_) {
+    return false;
+  }
+  for (int row = 0; row < r_; ++row) {
+    for (int col = 0; col < c_; ++col) {
+      a_[row * c_ + col] = abs(amplitudes(row, col));
+      cost_[node_edges_[row][col] >> 1] = -a_[row * c_ + col];
+    }
+  }
+  has_optimal_flow_ = false;
+  failed_lambda_change_ = numeric_limits<double>::infinity();
+  return true;
+}
+
+template <typename IndexType, template <typename> class Queue>
+void EMDFlowNetworkSAP<IndexType, Queue>::set_warm_start(bool warm_start) {
+  warm_start_ = warm_start;
+}
+
+template <typename IndexType, template <typename> class Queue>
+void EMDFlowNetworkSAP<IndexType, Queue>::set_record_augmentations(
+    bool record) {
+  record_augmentations_ = record;
+  augmentations_.clear();
 }
 
-void EMDFlowNetworkSAP::run_flow(double EMD_lambda, double signal_lambda) {
-  typedef pair<double, EMDFlowNetworkSAP::NodeIndex> q_elem;
+template <typename IndexType, template <typename> class Queue>
+bool EMDFlowNetworkSAP<IndexType, Queue>::get_augmentations(
+    vector<emd_flow_augmentation>* augmentations) {
+  if (!record_augmentations_) {
+    return false;
+  }
+  *augmentations = augmentations_;
+  return true;
+}
+
+template <typename IndexType, template <typename> class Queue>
+void EMDFlowNetworkSAP<IndexType, Queue>::run_flow(double EMD_lambda,
+    double signal_lambda) {
+  ++run_flow_calls;
+
+  double emd_lambda_change = EMD_lambda - emd_lambda_;
+  bool same_signal_lambda = (signal_lambda == signal_lambda_);
+  emd_lambda_ = EMD_lambda;
+  signal_lambda_ = signal_lambda;
+
+  // A repair that failed for a lambda change is not attempted again for
+  // larger changes.
+  if (warm_start_ && !record_augmentations_ && has_optimal_flow_
+      && same_signal_lambda && abs(emd_lambda_change) < failed_lambda_change_) {
+    if (repair_flow(emd_lambda_change)) {
+      ++warm_starts;
+      return;
+    }
+    failed_lambda_change_ = abs(emd_lambda_change);
+    ++warm_start_fallbacks;
+  }
 
   reset_flow();
-  apply_EMD_lambda(EMD_lambda);
-  apply_signal_lambda(signal_lambda);
+  augmentations_.clear();
+  if (record_augmentations_) {
+    size_t old_capacity = augmentations_.capacity();
+    augmentations_.reserve(min(sparsity_, r_));
+    if (augmentations_.capacity() != old_capacity) {
+      ++workspace_allocations;
+    }
+  }
+  recorded_emd_cost_ = 0.0;
 
   //print_full_graph();
 
   compute_initial_potential();
 
-  vector<EdgeIndex> edge_taken_to(potential_.size(), 0);
-  vector<bool> visited(potential_.size(), false);
-  vector<double> dst(potential_.size(), numeric_limits<double>::infinity());
-
   // find a new flow
   for (int total_flow = 0; total_flow < min(sparsity_, r_); ++total_flow) {
     // Dijkstra
-    fill(visited.begin(), visited.end(), false);
-    fill(dst.begin(), dst.end(), numeric_limits<double>::infinity());
-    priority_queue<q_elem> q;
-
-    dst[s_] = 0.0;
-    q.push(q_elem(-dst[s_], s_));
+    dst_[s_] = 0.0;
+    dst_emd_[s_] = 0.0;
+    push_back_counted(s_, &touched_nodes_, &workspace_allocations);
+    queue_.push(s_, dst_[s_]);
 
     size_t num_found = 0;
 
-    while (!q.empty() && num_found < potential_.size()) {
-      q_elem top = q.top();
-      q.pop();
-
-      if (visited[top.second]) {
+    while (!queue_.empty() && num_found < potential_.size()) {
+      NodeIndex cur_node = queue_.pop();
+      if (visited_[cur_node]) {
         continue;
       }
 
-      NodeIndex cur_node = top.second;
-      visited[cur_node] = true;
+      visited_[cur_node] = true;
       ++num_found;
 
+      // Only the shortest path to the sink is needed for the augmentation.
+      if (cur_node == t_) {
+        break;
+      }
+
       NodeIndex next_node;
-      for (vector<EdgeIndex>::iterator iter = outgoing_edges_[cur_node].begin();
-          iter != outgoing_edges_[cur_node].end(); ++iter) {
-        const Edge& e = e_[*iter];
-        next_node = e.to;
+      EdgeIndex last_edge = first_edge_[cur_node + 1];
+      for (EdgeIndex ii = first_edge_[cur_node]; ii < last_edge; ++ii) {
+        EdgeIndex cur_edge = out_[ii].edge;
+        next_node = out_[ii].to;
 
         ++total_inner_iterations;
 
-        if (e.capacity == 0) {
+        if (!has_capacity(cur_edge)) {
           continue;
         }
-        if (visited[next_node]) {
+        if (visited_[next_node]) {
           continue;
         }
-        
+
         ++checking_inner_iterations;
 
-        double adjusted_edge_cost = e.cost + potential_[cur_node]
+        double adjusted_edge_cost = edge_cost(cur_edge) + potential_[cur_node]
             - potential_[next_node];
-        if (dst[cur_node] + adjusted_edge_cost < dst[next_node]) {
-          dst[next_node] = dst[cur_node] + adjusted_edge_cost;
-          q.push(q_elem(-dst[next_node], next_node));
-          edge_taken_to[next_node] = *iter;
+        if (dst_[cur_node] + adjusted_edge_cost < dst_[next_node]) {
+          if (dst_[next_node] == numeric_limits<double>::infinity()) {
+            push_back_counted(next_node, &touched_nodes_,
+                              &workspace_allocations);
+          }
+          dst_[next_node] = dst_[cur_node] + adjusted_edge_cost;
+          dst_emd_[next_node] = dst_emd_[cur_node] + edge_emd_cost(cur_edge)
+              + potential_emd_[cur_node] - potential_emd_[next_node];
+          queue_.push(next_node, dst_[next_node]);
+          edge_taken_to_[next_node] = cur_edge;
+          previous_node_[next_node] = cur_node;
 
           ++updating_inner_iterations;
         }
       }
     }
 
-    // change potentials
-    for (size_t ii = 0; ii < potential_.size(); ++ii) {
-      potential_[ii] += dst[ii];
+    // Change potentials. The standard update p(v) += min(dst(v), dst(t))
+    // keeps the reduced costs non-negative. Shifting all potentials by
+    // -dst(t) does not change the reduced costs, so only the potentials of
+    // the settled nodes change.
+    double sink_distance = dst_[t_];
+    double sink_emd_distance = dst_emd_[t_];
+    for (size_t ii = 0; ii < touched_nodes_.size(); ++ii) {
+      NodeIndex node = touched_nodes_[ii];
+      if (visited_[node]) {
+        potential_[node] += dst_[node] - sink_distance;
+        potential_emd_[node] += dst_emd_[node] - sink_emd_distance;
+      }
     }
+    nodes_not_settled += potential_.size() - num_found;
 
     // change capacities
+    emd_flow_augmentation* augmentation = NULL;
+    if (record_augmentations_) {
+      push_back_counted(emd_flow_augmentation(), &augmentations_,
+                        &workspace_allocations);
+      augmentation = &augmentations_.back();
+      augmentation->amp_sum = (augmentations_.size() > 1
+          ? augmentations_[augmentations_.size() - 2].amp_sum : 0.0);
+    }
     NodeIndex cur_node = t_;
     do {
-      Edge& forward_edge = e_[edge_taken_to[cur_node]];
-      forward_edge.capacity = 0;
-      e_[forward_edge.opposite].capacity = 1;
-      cur_node = e_[forward_edge.opposite].to;
+      push_flow(edge_taken_to_[cur_node]);
+      if (augmentation != NULL) {
+        record_edge(edge_taken_to_[cur_node], augmentation);
+      }
+      cur_node = previous_node_[cur_node];
     } while (cur_node != s_);
+    if (augmentation != NULL) {
+      augmentation->emd_cost = static_cast<int>(floor(recorded_emd_cost_
+          + 0.5));
+    }
+
+    // reset the workspace entries used in this search
+    queue_.clear();
+    for (size_t ii = 0; ii < touched_nodes_.size(); ++ii) {
+      dst_[touched_nodes_[ii]] = numeric_limits<double>::infinity();
+      visited_[touched_nodes_[ii]] = false;
+    }
+    touched_nodes_.clear();
   }
 
+  has_optimal_flow_ = true;
+
   //print_full_graph();
 }
 
-int EMDFlowNetworkSAP::get_EMD_used() {
-  int emd_cost = 0;
+// Adds the change caused by the flow on edge e to the augmentation.
+template <typename IndexType, template <typename> class Queue>
+void EMDFlowNetworkSAP<IndexType, Queue>::record_edge(EdgeIndex e,
+    emd_flow_augmentation* augmentation) {
+  EdgeIndex pair = e >> 1;
+  if (pair < first_node_pair_) {
+    return;
+  }
+  if (pair >= first_emd_pair_) {
+    recorded_emd_cost_ += edge_emd_cost(e);
+    return;
+  }
+  int row = (pair - first_node_pair_) / c_;
+  int col = (pair - first_node_pair_) % c_;
+  if (e & 1) {
+    push_back_counted(make_pair(row, col), &augmentation->removed,
+                      &workspace_allocations);
+    augmentation->amp_sum -= a_[row * c_ + col];
+  } else {
+    push_back_counted(make_pair(row, col), &augmentation->added,
+                      &workspace_allocations);
+    augmentation->amp_sum += a_[row * c_ + col];
+  }
+}
+
+// The flow of the previous run_flow call is still a feasible flow, but it can
+// contain negative cycles in the residual graph for the new costs. Along the
+// edges of the shortest path trees, the potentials change linearly with the
+// EMD lambda, so we first move the potentials by the EMD lambda change times
+// their EMD part. Then only the edges whose reduced cost changes sign have a
+// negative reduced cost. Starting from these potentials as labels, we run a
+// FIFO label-correcting algorithm (Bellman-Ford). After each round, cycles in
+// the graph of parent pointers are negative cycles and get cancelled. When no
+// label changes anymore, the flow is optimal and the labels are valid
+// potentials.
+// Returns false if the repair needs more edge scans than a solve from scratch
+// would take. The flow is then not optimal.
+template <typename IndexType, template <typename> class Queue>
+bool EMDFlowNetworkSAP<IndexType, Queue>::repair_flow(
+    double emd_lambda_change) {
+  long long max_edge_scans = static_cast<long long>(min(sparsity_, r_) + 1)
+      * out_.size();
+  long long edge_scans = 0;
+
+  // previous_node_[v] == v indicates that v has no parent
+  repair_queue_.clear();
+  for (size_t ii = 0; ii < potential_.size(); ++ii) {
+    potential_[ii] += emd_lambda_change * potential_emd_[ii];
+    previous_node_[ii] = ii;
+    push_back_counted(static_cast<NodeIndex>(ii), &repair_queue_,
+                      &workspace_allocations);
+  }
+
+  // visited_ indicates that a node is in the queue of the next round. To keep
+  // the cost of the cycle detection proportional to the work of the label
+  // updates, the parent pointers are only checked again after as many label
+  // updates as the previous check took steps.
+  bool success = true;
+  long long updates_since_check = 0;
+  long long last_check_steps = 0;
+  while (!repair_queue_.empty()) {
+    next_repair_queue_.clear();
+    for (size_t ii = 0; ii < repair_queue_.size(); ++ii) {
+      NodeIndex cur_node = repair_queue_[ii];
+      visited_[cur_node] = false;
+
+      EdgeIndex last_edge = first_edge_[cur_node + 1];
+      for (EdgeIndex jj = first_edge_[cur_node]; jj < last_edge; ++jj) {
+        EdgeIndex cur_edge = out_[jj].edge;
+        ++edge_scans;
+        if (!has_capacity(cur_edge)) {
+          continue;
+        }
+        NodeIndex next_node = out_[jj].to;
+        double label = potential_[cur_node] + edge_cost(cur_edge);
+        double tolerance = kRepairTolerance
+            * max(1.0, abs(potential_[next_node]));
+        if (label < potential_[next_node] - tolerance) {
+          potential_[next_node] = label;
+          potential_emd_[next_node] = potential_emd_[cur_node]
+              + edge_emd_cost(cur_edge);
+          previous_node_[next_node] = cur_node;
+          edge_taken_to_[next_node] = cur_edge;
+          ++updates_since_check;
+          if (!visited_[next_node]) {
+            visited_[next_node] = true;
+            push_back_counted(next_node, &next_repair_queue_,
+                              &workspace_allocations);
+          }
+        }
+      }
+    }
+    repair_queue_.swap(next_repair_queue_);
+
+    if (edge_scans > max_edge_scans) {
+      success = false;
+      break;
+    }
+
+    if (updates_since_check >= last_check_steps) {
+      last_check_steps = cancel_negative_cycles();
+      updates_since_check = 0;
+    }
+  }
+
+  for (size_t ii = 0; ii < repair_queue_.size(); ++ii) {
+    visited_[repair_queue_[ii]] = false;
+  }
+  repair_queue_.clear();
+  repair_edge_scans += edge_scans;
+  return success;
+}
+
+// Follows the parent pointers from every node in repair_queue_. If a walk
+// returns to a node it has already visited, the parent pointers form a cycle,
+// which has negative cost. One unit of flow is pushed around the cycle and
+// its nodes are added to the queue. Returns the number of steps of the walks.
+template <typename IndexType, template <typename> class Queue>
+long long EMDFlowNetworkSAP<IndexType, Queue>::cancel_negative_cycles() {
+  long long num_steps = 0;
+  long long first_stamp = current_stamp_ + 1;
+  size_t num_queued = repair_queue_.size();
+  for (size_t ii = 0; ii < num_queued; ++ii) {
+    ++current_stamp_;
+    NodeIndex node = repair_queue_[ii];
+    while (previous_node_[node] != node && walk_stamp_[node] < first_stamp) {
+      walk_stamp_[node] = current_stamp_;
+      node = previous_node_[node];
+      ++num_steps;
+    }
+    if (walk_stamp_[node] != current_stamp_) {
+      continue;
+    }
+
+    NodeIndex cur_node = node;
+    do {
+      NodeIndex prev_node = previous_node_[cur_node];
+      push_flow(edge_taken_to_[cur_node]);
+      previous_node_[cur_node] = cur_node;
+      if (!visited_[cur_node]) {
+        visited_[cur_node] = true;
+        push_back_counted(cur_node, &repair_queue_, &workspace_allocations);
+      }
+      cur_node = prev_node;
+    } while (cur_node != node);
+    ++cancelled_cycles;
+  }
+  return num_steps;
+}
+
+template <typename IndexType, template <typename> class Queue>
+int EMDFlowNetworkSAP<IndexType, Queue>::get_EMD_used() {
+  // The edge costs need not be integers, so they are summed as doubles and
+  // the total is rounded once.
+  double emd_cost = 0.0;
+  if (use_chain_) {
+    for (int row = 0; row < r_; ++row) {
+      for (int col = 0; col < c_ - 1; ++col) {
+        if (has_flow(emd_edges_[row][col])) {
+          emd_cost += chain_offset_;
+        }
+      }
+    }
+    for (size_t ii = 0; ii < chain_flow_.size(); ++ii) {
+      emd_cost += chain_flow_[ii] * chain_step_;
+    }
+    return static_cast<int>(floor(emd_cost + 0.5));
+  }
+
   for (int row = 0; row < r_; ++row) {
     for (int col = 0; col < c_ - 1; ++col) {
       size_t ndest = num_destinations(row);
       int first_dest = first_destination(row);
       for (int idest = 0; idest < static_cast<int>(ndest); ++idest) {
-        if (e_[emd_edges_[row][col][idest]].capacity == 0) {
+        if (has_flow(emd_edges_[row][col] + 2 * idest)) {
           emd_cost += emd_costs_[abs(row - (first_dest + idest))];
         }
       }
     }
   }
-  return emd_cost;
+  return static_cast<int>(floor(emd_cost + 0.5));
 }
 
-double EMDFlowNetworkSAP::get_supported_amplitude_sum() {
+template <typename IndexType, template <typename> class Queue>
+double EMDFlowNetworkSAP<IndexType, Queue>::get_supported_amplitude_sum() {
   //print_full_graph();
 
   double amp_sum = 0;
   for (int row = 0; row < r_; ++row) {
     for (int col = 0; col < c_; ++col) {
-      if (e_[node_edges_[row][col]].capacity == 0) {
-        amp_sum += abs(a_[row][col]);
+      if (has_flow(node_edges_[row][col])) {
+        amp_sum += a_[row * c_ + col];
       }
     }
   }
   return amp_sum;
 }
 
-void EMDFlowNetworkSAP::get_support(std::vector<std::vector<bool> >* support) {
+template <typename IndexType, template <typename> class Queue>
+void EMDFlowNetworkSAP<IndexType, Queue>::get_support(
+    std::vector<std::vector<bool> >* support) {
   if (static_cast<int>(support->size()) != r_) {
     support->resize(r_);
   }
@@ -363,33 +856,53 @@ void EMDFlowNetworkSAP::get_support(std::vector<std::vector<bool> >* support) {
       (*support)[row].resize(c_);
     }
     for (int col = 0; col < c_; ++col) {
-      (*support)[row][col] = (e_[node_edges_[row][col]].capacity == 0);
+      (*support)[row][col] = has_flow(node_edges_[row][col]);
     }
   }
 }
 
-int EMDFlowNetworkSAP::get_num_nodes() {
-  return outgoing_edges_.size();
+template <typename IndexType, template <typename> class Queue>
+int EMDFlowNetworkSAP<IndexType, Queue>::get_num_nodes() {
+  return potential_.size();
 }
 
-int EMDFlowNetworkSAP::get_num_edges() {
-  return e_.size();
+template <typename IndexType, template <typename> class Queue>
+int EMDFlowNetworkSAP<IndexType, Queue>::get_num_edges() {
+  return out_.size();
 }
 
-int EMDFlowNetworkSAP::get_num_columns() {
+template <typename IndexType, template <typename> class Queue>
+int EMDFlowNetworkSAP<IndexType, Queue>::get_num_columns() {
   return c_;
 }
 
-int EMDFlowNetworkSAP::get_num_rows() {
+template <typename IndexType, template <typename> class Queue>
+int EMDFlowNetworkSAP<IndexType, Queue>::get_num_rows() {
   return r_;
 }
 
-void EMDFlowNetworkSAP::get_performance_diagnostics(std::string* s) {
+template <typename IndexType, template <typename> class Queue>
+void EMDFlowNetworkSAP<IndexType, Queue>::get_performance_diagnostics(
+    std::string* s) {
   const size_t tmp_size = 2000;
   char tmp[tmp_size];
   snprintf(tmp, tmp_size, "Total inner iterations: %lld\n"
-      "Checking inner iterations: %lld\nUpdating inner iterations: %lld\n",
+      "Checking inner iterations: %lld\nUpdating inner iterations: %lld\n"
+      "Nodes not settled in Dijkstra: %lld\n"
+      "run_flow calls: %lld\n"
+      "Workspace vector reallocations in run_flow: %lld\n"
+      "Warm starts: %lld\nWarm start fallbacks: %lld\n"
+      "Cancelled cycles: %lld\nEdge scans in warm starts: %lld\n",
       total_inner_iterations, checking_inner_iterations,
-      updating_inner_iterations);
+      updating_inner_iterations, nodes_not_settled, run_flow_calls,
+      queue_.num_allocations() + workspace_allocations, warm_starts,
+      warm_start_fallbacks, cancelled_cycles, repair_edge_scans);
   *s = string(tmp);
 }
+
+template class EMDFlowNetworkSAP<uint32_t, LazyBinaryHeap>;
+template class EMDFlowNetworkSAP<uint64_t, LazyBinaryHeap>;
+template class EMDFlowNetworkSAP<uint32_t, IndexedFourAryHeap>;
+template class EMDFlowNetworkSAP<uint64_t, IndexedFourAryHeap>;
+template class EMDFlowNetworkSAP<uint32_t, RadixHeap>;
+template class EMDFlowNetworkSAP<uint64_t, RadixHeap>;
@@ -2,18 +2,30 @@
 #define __EMD_FLOW_NETWORK_SAP_H__
 
 #include "emd_flow_network.h"
+#include "emd_flow_priority_queue.h"
 
 #include <algorithm>
 #include <vector>
 #include <cstddef>
+#include <stdint.h>
 
+// IndexType is the type used for node and edge indices. The factory uses
+// 32-bit indices whenever the graph fits (see index_type_suffices).
+// Queue is the priority queue used in the Dijkstra search (see
+// emd_flow_priority_queue.h).
+template <typename IndexType,
+          template <typename> class Queue = LazyBinaryHeap>
 class EMDFlowNetworkSAP : public EMDFlowNetwork {
  public:
   EMDFlowNetworkSAP(
-      const std::vector<std::vector<double> >& amplitudes,
+      const AmplitudeMatrix& amplitudes,
       int outdegree_vertical_distance,
       const std::vector<double>& emd_costs);
   void set_sparsity(int s);
+  bool set_amplitudes(const AmplitudeMatrix& amplitudes);
+  void set_warm_start(bool warm_start);
+  void set_record_augmentations(bool record);
+  bool get_augmentations(std::vector<emd_flow_augmentation>* augmentations);
   void run_flow(double EMD_lambda, double signal_lambda);
   int get_EMD_used();
   double get_supported_amplitude_sum();
@@ -25,27 +37,35 @@ class EMDFlowNetworkSAP : public EMDFlowNetwork {
   void get_performance_diagnostics(std::string* s);
   ~EMDFlowNetworkSAP() { }
 
+  // Returns true if all node and edge indices of the graph for the given
+  // parameters can be represented with IndexType.
+  static bool index_type_suffices(int r, int c,
+      int outdegree_vertical_distance, const std::vector<double>& emd_costs);
+
  private:
   // node indices:
   // source: 0
   // sink: 1
   // other innode: 2 + 2 * (c_ * num_rows + r_)
   // other outnode: 3 + 2 * (c_ * num_rows + r_)
-  typedef size_t NodeIndex;
-  typedef size_t EdgeIndex;
+  // chain node (only with the chain gadget):
+  //     2 + 2 * num_rows * num_cols + c_ * num_rows + r_
+  typedef IndexType NodeIndex;
+  // Edges come in pairs: edge 2 * i is the forward edge of pair i, edge
+  // 2 * i + 1 the corresponding backward edge. So the opposite of edge e is
+  // e ^ 1, and the cost of the backward edge is the negated forward cost.
+  typedef IndexType EdgeIndex;
 
-  struct Edge {
+  // entry of the compressed sparse row adjacency structure
+  struct OutgoingEdge {
     NodeIndex to;
-    int capacity;
-    double cost;
-    EdgeIndex opposite;
+    EdgeIndex edge;
 
-    Edge(NodeIndex _to, int _capacity, double _cost, EdgeIndex _opposite)
-        : to(_to), capacity(_capacity), cost(_cost), opposite(_opposite) { }
+    OutgoingEdge(NodeIndex _to, EdgeIndex _edge) : to(_to), edge(_edge) { }
   };
 
-  // amplitudes
-  std::vector<std::vector<double> > a_;
+  // absolute values of the amplitudes, entry (row, col) at row * c_ + col
+  std::vector<double> a_;
   // sparsity per column
   int sparsity_;
   // number of rows
@@ -56,25 +76,131 @@ class EMDFlowNetworkSAP : public EMDFlowNetwork {
   int outdegree_vertical_distance_;
   // emd costs for an edge between columns with vertical distance i.
   std::vector<double> emd_costs_;
+  // True if the edges between columns are represented by a chain gadget.
+  // This is possible if the graph is full and the EMD costs are affine in
+  // the vertical distance (emd_costs_[i] = chain_offset_ + i * chain_step_).
+  // Instead of an edge for each pair of rows, every column gets a chain of
+  // nodes connected by up / down edges of cost chain_step_. An outnode enters
+  // the chain node in its row (cost chain_offset_) and each chain node leaves
+  // to the innode in its row of the next column (cost 0). This reduces the
+  // number of edges between two columns from O(r^2) to O(r).
+  bool use_chain_;
+  double chain_offset_;
+  double chain_step_;
+  // True if the EMD costs are convex in the (signed) vertical distance. Then
+  // the initial potentials between two columns can be computed with a lower
+  // envelope instead of relaxing every edge.
+  bool emd_costs_convex_;
+  // lambdas of the current run_flow call
+  double emd_lambda_;
+  double signal_lambda_;
 
   // source, sink
   NodeIndex s_, t_;
 
   // edges representing a node cost
   std::vector<std::vector<EdgeIndex> > node_edges_;
-  // edges representing an EMD step
-  std::vector<std::vector<std::vector<EdgeIndex> > > emd_edges_;
-  // edges leaving a node
-  std::vector<std::vector<EdgeIndex> > outgoing_edges_;
-  // set of all edges
-  std::vector<Edge> e_;
+  // first edge representing an EMD step (the edges leaving an outnode are
+  // consecutive; with the chain gadget this is the edge entering the chain)
+  std::vector<std::vector<EdgeIndex> > emd_edges_;
+  // chain gadget edges from row r to row r + 1 (down) and from row r + 1 to
+  // row r (up), indexed by [col][r]
+  std::vector<std::vector<EdgeIndex> > chain_down_edges_;
+  std::vector<std::vector<EdgeIndex> > chain_up_edges_;
+  // chain gadget edges from a chain node to the next column, indexed by
+  // [row][col]
+  std::vector<std::vector<EdgeIndex> > chain_exit_edges_;
+
+  // edges leaving each node in compressed sparse row format: the edges
+  // leaving node v are out_[first_edge_[v]], ..., out_[first_edge_[v + 1] - 1]
+  std::vector<OutgoingEdge> out_;
+  std::vector<EdgeIndex> first_edge_;
+  // next free position in each node's range during graph construction
+  std::vector<EdgeIndex> next_edge_;
+  // number of edge pairs added so far during graph construction
+  EdgeIndex num_edge_pairs_;
+  // first node edge pair (the pair for entry (row, col) is
+  // first_node_pair_ + row * c_ + col)
+  EdgeIndex first_node_pair_;
+  // Cost of the forward edge of each pair without the lambdas. The edges
+  // from the source, to the sink, and the node edges come first and are
+  // scaled by signal_lambda_. The edges between columns start at
+  // first_emd_pair_ and are scaled by emd_lambda_. So changing the lambdas
+  // does not require a pass over the edges.
+  std::vector<double> cost_;
+  EdgeIndex first_emd_pair_;
+  // All edges have capacity 1 except for the chain edges between rows,
+  // which are never saturated. These come last, starting at
+  // first_chain_pair_. For a unit capacity pair, flow_ indicates whether the
+  // forward edge carries flow. For the chain edges, chain_flow_ contains the
+  // flow on the forward edge.
+  EdgeIndex first_chain_pair_;
+  std::vector<bool> flow_;
+  std::vector<int> chain_flow_;
 
   // node potentials
   std::vector<double> potential_;
+  // Part of the potentials that is multiplied with the EMD lambda: the EMD
+  // cost of the paths that determine the potentials. Needed for warm
+  // starts.
+  std::vector<double> potential_emd_;
+
+  // Dijkstra workspaces. They persist across calls of run_flow, and only the
+  // entries of nodes in touched_nodes_ are reset after each search.
+  std::vector<double> dst_;
+  // EMD part of dst_ (see potential_emd_)
+  std::vector<double> dst_emd_;
+  std::vector<bool> visited_;
+  std::vector<EdgeIndex> edge_taken_to_;
+  std::vector<NodeIndex> previous_node_;
+  std::vector<NodeIndex> touched_nodes_;
+  Queue<NodeIndex> queue_;
+
+  // True if warm starts are enabled (see EMDFlowNetwork::set_warm_start).
+  bool warm_start_;
+  // True if the current flow is an optimal flow for the current sparsity and
+  // the lambdas of the last run_flow call.
+  bool has_optimal_flow_;
+  // smallest change of the EMD lambda for which a warm start failed
+  double failed_lambda_change_;
+  // Workspaces of the warm start. The label-correcting algorithm uses
+  // potential_ as labels and previous_node_ / edge_taken_to_ as parent
+  // pointers. walk_stamp_ marks the nodes visited during the cycle detection.
+  std::vector<NodeIndex> repair_queue_;
+  std::vector<NodeIndex> next_repair_queue_;
+  std::vector<long long> walk_stamp_;
+  long long current_stamp_;
+  // relative tolerance for decreasing a label in the warm start
+  static const double kRepairTolerance;
+
+  // True if run_flow records the augmentations in augmentations_.
+  bool record_augmentations_;
+  std::vector<emd_flow_augmentation> augmentations_;
+  // EMD cost of the flow during the recording
+  double recorded_emd_cost_;
+
+  // lower envelope: rows of the minimizing outnodes and the rows from which
+  // on they are minimal
+  std::vector<int> envelope_source_;
+  std::vector<int> envelope_start_;
 
   long long total_inner_iterations;
   long long checking_inner_iterations;
   long long updating_inner_iterations;
+  // number of nodes not settled because Dijkstra stopped at the sink
+  long long nodes_not_settled;
+  long long run_flow_calls;
+  long long warm_starts;
+  long long warm_start_fallbacks;
+  long long cancelled_cycles;
+  long long repair_edge_scans;
+  // number of times a workspace vector of run_flow or the warm start had to
+  // grow after the construction (the queue counts its own allocations). This
+  // covers run_flow only: the first searches can grow the lazy heap up to the
+  // largest number of entries a search needs (reserving the worst case, one
+  // entry per residual edge, would cost more memory than the graph), and
+  // emd_flow allocates the result support and its search state per call.
+  long long workspace_allocations;
 
   NodeIndex innode_index(int r, int c) {
     return 2 + 2 * (c * r_ + r);
@@ -84,19 +210,88 @@ class EMDFlowNetworkSAP : public EMDFlowNetwork {
     return innode_index(r, c) + 1;
   }
 
+  NodeIndex chainnode_index(int r, int c) {
+    return 2 + 2 * r_ * c_ + c * r_ + r;
+  }
+
+  static size_t num_destinations(int r, int num_rows,
+      int outdegree_vertical_distance) {
+    return 1 + std::min(outdegree_vertical_distance, r)
+             + std::min(outdegree_vertical_distance, num_rows - r - 1);
+  }
+
   size_t num_destinations(int r) {
-    return 1 + std::min(outdegree_vertical_distance_, r)
-             + std::min(outdegree_vertical_distance_, r_ - r - 1);
+    return num_destinations(r, r_, outdegree_vertical_distance_);
   }
 
   int first_destination(int r) {
     return std::max(0, r - outdegree_vertical_distance_);
   }
 
-  void apply_EMD_lambda(double lambda);
-  void apply_signal_lambda(double lambda);
+  bool has_capacity(EdgeIndex e) {
+    EdgeIndex pair = e >> 1;
+    if (pair < first_chain_pair_) {
+      return flow_[pair] == static_cast<bool>(e & 1);
+    } else {
+      return !(e & 1) || chain_flow_[pair - first_chain_pair_] > 0;
+    }
+  }
+
+  void push_flow(EdgeIndex e) {
+    EdgeIndex pair = e >> 1;
+    if (pair < first_chain_pair_) {
+      flow_[pair] = !(e & 1);
+    } else {
+      chain_flow_[pair - first_chain_pair_] += ((e & 1) ? -1 : 1);
+    }
+  }
+
+  bool has_flow(EdgeIndex e) {
+    return flow_[e >> 1];
+  }
+
+  // EMD part of the edge cost: the cost without lambda for edges between
+  // columns, 0 for all other edges.
+  double edge_emd_cost(EdgeIndex e) {
+    EdgeIndex pair = e >> 1;
+    if (pair < first_emd_pair_) {
+      return 0.0;
+    }
+    return (e & 1) ? -cost_[pair] : cost_[pair];
+  }
+
+  void set_potential(NodeIndex node, double potential, double emd_potential) {
+    potential_[node] = potential;
+    potential_emd_[node] = emd_potential;
+  }
+
+  void lower_potential(NodeIndex to, NodeIndex from, EdgeIndex e) {
+    double candidate = potential_[from] + edge_cost(e);
+    if (candidate < potential_[to]) {
+      set_potential(to, candidate, potential_emd_[from] + edge_emd_cost(e));
+    }
+  }
+
+  double edge_cost(EdgeIndex e) {
+    EdgeIndex pair = e >> 1;
+    double cost = cost_[pair]
+        * (pair < first_emd_pair_ ? signal_lambda_ : emd_lambda_);
+    return (e & 1) ? -cost : cost;
+  }
+
+  static bool emd_costs_are_affine(const std::vector<double>& emd_costs,
+      double* offset, double* step);
+  static bool emd_costs_are_convex(const std::vector<double>& emd_costs);
+  void add_all_edges();
+  EdgeIndex add_edge(NodeIndex from, NodeIndex to, double cost);
   void reset_flow();
   void compute_initial_potential();
+  void record_edge(EdgeIndex e, emd_flow_augmentation* augmentation);
+  bool repair_flow(double emd_lambda_change);
+  long long cancel_negative_cycles();
+  double transform_value(int from_row, int to_row, int col);
+  bool transform_dominates(int new_row, int old_row, int to_row, int col);
+  void distance_transform(int col);
   void print_full_graph();
 };
 
@@ -0,0 +1,298 @@
+#include "emd_flow_parallel.h"
+
+#include <algorithm>
+
+using namespace std;
+
+// arguments of a thread started by run_in_parallel
+struct parallel_task_args {
+  int index;
+  void (*function)(int, void*);
+  void* context;
+};
+
+void* run_parallel_task(void* raw_args) {
+  parallel_task_args* args = static_cast<parallel_task_args*>(raw_args);
+  args->function(args->index, args->context);
+  return NULL;
+}
+
+void run_in_parallel(int num_tasks, void (*function)(int, void*),
+    void* context) {
+  vector<parallel_task_args> args(num_tasks);
+  vector<pthread_t> threads(num_tasks);
+  vector<bool> started(num_tasks, false);
+  for (int ii = 1; ii < num_tasks; ++ii) {
+    args[ii].index = ii;
+    args[ii].function = function;
+    args[ii].context = context;
+    started[ii] = (pthread_create(&threads[ii], NULL, run_parallel_task,
+                                  &args[ii]) == 0);
+  }
+  if (num_tasks > 0) {
+    function(0, context);
+  }
+  for (int ii = 1; ii < num_tasks; ++ii) {
+    if (started[ii]) {
+      pthread_join(threads[ii], NULL);
+    } else {
+      // Out of threads, so run the task here.
+      function(ii, context);
+    }
+  }
+}
+
+EMDFlowThreadPool::EMDFlowThreadPool(int num_threads)
+    : busy_(false), stopping_(false), num_runs_(0), num_tasks_(0),
+      function_(NULL), context_(NULL), num_running_(0) {
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&work_ready_, NULL);
+  pthread_cond_init(&work_done_, NULL);
+  // The arguments must not move while the threads start.
+  worker_args_.resize(max(0, num_threads - 1));
+  for (size_t ii = 0; ii < worker_args_.size(); ++ii) {
+    worker_args_[ii].pool = this;
+    worker_args_[ii].worker = ii + 1;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, worker_main, &worker_args_[ii]) != 0) {
+      break;
+    }
+    threads_.push_back(thread);
+  }
+}
+
+EMDFlowThreadPool::~EMDFlowThreadPool() {
+  pthread_mutex_lock(&mutex_);
+  stopping_ = true;
+  pthread_cond_broadcast(&work_ready_);
+  pthread_mutex_unlock(&mutex_);
+  for (size_t ii = 0; ii < threads_.size(); ++ii) {
+    pthread_join(threads_[ii], NULL);
+  }
+  pthread_cond_destroy(&work_done_);
+  pthread_cond_destroy(&work_ready_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+void EMDFlowThreadPool::run(int num_tasks, void (*function)(int, void*),
+    void* context) {
+  bool run_here = (threads_.empty() || num_tasks <= 1);
+  if (!run_here) {
+    pthread_mutex_lock(&mutex_);
+    if (busy_) {
+      run_here = true;
+    } else {
+      busy_ = true;
+      num_tasks_ = num_tasks;
+      function_ = function;
+      context_ = context;
+      num_running_ = threads_.size();
+      ++num_runs_;
+      pthread_cond_broadcast(&work_ready_);
+    }
+    pthread_mutex_unlock(&mutex_);
+  }
+  if (run_here) {
+    for (int ii = 0; ii < num_tasks; ++ii) {
+      function(ii, context);
+    }
+    return;
+  }
+
+  int num_threads = get_num_threads();
+  for (int ii = 0; ii < num_tasks; ii += num_threads) {
+    function(ii, context);
+  }
+  pthread_mutex_lock(&mutex_);
+  while (num_running_ > 0) {
+    pthread_cond_wait(&work_done_, &mutex_);
+  }
+  busy_ = false;
+  pthread_mutex_unlock(&mutex_);
+}
+
+void* EMDFlowThreadPool::worker_main(void* raw_args) {
+  worker_args* args = static_cast<worker_args*>(raw_args);
+  EMDFlowThreadPool* pool = args->pool;
+  long long num_runs_seen = 0;
+  pthread_mutex_lock(&pool->mutex_);
+  while (true) {
+    while (!pool->stopping_ && pool->num_runs_ == num_runs_seen) {
+      pthread_cond_wait(&pool->work_ready_, &pool->mutex_);
+    }
+    if (pool->stopping_) {
+      break;
+    }
+    num_runs_seen = pool->num_runs_;
+    int num_tasks = pool->num_tasks_;
+    void (*function)(int, void*) = pool->function_;
+    void* context = pool->context_;
+    int num_threads = pool->get_num_threads();
+    pthread_mutex_unlock(&pool->mutex_);
+
+    for (int ii = args->worker; ii < num_tasks; ii += num_threads) {
+      function(ii, context);
+    }
+
+    pthread_mutex_lock(&pool->mutex_);
+    --pool->num_running_;
+    if (pool->num_running_ == 0) {
+      pthread_cond_signal(&pool->work_done_);
+    }
+  }
+  pthread_mutex_unlock(&pool->mutex_);
+  return NULL;
+}
+
+// items [begin, end) left to a worker in run_work_stealing
+struct work_range {
+  int begin;
+  int end;
+  pthread_mutex_t mutex;
+};
+
+// state shared by the workers of run_work_stealing
+struct work_stealing_context {
+  vector<work_range> ranges;
+  void (*function)(int, int, void*);
+  void* context;
+};
+
+// Moves the second half of the largest range of another worker to the range
+// of worker. Returns false if all ranges are empty.
+bool steal_work(int worker, work_stealing_context* state) {
+  while (true) {
+    int victim = -1;
+    int victim_size = 0;
+    for (size_t ii = 0; ii < state->ranges.size(); ++ii) {
+      pthread_mutex_lock(&state->ranges[ii].mutex);
+      int size = state->ranges[ii].end - state->ranges[ii].begin;
+      pthread_mutex_unlock(&state->ranges[ii].mutex);
+      if (size > victim_size) {
+        victim = ii;
+        victim_size = size;
+      }
+    }
+    if (victim == -1) {
+      return false;
+    }
+
+    work_range& range = state->ranges[victim];
+    pthread_mutex_lock(&range.mutex);
+    int size = range.end - range.begin;
+    int end = range.end;
+    range.end -= (size + 1) / 2;
+    int begin = range.end;
+    pthread_mutex_unlock(&range.mutex);
+    // The range can shrink between the two locks.
+    if (begin < end) {
+      pthread_mutex_lock(&state->ranges[worker].mutex);
+      state->ranges[worker].begin = begin;
+      state->ranges[worker].end = end;
+      pthread_mutex_unlock(&state->ranges[worker].mutex);
+      return true;
+    }
+  }
+}
+
+void work_stealing_task(int worker, void* raw_state) {
+  work_stealing_context* state = static_cast<work_stealing_context*>(
+      raw_state);
+  work_range& range = state->ranges[worker];
+  while (true) {
+    pthread_mutex_lock(&range.mutex);
+    int item = range.begin;
+    bool has_item = (range.begin < range.end);
+    if (has_item) {
+      ++range.begin;
+    }
+    pthread_mutex_unlock(&range.mutex);
+
+    if (has_item) {
+      state->function(item, worker, state->context);
+    } else if (!steal_work(worker, state)) {
+      return;
+    }
+  }
+}
+
+void run_work_stealing(int num_items, EMDFlowThreadPool* pool,
+    void (*function)(int, int, void*), void* context) {
+  int num_workers = max(1, min(pool->get_num_threads(), num_items));
+  work_stealing_context state;
+  state.function = function;
+  state.context = context;
+  state.ranges.resize(num_workers);
+  for (int ii = 0; ii < num_workers; ++ii) {
+    state.ranges[ii].begin = static_cast<long long>(num_items) * ii
+        / num_workers;
+    state.ranges[ii].end = static_cast<long long>(num_items) * (ii + 1)
+        / num_workers;
+    pthread_mutex_init(&state.ranges[ii].mutex, NULL);
+  }
+  pool->run(num_workers, work_stealing_task, &state);
+  for (int ii = 0; ii < num_workers; ++ii) {
+    pthread_mutex_destroy(&state.ranges[ii].mutex);
+  }
+}
+
+EMDFlowParallelSolver::EMDFlowParallelSolver(auto_ptr<EMDFlowNetwork> network)
+    : networks_(1, network.release()), pool_(NULL), emd_lambdas_(NULL) { }
+
+EMDFlowParallelSolver::~EMDFlowParallelSolver() {
+  for (size_t ii = 0; ii < networks_.size(); ++ii) {
+    delete networks_[ii];
+  }
+}
+
+void EMDFlowParallelSolver::add_network(auto_ptr<EMDFlowNetwork> network) {
+  networks_.push_back(network.release());
+}
+
+void EMDFlowParallelSolver::remove_networks(int num_networks) {
+  size_t new_size = max(1, num_networks);
+  for (size_t ii = new_size; ii < networks_.size(); ++ii) {
+    delete networks_[ii];
+  }
+  if (new_size < networks_.size()) {
+    networks_.resize(new_size);
+  }
+}
+
+bool EMDFlowParallelSolver::set_amplitudes(
+    const AmplitudeMatrix& amplitudes) {
+  for (size_t ii = 0; ii < networks_.size(); ++ii) {
+    if (!networks_[ii]->set_amplitudes(amplitudes)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void EMDFlowParallelSolver::set_sparsity(int s) {
+  for (size_t ii = 0; ii < networks_.size(); ++ii) {
+    networks_[ii]->set_sparsity(s);
+  }
+}
+
+void EMDFlowParallelSolver::set_warm_start(bool warm_start) {
+  for (size_t ii = 0; ii < networks_.size(); ++ii) {
+    networks_[ii]->set_warm_start(warm_start);
+  }
+}
+
+void EMDFlowParallelSolver::run_flows(const vector<double>& emd_lambdas) {
+  emd_lambdas_ = &emd_lambdas;
+  if (pool_ != NULL) {
+    pool_->run(emd_lambdas.size(), run_flow_task, this);
+  } else {
+    run_in_parallel(emd_lambdas.size(), run_flow_task, this);
+  }
+  emd_lambdas_ = NULL;
+}
+
+void EMDFlowParallelSolver::run_flow_task(int index, void* raw_solver) {
+  EMDFlowParallelSolver* solver =
+      static_cast<EMDFlowParallelSolver*>(raw_solver);
+  solver->networks_[index]->run_flow((*solver->emd_lambdas_)[index], 1.0);
+}
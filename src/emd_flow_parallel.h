@@ -0,0 +1,135 @@
+#ifndef __EMD_FLOW_PARALLEL_H__
+#define __EMD_FLOW_PARALLEL_H__
+
+#include <memory>
+#include <vector>
+
+#include <pthread.h>
+
+#include "emd_flow_network.h"
+
+// Calls function(ii, context) for ii = 0, ..., num_tasks - 1, each call in
+// its own thread. Call 0 runs in the calling thread. Returns after all calls
+// have finished.
+void run_in_parallel(int num_tasks, void (*function)(int, void*),
+    void* context);
+
+// Threads that are started once and then run the tasks of many run calls,
+// so frequent small parallel steps do not pay for starting threads.
+class EMDFlowThreadPool {
+ public:
+  // Starts num_threads - 1 threads (the thread calling run is the first
+  // worker). If a thread cannot be started, the pool has fewer threads.
+  explicit EMDFlowThreadPool(int num_threads);
+  // Stops and joins the threads.
+  ~EMDFlowThreadPool();
+
+  int get_num_threads() const {
+    return threads_.size() + 1;
+  }
+
+  // Calls function(ii, context) for ii = 0, ..., num_tasks - 1. Task ii runs
+  // on worker ii % get_num_threads(), where worker 0 is the calling thread.
+  // Returns after all calls have finished. If the pool is already running
+  // tasks (e.g., run is called from one of them or from another thread at
+  // the same time), the tasks run one after another in the calling thread.
+  void run(int num_tasks, void (*function)(int, void*), void* context);
+
+ private:
+  // arguments of worker_main
+  struct worker_args {
+    EMDFlowThreadPool* pool;
+    int worker;
+  };
+
+  std::vector<pthread_t> threads_;
+  std::vector<worker_args> worker_args_;
+  pthread_mutex_t mutex_;
+  // signalled when a run starts or the pool stops
+  pthread_cond_t work_ready_;
+  // signalled when the last thread has finished its tasks of a run
+  pthread_cond_t work_done_;
+  bool busy_;
+  bool stopping_;
+  // number of runs started so far, so that each thread joins every run once
+  long long num_runs_;
+  // the current run
+  int num_tasks_;
+  void (*function_)(int, void*);
+  void* context_;
+  // number of threads that have not finished their tasks of the current run
+  int num_running_;
+
+  static void* worker_main(void* args);
+
+  // no copying
+  EMDFlowThreadPool(const EMDFlowThreadPool&);
+  EMDFlowThreadPool& operator=(const EMDFlowThreadPool&);
+};
+
+// Calls function(item, worker, context) for item = 0, ..., num_items - 1 on
+// the workers of pool (worker is the index of the calling worker). Each
+// worker starts with a contiguous block of items and processes it in order.
+// A worker that runs out of items steals the second half of the largest
+// block left to another worker. Returns after all calls have finished.
+void run_work_stealing(int num_items, EMDFlowThreadPool* pool,
+    void (*function)(int, int, void*), void* context);
+
+// Runs the flow for several lambdas at once, each on its own copy of the flow
+// network. The copies keep their flows between calls, so warm starts work as
+// for a single network. The solver can be kept between instances of the same
+// shape; the copies are then updated instead of being built again.
+class EMDFlowParallelSolver {
+ public:
+  // network is the first copy. The solver takes ownership of it.
+  explicit EMDFlowParallelSolver(std::auto_ptr<EMDFlowNetwork> network);
+  ~EMDFlowParallelSolver();
+
+  // Adds another copy of the network and takes ownership of it. All copies
+  // must be built for the same input and sparsity.
+  void add_network(std::auto_ptr<EMDFlowNetwork> network);
+
+  // Deletes all copies after the first num_networks (at least one network is
+  // kept).
+  void remove_networks(int num_networks);
+
+  int get_num_networks() const {
+    return networks_.size();
+  }
+
+  EMDFlowNetwork* get_network(int index) {
+    return networks_[index];
+  }
+
+  // Sets the amplitudes of all copies. Returns false if a copy does not
+  // support updating the amplitudes (the copies then have to be built
+  // again).
+  bool set_amplitudes(const AmplitudeMatrix& amplitudes);
+
+  void set_sparsity(int s);
+  void set_warm_start(bool warm_start);
+
+  // Threads for run_flows until the next call (not owned). If pool is NULL,
+  // run_flows starts its own threads.
+  void set_thread_pool(EMDFlowThreadPool* pool) {
+    pool_ = pool;
+  }
+
+  // Runs the flow with EMD lambda emd_lambdas[ii] and signal lambda 1 on
+  // network ii for all ii in parallel. There can be at most as many lambdas
+  // as networks.
+  void run_flows(const std::vector<double>& emd_lambdas);
+
+ private:
+  std::vector<EMDFlowNetwork*> networks_;
+  EMDFlowThreadPool* pool_;
+  const std::vector<double>* emd_lambdas_;
+
+  static void run_flow_task(int index, void* solver);
+
+  // no copying
+  EMDFlowParallelSolver(const EMDFlowParallelSolver&);
+  EMDFlowParallelSolver& operator=(const EMDFlowParallelSolver&);
+};
+
+#endif
@@ -0,0 +1,178 @@
+#include "emd_flow_parametric.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace std;
+
+// relative tolerance for a point to lie strictly above a hull edge
+const double kHullTolerance = 1e-10;
+
+EMDFlowParametricSolver::EMDFlowParametricSolver(EMDFlowNetwork* network)
+    : network_(network), num_run_flow_calls_(0), tolerance_(0.0) { }
+
+EMDFlowParametricSolver::Point EMDFlowParametricSolver::solve(
+    double emd_lambda, double signal_lambda) {
+  network_->run_flow(emd_lambda, signal_lambda);
+  ++num_run_flow_calls_;
+  return Point(network_->get_EMD_used(),
+               network_->get_supported_amplitude_sum());
+}
+
+void EMDFlowParametricSolver::solve_extremes(Point* min_emd, Point* max_amp) {
+  // The flow without node costs has the smallest EMD cost, but not
+  // necessarily the largest amplitude sum among those flows. Similarly, the
+  // flow for lambda = 0 has the largest amplitude sum, but not necessarily
+  // the smallest EMD cost among those flows. Both are fixed up when points
+  // with the same EMD cost (amplitude sum) and a larger amplitude sum
+  // (smaller EMD cost) show up.
+  *min_emd = solve(1.0, 0.0);
+  *max_amp = solve(0.0, 1.0);
+  tolerance_ = kHullTolerance * max(1.0, max_amp->amp_sum);
+}
+
+bool EMDFlowParametricSolver::is_above(const Point& point, const Point& other,
+    double lambda) const {
+  return point.amp_sum - lambda * point.emd_cost
+      > other.amp_sum - lambda * other.emd_cost + tolerance_;
+}
+
+double EMDFlowParametricSolver::slope(const Point& left, const Point& right) {
+  return (right.amp_sum - left.amp_sum) / (right.emd_cost - left.emd_cost);
+}
+
+void EMDFlowParametricSolver::compute_breakpoints() {
+  breakpoints_.clear();
+
+  vector<Point> vertices;
+  // Right ends of the hull sections that still need to be checked. The last
+  // element is the right end of the section starting at vertices.back().
+  vector<Point> pending;
+  vertices.push_back(Point(0, 0.0));
+  pending.push_back(Point(0, 0.0));
+  solve_extremes(&vertices[0], &pending[0]);
+
+  while (!pending.empty()) {
+    Point left = vertices.back();
+    Point right = pending.back();
+    if (right.emd_cost <= left.emd_cost || right.amp_sum <= left.amp_sum) {
+      if (right.emd_cost <= left.emd_cost && right.amp_sum > left.amp_sum) {
+        vertices.back() = right;
+      }
+      pending.pop_back();
+      continue;
+    }
+
+    double lambda = slope(left, right);
+    Point mid = solve(lambda, 1.0);
+    if (is_above(mid, left, lambda)) {
+      pending.push_back(mid);
+    } else {
+      vertices.push_back(right);
+      pending.pop_back();
+    }
+  }
+
+  breakpoints_.resize(vertices.size());
+  for (size_t ii = 0; ii < vertices.size(); ++ii) {
+    breakpoints_[ii].emd_cost = vertices[ii].emd_cost;
+    breakpoints_[ii].amp_sum = vertices[ii].amp_sum;
+    if (ii == 0) {
+      breakpoints_[ii].lambda_high = numeric_limits<double>::infinity();
+    } else {
+      breakpoints_[ii].lambda_high = breakpoints_[ii - 1].lambda_low;
+    }
+    if (ii + 1 == vertices.size()) {
+      breakpoints_[ii].lambda_low = 0.0;
+    } else {
+      breakpoints_[ii].lambda_low = slope(vertices[ii], vertices[ii + 1]);
+    }
+  }
+}
+
+bool EMDFlowParametricSolver::compute_breakpoint(int emd_budget,
+    emd_flow_breakpoint* breakpoint) {
+  Point first(0, 0.0);
+  Point right(0, 0.0);
+  solve_extremes(&first, &right);
+  if (first.emd_cost > emd_budget) {
+    breakpoint->emd_cost = first.emd_cost;
+    return false;
+  }
+
+  // Narrow down the hull section containing the budget: left is always a
+  // hull point with EMD cost at most the budget, right one with a larger EMD
+  // cost (if there is one).
+  Point left = first;
+  bool has_right = (right.emd_cost > emd_budget
+                    && right.amp_sum > left.amp_sum);
+  if (!has_right && right.emd_cost <= emd_budget) {
+    left = right;
+  }
+  breakpoint->lambda_low = 0.0;
+  while (has_right) {
+    double lambda = slope(left, right);
+    Point mid = solve(lambda, 1.0);
+    if (!is_above(mid, left, lambda)) {
+      breakpoint->lambda_low = lambda;
+      break;
+    }
+    if (mid.emd_cost <= emd_budget) {
+      left = mid;
+    } else {
+      right = mid;
+    }
+  }
+
+  // Find the left neighbor of the vertex in the same way. If left lies on
+  // the part of the hull with slope 0, the search moves it to the vertex
+  // with the largest amplitude sum.
+  breakpoint->lambda_high = numeric_limits<double>::infinity();
+  while (first.emd_cost < left.emd_cost) {
+    if (first.amp_sum >= left.amp_sum - tolerance_) {
+      left = first;
+      break;
+    }
+    double lambda = slope(first, left);
+    Point mid = solve(lambda, 1.0);
+    if (!is_above(mid, first, lambda)) {
+      breakpoint->lambda_high = lambda;
+      break;
+    }
+    if (mid.amp_sum >= left.amp_sum - tolerance_) {
+      left = mid;
+    } else {
+      first = mid;
+    }
+  }
+
+  breakpoint->emd_cost = left.emd_cost;
+  breakpoint->amp_sum = left.amp_sum;
+  return true;
+}
+
+int EMDFlowParametricSolver::find_breakpoint(int emd_budget) const {
+  int lo = 0;
+  int hi = breakpoints_.size();
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (breakpoints_[mid].emd_cost <= emd_budget) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo - 1;
+}
+
+void EMDFlowParametricSolver::solve_at_breakpoint(
+    const emd_flow_breakpoint& breakpoint) {
+  double lambda;
+  if (breakpoint.lambda_high == numeric_limits<double>::infinity()) {
+    lambda = 2.0 * breakpoint.lambda_low + 1.0;
+  } else {
+    lambda = (breakpoint.lambda_low + breakpoint.lambda_high) / 2.0;
+  }
+  solve(lambda, 1.0);
+}
@@ -0,0 +1,95 @@
+#ifndef __EMD_FLOW_PARAMETRIC_H__
+#define __EMD_FLOW_PARAMETRIC_H__
+
+#include <vector>
+
+#include "emd_flow_network.h"
+
+// A vertex of the curve of optimal (EMD cost, amplitude sum) tradeoffs.
+struct emd_flow_breakpoint {
+  int emd_cost;
+  double amp_sum;
+  // The vertex maximizes amp_sum - lambda * emd_cost exactly for lambda in
+  // [lambda_low, lambda_high]. lambda_high is infinity for the vertex with
+  // the smallest EMD cost and lambda_low is 0 for the vertex with the largest
+  // amplitude sum.
+  double lambda_low;
+  double lambda_high;
+};
+
+// Computes all breakpoints of the Lagrangian relaxation
+//
+//   max amp_sum - lambda * emd_cost
+//
+// as a function of lambda, i.e., the vertices of the upper convex hull of the
+// achievable (EMD cost, amplitude sum) pairs. The EMD cost of the optimal
+// solution is a non-increasing step function of lambda with steps at the
+// breakpoints, so the breakpoints give the exact lambda interval for every
+// EMD budget.
+//
+// Between two known vertices, the solver runs the flow at the lambda for
+// which both vertices are equally good (Eisner-Severance). Either the flow
+// finds a new vertex between the two, or the two vertices are neighbors on
+// the hull. This takes 2 * V - 1 run_flow calls for V vertices (plus at most
+// two if the flows for the two extreme lambdas are not vertices). With warm
+// starts enabled in the network, each call starts from the flow of the
+// previous one.
+class EMDFlowParametricSolver {
+ public:
+  // The network must have its sparsity set. The solver does not take
+  // ownership of the network.
+  explicit EMDFlowParametricSolver(EMDFlowNetwork* network);
+
+  void compute_breakpoints();
+
+  // Computes only the breakpoint with the largest EMD cost at most
+  // emd_budget and its lambda interval. This searches the hull section
+  // containing the budget and usually takes far fewer run_flow calls than
+  // computing all breakpoints. If even the smallest EMD cost is larger than
+  // emd_budget, returns false and sets breakpoint->emd_cost to the smallest
+  // EMD cost.
+  bool compute_breakpoint(int emd_budget, emd_flow_breakpoint* breakpoint);
+
+  // Breakpoints in order of increasing EMD cost (and increasing amplitude
+  // sum).
+  const std::vector<emd_flow_breakpoint>& get_breakpoints() const {
+    return breakpoints_;
+  }
+
+  // Returns the index of the breakpoint with the largest EMD cost at most
+  // emd_budget in get_breakpoints(), or -1 if there is no such breakpoint.
+  int find_breakpoint(int emd_budget) const;
+
+  // Runs the flow with a lambda inside the interval of the given breakpoint,
+  // so that the network contains the corresponding support.
+  void solve_at_breakpoint(const emd_flow_breakpoint& breakpoint);
+
+  int get_num_run_flow_calls() const {
+    return num_run_flow_calls_;
+  }
+
+ private:
+  struct Point {
+    int emd_cost;
+    double amp_sum;
+
+    Point(int _emd_cost, double _amp_sum)
+        : emd_cost(_emd_cost), amp_sum(_amp_sum) { }
+  };
+
+  EMDFlowNetwork* network_;
+  std::vector<emd_flow_breakpoint> breakpoints_;
+  int num_run_flow_calls_;
+  // absolute tolerance for is_above
+  double tolerance_;
+
+  Point solve(double emd_lambda, double signal_lambda);
+  // Solves for the flows with the smallest EMD cost and the largest amplitude
+  // sum and sets the tolerance.
+  void solve_extremes(Point* min_emd, Point* max_amp);
+  // True if point is strictly better than other for the given lambda.
+  bool is_above(const Point& point, const Point& other, double lambda) const;
+  static double slope(const Point& left, const Point& right);
+};
+
+#endif
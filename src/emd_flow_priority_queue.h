@@ -0,0 +1,285 @@
+#ifndef __EMD_FLOW_PRIORITY_QUEUE_H__
+#define __EMD_FLOW_PRIORITY_QUEUE_H__
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+
+// Priority queues for the Dijkstra search in EMDFlowNetworkSAP. All queues
+// have the same interface:
+//
+// reset(n): prepares the queue for nodes 0, ..., n - 1 and clears it.
+// empty(): true if the queue contains no elements.
+// push(node, key): inserts node with the given key. If the node is already
+//     in the queue, its key is decreased (if the new key is smaller).
+// pop(): removes an element with minimum key and returns its node.
+// clear(): removes all elements.
+// num_allocations(): number of times the queue had to allocate memory since
+//     the last call of reset.
+//
+// The lazy queues do not support decrease-key and insert a node once for each
+// push instead, so pop() can return the same node several times. The caller
+// has to skip nodes that were already settled.
+
+// Binary heap with lazy deletion. reset reserves one entry per node; a search
+// that pushes more entries grows the heap, which keeps its capacity for the
+// following searches.
+template <typename NodeIndex>
+class LazyBinaryHeap {
+ public:
+  LazyBinaryHeap() : num_allocations_(0) { }
+
+  void reset(size_t num_nodes) {
+    heap_.clear();
+    heap_.reserve(num_nodes);
+    num_allocations_ = 0;
+  }
+
+  bool empty() const {
+    return heap_.empty();
+  }
+
+  void push(NodeIndex node, double key) {
+    size_t old_capacity = heap_.capacity();
+    heap_.push_back(Entry(-key, node));
+    std::push_heap(heap_.begin(), heap_.end());
+    if (heap_.capacity() != old_capacity) {
+      ++num_allocations_;
+    }
+  }
+
+  NodeIndex pop() {
+    std::pop_heap(heap_.begin(), heap_.end());
+    NodeIndex node = heap_.back().second;
+    heap_.pop_back();
+    return node;
+  }
+
+  void clear() {
+    heap_.clear();
+  }
+
+  long long num_allocations() const {
+    return num_allocations_;
+  }
+
+ private:
+  // negated key and node (std::push_heap builds a max-heap)
+  typedef std::pair<double, NodeIndex> Entry;
+  std::vector<Entry> heap_;
+  long long num_allocations_;
+};
+
+
+// Indexed 4-ary heap with decrease-key. Every node is contained at most once,
+// so the heap never grows beyond the number of nodes.
+template <typename NodeIndex>
+class IndexedFourAryHeap {
+ public:
+  void reset(size_t num_nodes) {
+    heap_.clear();
+    heap_.reserve(num_nodes);
+    position_.assign(num_nodes, not_in_heap());
+  }
+
+  bool empty() const {
+    return heap_.empty();
+  }
+
+  void push(NodeIndex node, double key) {
+    NodeIndex pos = position_[node];
+    if (pos == not_in_heap()) {
+      pos = heap_.size();
+      heap_.push_back(Entry(key, node));
+    } else if (key >= heap_[pos].first) {
+      return;
+    }
+    sift_up(pos, Entry(key, node));
+  }
+
+  NodeIndex pop() {
+    NodeIndex node = heap_[0].second;
+    position_[node] = not_in_heap();
+    Entry last = heap_.back();
+    heap_.pop_back();
+    if (!heap_.empty()) {
+      sift_down(0, last);
+    }
+    return node;
+  }
+
+  void clear() {
+    for (size_t ii = 0; ii < heap_.size(); ++ii) {
+      position_[heap_[ii].second] = not_in_heap();
+    }
+    heap_.clear();
+  }
+
+  // heap_ is reserved for all nodes in reset, and every node is contained
+  // at most once.
+  long long num_allocations() const {
+    return 0;
+  }
+
+ private:
+  typedef std::pair<double, NodeIndex> Entry;
+  std::vector<Entry> heap_;
+  // position of each node in heap_
+  std::vector<NodeIndex> position_;
+
+  static NodeIndex not_in_heap() {
+    return static_cast<NodeIndex>(-1);
+  }
+
+  void place(NodeIndex pos, const Entry& entry) {
+    heap_[pos] = entry;
+    position_[entry.second] = pos;
+  }
+
+  void sift_up(NodeIndex pos, const Entry& entry) {
+    while (pos > 0) {
+      NodeIndex parent = (pos - 1) / 4;
+      if (heap_[parent].first <= entry.first) {
+        break;
+      }
+      place(pos, heap_[parent]);
+      pos = parent;
+    }
+    place(pos, entry);
+  }
+
+  void sift_down(NodeIndex pos, const Entry& entry) {
+    size_t size = heap_.size();
+    while (true) {
+      size_t first_child = 4 * static_cast<size_t>(pos) + 1;
+      if (first_child >= size) {
+        break;
+      }
+      size_t last_child = std::min(first_child + 4, size);
+      size_t best = first_child;
+      for (size_t child = first_child + 1; child < last_child; ++child) {
+        if (heap_[child].first < heap_[best].first) {
+          best = child;
+        }
+      }
+      if (heap_[best].first >= entry.first) {
+        break;
+      }
+      place(pos, heap_[best]);
+      pos = best;
+    }
+    place(pos, entry);
+  }
+};
+
+
+// Monotone radix heap with lazy deletion. The keys pushed must not be smaller
+// than the last key popped, which holds for Dijkstra with non-negative
+// reduced costs. Keys that are slightly smaller because of rounding errors are
+// treated as equal to the last popped key.
+//
+// Non-negative doubles are ordered like their bit patterns, so the heap works
+// on the 64-bit representation of the keys. Bucket 0 contains the elements
+// whose key equals the last popped key, bucket i > 0 the elements whose key
+// first differs from the last popped key in bit i - 1 (counted from the least
+// significant bit).
+template <typename NodeIndex>
+class RadixHeap {
+ public:
+  RadixHeap() : size_(0), last_(0), num_allocations_(0) { }
+
+  // The buckets keep their capacity, so they only allocate memory while the
+  // first searches run.
+  void reset(size_t /*num_nodes*/) {
+    clear();
+    num_allocations_ = 0;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  void push(NodeIndex node, double key) {
+    uint64_t bits = last_;
+    if (key > 0.0) {
+      memcpy(&bits, &key, sizeof(bits));
+      bits = std::max(bits, last_);
+    }
+    append(bucket(bits), Entry(bits, node));
+    ++size_;
+  }
+
+  NodeIndex pop() {
+    if (buckets_[0].empty()) {
+      int ii = 1;
+      while (buckets_[ii].empty()) {
+        ++ii;
+      }
+      std::vector<Entry>& source = buckets_[ii];
+      uint64_t new_last = source[0].first;
+      for (size_t jj = 1; jj < source.size(); ++jj) {
+        new_last = std::min(new_last, source[jj].first);
+      }
+      last_ = new_last;
+      // all elements of the bucket move to a bucket with a smaller index
+      for (size_t jj = 0; jj < source.size(); ++jj) {
+        append(bucket(source[jj].first), source[jj]);
+      }
+      source.clear();
+    }
+    NodeIndex node = buckets_[0].back().second;
+    buckets_[0].pop_back();
+    --size_;
+    return node;
+  }
+
+  void clear() {
+    for (int ii = 0; ii < kNumBuckets; ++ii) {
+      buckets_[ii].clear();
+    }
+    size_ = 0;
+    last_ = 0;
+  }
+
+  long long num_allocations() const {
+    return num_allocations_;
+  }
+
+ private:
+  enum { kNumBuckets = 65 };
+  typedef std::pair<uint64_t, NodeIndex> Entry;
+  std::vector<Entry> buckets_[kNumBuckets];
+  size_t size_;
+  uint64_t last_;
+  long long num_allocations_;
+
+  int bucket(uint64_t bits) const {
+    uint64_t diff = bits ^ last_;
+    if (diff == 0) {
+      return 0;
+    }
+#ifdef __GNUC__
+    return 64 - __builtin_clzll(diff);
+#else
+    int result = 0;
+    while (diff != 0) {
+      diff >>= 1;
+      ++result;
+    }
+    return result;
+#endif
+  }
+
+  void append(int index, const Entry& entry) {
+    std::vector<Entry>& target = buckets_[index];
+    size_t old_capacity = target.capacity();
+    target.push_back(entry);
+    if (target.capacity() != old_capacity) {
+      ++num_allocations_;
+    }
+  }
+};
+
+#endif
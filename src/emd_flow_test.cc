@@ -1,7 +1,14 @@
 #include "emd_flow.h"
+#include "emd_flow_io.h"
 #include "emd_flow_network.h"
+#include "emd_flow_network_sap.h"
+#include "emd_flow_parallel.h"
+#include "emd_flow_parametric.h"
 
 #include <cstdio>                                                               
+#include <cstdlib>
+#include <memory>
+#include <string>
 #include <vector>
 
 #include "boost/assign/list_of.hpp"
@@ -10,11 +17,15 @@
 using namespace boost::assign;
 using namespace std;
 
-void WriteToStderr(const char* s) {
+void WriteToStderr(const char* s, void*) {
   fprintf(stderr, s);
   fflush(stderr);
 }
 
+void AppendToString(const char* s, void* output) {
+  static_cast<string*>(output)->append(s);
+}
+
 void FillArgs(int s, int B, emd_flow_args* args) {
   args->s = s;
   args->emd_bound_low = B;
@@ -28,6 +39,52 @@ void FillArgs(int s, int B, emd_flow_args* args) {
   args->verbose = true;
 }
 
+// r x c matrix with random integer amplitudes in [0, 100).
+vector<vector<double> > RandomAmplitudes(int r, int c) {
+  vector<vector<double> > x(r, vector<double>(c));
+  for (int row = 0; row < r; ++row) {
+    for (int col = 0; col < c; ++col) {
+      x[row][col] = rand() % 100;
+    }
+  }
+  return x;
+}
+
+// Seeds rand() and returns a random instance with min_size to max_r rows and
+// min_size to max_c columns. Later rand() calls of the test continue from
+// this state, so every trial is reproducible from its seed alone.
+vector<vector<double> > RandomInstance(unsigned int seed, int max_r,
+                                       int max_c, int min_size = 2) {
+  srand(seed);
+  int r = min_size + rand() % (max_r - min_size + 1);
+  int c = min_size + rand() % (max_c - min_size + 1);
+  return RandomAmplitudes(r, c);
+}
+
+// The 3 x 2 instance of the hand-checked tests: with sparsity 1, the best
+// support without EMD is row 2 (amplitude sum 101), and moving the path two
+// rows between the columns gives 201.
+vector<vector<double> > TwoPathInstance() {
+  vector<vector<double> > x;
+  x.push_back(list_of(0.0)(100.0));
+  x.push_back(list_of(0.0)(0.0));
+  x.push_back(list_of(101.0)(0.0));
+  return x;
+}
+
+// The 4 x 3 instance of the hand-checked convex cost tests: with sparsity 1
+// and quadratic costs, the path 0, 1, 3 (EMD 1 + 4, amplitude sum 110) beats
+// the path 0, 0, 3 (EMD 9, amplitude sum 115) that linear costs would price
+// at 3.
+vector<vector<double> > ConvexInstance() {
+  vector<vector<double> > x;
+  x.push_back(list_of(50.0)(15.0)(0.0));
+  x.push_back(list_of(0.0)(10.0)(0.0));
+  x.push_back(list_of(0.0)(0.0)(0.0));
+  x.push_back(list_of(0.0)(0.0)(50.0));
+  return x;
+}
+
 void CheckResultConsistency(const emd_flow_result&) {
   // TODO:implement
 }
@@ -351,6 +408,1349 @@ TEST(EMDFlowTest, SimpleImpossibleEMDCosts) {
   CheckResultIsEmpty(result);
 }
 
+TEST(EMDFlowTest, BadLambdaGuesses) {
+  vector<vector<double> > x;
+  x.push_back(list_of(0.0)(100.0));
+  x.push_back(list_of(0.0)(0.0));
+  x.push_back(list_of(101.0)(0.0));
+  const int s = 1;
+  emd_flow_args args(x);
+  vector<vector<bool> > support;
+  emd_flow_result result;
+  result.support = &support;
+
+  // far too small
+  FillArgs(s, 1, &args);
+  args.lambda_low = 1e-30;
+  args.lambda_high = 2e-30;
+  emd_flow(args, &result); 
+  CheckResult(result, 0, 101.0);
+
+  // far too large
+  FillArgs(s, 2, &args);
+  args.lambda_low = 1e30;
+  args.lambda_high = 2e30;
+  emd_flow(args, &result); 
+  CheckResult(result, 2, 201.0);
+
+  // Non-integer EMD costs with a common unit of 0.5: moving the path by two
+  // rows costs 6.
+  args.emd_costs = list_of(0.0)(2.5)(6.0);
+  FillArgs(s, 5, &args);
+  args.lambda_low = 1e-30;
+  args.lambda_high = 2e-30;
+  emd_flow(args, &result);
+  CheckResult(result, 0, 101.0);
+
+  FillArgs(s, 6, &args);
+  args.lambda_low = 1e30;
+  args.lambda_high = 2e30;
+  emd_flow(args, &result);
+  CheckResult(result, 6, 201.0);
+}
+
+TEST(EMDFlowTest, BadLambdaGuessesCostConstantFlows) {
+  vector<vector<double> > x;
+  x.push_back(list_of(0.0)(100.0));
+  x.push_back(list_of(0.0)(0.0));
+  x.push_back(list_of(101.0)(0.0));
+  emd_flow_args args(x);
+  vector<vector<bool> > support;
+  emd_flow_result result;
+  result.support = &support;
+
+  // With the secant and hybrid policies, a wrong guess is replaced by the
+  // bound from compute_lambda_bounds right away, so the number of flow
+  // computations does not depend on how far off the guess is.
+  emd_flow_search_policy policies[] = {kSecantSearch, kHybridSearch};
+  double guesses[] = {1e-30, 1e-10, 1e10, 1e30};
+  for (int ii = 0; ii < 2; ++ii) {
+    for (int jj = 0; jj < 4; ++jj) {
+      FillArgs(1, 1, &args);
+      args.verbose = false;
+      args.search_policy = policies[ii];
+      args.lambda_low = guesses[jj];
+      args.lambda_high = 2.0 * guesses[jj];
+      emd_flow(args, &result);
+      CheckResult(result, 0, 101.0);
+      EXPECT_GE(6, result.num_run_flow_calls);
+
+      FillArgs(1, 2, &args);
+      args.verbose = false;
+      args.search_policy = policies[ii];
+      args.lambda_low = guesses[jj];
+      args.lambda_high = 2.0 * guesses[jj];
+      emd_flow(args, &result);
+      CheckResult(result, 2, 201.0);
+      EXPECT_GE(6, result.num_run_flow_calls);
+    }
+  }
+}
+
+TEST(EMDFlowTest, SecantSearchStopsBetweenNeighbors) {
+  vector<vector<double> > x;
+  x.push_back(list_of(0.0)(100.0));
+  x.push_back(list_of(0.0)(0.0));
+  x.push_back(list_of(101.0)(0.0));
+  const int s = 1;
+  // There is no solution with EMD cost 1, only 0 and 2.
+  const int B = 1;
+  emd_flow_args args(x);
+  FillArgs(s, B, &args);
+  vector<vector<bool> > support;
+  emd_flow_result result;
+  result.support = &support;
+
+  emd_flow(args, &result);
+  CheckResult(result, 0, 101.0);
+  int num_bisection_calls = result.num_run_flow_calls;
+
+  args.search_policy = kSecantSearch;
+  emd_flow(args, &result);
+  CheckResult(result, 0, 101.0);
+  EXPECT_LT(result.num_run_flow_calls, num_bisection_calls);
+
+  args.search_policy = kHybridSearch;
+  emd_flow(args, &result);
+  CheckResult(result, 0, 101.0);
+  EXPECT_LT(result.num_run_flow_calls, num_bisection_calls);
+}
+
+TEST(EMDFlowTest, ParametricOneEMDOneSparsity) {
+  vector<vector<double> > x;
+  x.push_back(list_of(0.0)(100.0));
+  x.push_back(list_of(0.0)(0.0));
+  x.push_back(list_of(101.0)(0.0));
+  const int s = 1;
+  const int B = 1;
+  emd_flow_args args(x);
+  FillArgs(s, B, &args);
+  args.parametric = true;
+
+  vector<vector<bool> > support;
+  emd_flow_result result;
+  result.support = &support;
+  emd_flow(args, &result); 
+
+  vector<vector<bool> > expected_support;
+  expected_support.push_back(list_of(0)(0));
+  expected_support.push_back(list_of(0)(0));
+  expected_support.push_back(list_of(1)(1));
+  CheckResult(result, expected_support, 0, 101.0);
+  // The solution with EMD 2 has amplitude sum 201.
+  EXPECT_DOUBLE_EQ(50.0, result.final_lambda_low);
+}
+
+TEST(EMDFlowTest, FrontierOneSparsity) {
+  vector<vector<double> > x;
+  x.push_back(list_of(0.0)(100.0));
+  x.push_back(list_of(0.0)(0.0));
+  x.push_back(list_of(101.0)(0.0));
+  emd_flow_args args(x);
+  FillArgs(1, 0, &args);
+
+  emd_flow_frontier_result result;
+  emd_flow_frontier(args, &result);
+  ASSERT_EQ(2u, result.points.size());
+  EXPECT_EQ(0, result.points[0].emd_cost);
+  EXPECT_DOUBLE_EQ(101.0, result.points[0].amp_sum);
+  EXPECT_DOUBLE_EQ(50.0, result.points[0].lambda_low);
+  EXPECT_EQ(2, result.points[1].emd_cost);
+  EXPECT_DOUBLE_EQ(201.0, result.points[1].amp_sum);
+  EXPECT_DOUBLE_EQ(0.0, result.points[1].lambda_low);
+  EXPECT_DOUBLE_EQ(50.0, result.points[1].lambda_high);
+
+  vector<vector<bool> > support;
+  emd_flow_frontier_support(&result, 1, &support);
+  vector<vector<bool> > expected_support;
+  expected_support.push_back(list_of(0)(1));
+  expected_support.push_back(list_of(0)(0));
+  expected_support.push_back(list_of(1)(0));
+  EXPECT_EQ(expected_support, support);
+  emd_flow_frontier_support(&result, 0, &support);
+  expected_support[0][1] = false;
+  expected_support[2][1] = true;
+  EXPECT_EQ(expected_support, support);
+}
+
+TEST(EMDFlowTest, SparsitySweepReroutesEarlierPaths) {
+  vector<vector<double> > x;
+  x.push_back(list_of(1.0)(5.0)(7.0));
+  x.push_back(list_of(0.0)(6.0)(1.0));
+  x.push_back(list_of(7.0)(5.0)(1.0));
+  emd_flow_args args(x);
+  FillArgs(3, 0, &args);
+  args.verbose = false;
+  // With lambda 3, the single path runs through the 6 in the middle row. For
+  // sparsity 2, rows 0 and 2 in every column collect 26 without EMD, so the
+  // second step removes the 6 from the support again.
+  vector<emd_flow_augmentation> steps;
+  emd_flow_sparsity_sweep(args, 3.0, &steps);
+  ASSERT_EQ(3u, steps.size());
+  EXPECT_EQ(2, steps[0].emd_cost);
+  EXPECT_DOUBLE_EQ(20.0, steps[0].amp_sum);
+  EXPECT_EQ(0, steps[1].emd_cost);
+  EXPECT_DOUBLE_EQ(26.0, steps[1].amp_sum);
+  ASSERT_EQ(1u, steps[1].removed.size());
+  EXPECT_EQ(make_pair(1, 1), steps[1].removed[0]);
+  EXPECT_EQ(0, steps[2].emd_cost);
+  EXPECT_DOUBLE_EQ(33.0, steps[2].amp_sum);
+
+  vector<vector<bool> > support;
+  emd_flow_sparsity_support(steps, 1, 3, 3, &support);
+  vector<vector<bool> > expected_support;
+  expected_support.push_back(list_of(0)(0)(1));
+  expected_support.push_back(list_of(0)(1)(0));
+  expected_support.push_back(list_of(1)(0)(0));
+  EXPECT_EQ(expected_support, support);
+  emd_flow_sparsity_support(steps, 2, 3, 3, &support);
+  expected_support[0] = list_of(1)(1)(1);
+  expected_support[1] = list_of(0)(0)(0);
+  expected_support[2] = list_of(1)(1)(1);
+  EXPECT_EQ(expected_support, support);
+}
+
+TEST(EMDFlowTest, SparsitySweepMatchesSingleSolves) {
+  for (int trial = 0; trial < 20; ++trial) {
+    vector<vector<double> > x = RandomInstance(500 + trial, 9, 7);
+    int r = x.size();
+    int c = x[0].size();
+    // odd trials use quadratic costs and a limited outdegree
+    int outdegree = (trial % 2 == 1) ? r / 2 : r - 1;
+    vector<double> emd_costs;
+    for (int ii = 0; ii <= outdegree; ++ii) {
+      emd_costs.push_back(trial % 2 == 1 ? ii * ii : ii);
+    }
+    emd_flow_args args(x);
+    FillArgs(r, 0, &args);
+    args.outdegree_vertical_distance = outdegree;
+    args.emd_costs = emd_costs;
+    args.verbose = false;
+    double lambda = 0.5 * (trial % 5);
+
+    vector<emd_flow_augmentation> steps;
+    emd_flow_sparsity_sweep(args, lambda, &steps);
+    ASSERT_EQ(static_cast<size_t>(r), steps.size());
+
+    auto_ptr<EMDFlowNetwork> network =
+        EMDFlowNetworkFactory::create_EMD_flow_network(x, outdegree,
+            emd_costs, EMDFlowNetworkFactory::kShortestAugmentingPath);
+    for (int s = 1; s <= r; ++s) {
+      network->set_sparsity(s);
+      network->run_flow(lambda, 1.0);
+      EXPECT_NEAR(network->get_supported_amplitude_sum()
+              - lambda * network->get_EMD_used(),
+          steps[s - 1].amp_sum - lambda * steps[s - 1].emd_cost, 1e-9);
+
+      vector<vector<bool> > support;
+      emd_flow_sparsity_support(steps, s, r, c, &support);
+      double amp_sum = 0.0;
+      for (int col = 0; col < c; ++col) {
+        int num_entries = 0;
+        for (int row = 0; row < r; ++row) {
+          if (support[row][col]) {
+            ++num_entries;
+            amp_sum += x[row][col];
+          }
+        }
+        EXPECT_EQ(s, num_entries);
+      }
+      EXPECT_DOUBLE_EQ(steps[s - 1].amp_sum, amp_sum);
+    }
+  }
+}
+
+TEST(EMDFlowTest, ParallelSearchConvexCosts) {
+  vector<vector<double> > x = ConvexInstance();
+  emd_flow_args args(x);
+  vector<vector<bool> > support;
+  emd_flow_result result;
+  result.support = &support;
+
+  // The solutions with quadratic costs have EMD 0, 5 and 9. No solution has
+  // EMD 1 to 4, so the last search falls back to the one with EMD 0.
+  int bounds_low[] = {5, 9, 1};
+  int bounds_high[] = {8, 9, 4};
+  int expected_emd[] = {5, 9, 0};
+  double expected_amp_sum[] = {110.0, 115.0, 65.0};
+  for (int ii = 0; ii < 3; ++ii) {
+    FillArgs(1, bounds_low[ii], &args);
+    args.emd_bound_high = bounds_high[ii];
+    args.outdegree_vertical_distance = 3;
+    args.emd_costs = list_of(0.0)(1.0)(4.0)(9.0);
+    args.verbose = false;
+    args.num_search_threads = 4;
+    emd_flow(args, &result);
+    CheckResult(result, expected_emd[ii], expected_amp_sum[ii]);
+  }
+}
+
+TEST(EMDFlowTest, ParallelSearchFindsFeasibleSolutions) {
+  for (int trial = 0; trial < 20; ++trial) {
+    vector<vector<double> > x = RandomInstance(1600 + trial, 9, 7);
+    int r = x.size();
+    int c = x[0].size();
+    emd_flow_args args(x);
+    FillArgs(1 + rand() % r, rand() % 6, &args);
+    args.emd_bound_high = args.emd_bound_low + 1;
+    args.verbose = false;
+    args.warm_start = (trial % 2 == 1);
+    args.search_policy = (trial % 3 == 0 ? kBisectionSearch : kHybridSearch);
+    vector<vector<bool> > support;
+    emd_flow_result result;
+    result.support = &support;
+    emd_flow(args, &result);
+    double sequential_amp_sum = result.amp_sum;
+
+    args.num_search_threads = 4;
+    emd_flow(args, &result);
+    EXPECT_LE(result.emd_cost, args.emd_bound_high);
+    // The parallel search narrows the interval of lambdas at least as far.
+    EXPECT_GE(result.amp_sum, sequential_amp_sum - 1e-9);
+    double amp_sum = 0.0;
+    for (int row = 0; row < r; ++row) {
+      for (int col = 0; col < c; ++col) {
+        if (support[row][col]) {
+          amp_sum += x[row][col];
+        }
+      }
+    }
+    EXPECT_DOUBLE_EQ(result.amp_sum, amp_sum);
+  }
+}
+
+// Records the thread of each task and runs a nested round on the same pool.
+struct PoolRun {
+  EMDFlowThreadPool* pool;
+  vector<pthread_t> threads;
+  vector<int> nested_tasks;
+};
+
+void CountNestedTask(int, void* raw_count) {
+  ++*static_cast<int*>(raw_count);
+}
+
+void RecordThread(int index, void* raw_run) {
+  PoolRun* run = static_cast<PoolRun*>(raw_run);
+  run->threads[index] = pthread_self();
+  run->pool->run(3, CountNestedTask, &run->nested_tasks[index]);
+}
+
+TEST(EMDFlowThreadPoolTest, KeepsThreadsBetweenRuns) {
+  EMDFlowThreadPool pool(4);
+  ASSERT_EQ(4, pool.get_num_threads());
+  PoolRun first;
+  first.pool = &pool;
+  first.threads.resize(8);
+  first.nested_tasks.assign(8, 0);
+  pool.run(8, RecordThread, &first);
+  PoolRun second = first;
+  second.nested_tasks.assign(8, 0);
+  pool.run(8, RecordThread, &second);
+
+  for (int ii = 0; ii < 8; ++ii) {
+    // Task ii runs on worker ii % 4 in both runs, worker 0 is this thread.
+    EXPECT_TRUE(pthread_equal(first.threads[ii], first.threads[ii % 4]));
+    EXPECT_TRUE(pthread_equal(first.threads[ii], second.threads[ii]));
+    EXPECT_EQ(ii % 4 == 0, pthread_equal(first.threads[ii], pthread_self())
+        != 0);
+    // The pool is busy, so the nested rounds run in the calling thread.
+    EXPECT_EQ(3, first.nested_tasks[ii]);
+    EXPECT_EQ(3, second.nested_tasks[ii]);
+  }
+  for (int ii = 1; ii < 4; ++ii) {
+    for (int jj = 0; jj < ii; ++jj) {
+      EXPECT_FALSE(pthread_equal(first.threads[ii], first.threads[jj]));
+    }
+  }
+}
+
+// One emd_flow call per thread, each with its own output.
+struct ConcurrentCall {
+  vector<vector<double> > x;
+  int s;
+  int emd_budget;
+  bool warm_start;
+  vector<vector<bool> > support;
+  emd_flow_result result;
+  string output;
+};
+
+void RunConcurrentCall(int index, void* raw_calls) {
+  ConcurrentCall& call =
+      (*static_cast<vector<ConcurrentCall>*>(raw_calls))[index];
+  emd_flow_args args(call.x);
+  FillArgs(call.s, call.emd_budget, &args);
+  args.output_function = AppendToString;
+  args.output_context = &call.output;
+  args.warm_start = call.warm_start;
+  call.result.support = &call.support;
+  emd_flow(args, &call.result);
+}
+
+TEST(EMDFlowTest, ConcurrentCallsMatchSequentialCalls) {
+  srand(17);
+  const int kNumCalls = 8;
+  vector<ConcurrentCall> calls(kNumCalls);
+  for (int ii = 0; ii < kNumCalls; ++ii) {
+    calls[ii].x = RandomAmplitudes(30, 20);
+    calls[ii].s = 2;
+    calls[ii].emd_budget = 2 * ii;
+    calls[ii].warm_start = (ii % 2 == 1);
+  }
+  run_in_parallel(kNumCalls, RunConcurrentCall, &calls);
+
+  for (int ii = 0; ii < kNumCalls; ++ii) {
+    vector<ConcurrentCall> sequential(1, calls[ii]);
+    sequential[0].output.clear();
+    RunConcurrentCall(0, &sequential);
+    EXPECT_EQ(sequential[0].result.emd_cost, calls[ii].result.emd_cost);
+    EXPECT_DOUBLE_EQ(sequential[0].result.amp_sum, calls[ii].result.amp_sum);
+    EXPECT_EQ(sequential[0].support, calls[ii].support);
+    EXPECT_NE(string::npos, calls[ii].output.find("Final l:"));
+  }
+}
+
+TEST(EMDFlowTest, ConcurrentCallsOnDifferentShapes) {
+  const int kNumCalls = 4;
+  vector<ConcurrentCall> calls(kNumCalls);
+  calls[0].x = TwoPathInstance();
+  calls[0].s = 1;
+  calls[0].emd_budget = 2;
+  calls[1].x = ConvexInstance();
+  calls[1].s = 1;
+  calls[1].emd_budget = 3;
+  calls[2].x = ConvexInstance();
+  calls[2].s = 2;
+  calls[2].emd_budget = 0;
+  calls[3].x = vector<vector<double> >(1, list_of(3.0)(4.0)(5.0)(6.0)(7.0));
+  calls[3].s = 1;
+  calls[3].emd_budget = 0;
+  for (int ii = 0; ii < kNumCalls; ++ii) {
+    calls[ii].warm_start = (ii % 2 == 1);
+  }
+  run_in_parallel(kNumCalls, RunConcurrentCall, &calls);
+
+  // With linear costs, the path 0, 0, 3 of ConvexInstance is the best one
+  // with EMD 3. With sparsity 2 and no EMD, rows 0 and 3 collect 115.
+  int expected_emd[] = {2, 3, 0, 0};
+  double expected_amp_sum[] = {201.0, 115.0, 115.0, 25.0};
+  const char* expected_header[] = {"r = 3,  c = 2,", "r = 4,  c = 3,",
+      "r = 4,  c = 3,", "r = 1,  c = 5,"};
+  for (int ii = 0; ii < kNumCalls; ++ii) {
+    CheckResult(calls[ii].result, expected_emd[ii], expected_amp_sum[ii]);
+    ASSERT_EQ(calls[ii].x.size(), calls[ii].support.size());
+    ASSERT_EQ(calls[ii].x[0].size(), calls[ii].support[0].size());
+    EXPECT_NE(string::npos, calls[ii].output.find(expected_header[ii]));
+    EXPECT_NE(string::npos, calls[ii].output.find("Final l:"));
+  }
+}
+
+TEST(EMDFlowTest, BatchMatchesSingleCalls) {
+  srand(19);
+  const int kNumInstances = 40;
+  // runs of instances with the same shape
+  vector<vector<vector<double> > > x(kNumInstances);
+  for (int ii = 0; ii < kNumInstances; ++ii) {
+    x[ii] = RandomAmplitudes(5 + (ii / 4) % 3, 4 + (ii / 4) % 2);
+  }
+
+  vector<emd_flow_args*> args;
+  vector<vector<vector<bool> > > supports(kNumInstances);
+  vector<emd_flow_result> results(kNumInstances);
+  for (int ii = 0; ii < kNumInstances; ++ii) {
+    args.push_back(new emd_flow_args(x[ii]));
+    FillArgs(1 + ii % 3, ii % 7, args[ii]);
+    args[ii]->verbose = false;
+    results[ii].support = &supports[ii];
+  }
+  vector<const emd_flow_args*> batch_args(args.begin(), args.end());
+  vector<emd_flow_result*> batch_results;
+  for (int ii = 0; ii < kNumInstances; ++ii) {
+    batch_results.push_back(&results[ii]);
+  }
+  emd_flow_batch(batch_args, batch_results, 4);
+
+  for (int ii = 0; ii < kNumInstances; ++ii) {
+    vector<vector<bool> > support;
+    emd_flow_result result;
+    result.support = &support;
+    emd_flow(*args[ii], &result);
+    EXPECT_EQ(result.emd_cost, results[ii].emd_cost);
+    EXPECT_DOUBLE_EQ(result.amp_sum, results[ii].amp_sum);
+    EXPECT_EQ(support, supports[ii]);
+    delete args[ii];
+  }
+}
+
+TEST(EMDFlowTest, BatchMixesShapes) {
+  vector<vector<double> > y;
+  y.push_back(list_of(0.0)(1.0));
+  y.push_back(list_of(1.0)(0.0));
+  y.push_back(list_of(0.0)(0.0));
+  vector<double> quadratic_costs = list_of(0.0)(1.0)(4.0)(9.0);
+  // With one thread, the instances run in order. The network is rebuilt
+  // whenever the size or the EMD costs change and reused otherwise.
+  const int kNumInstances = 6;
+  vector<vector<double> > x[kNumInstances] = {TwoPathInstance(), y,
+      ConvexInstance(), ConvexInstance(), ConvexInstance(), TwoPathInstance()};
+  int s[] = {1, 2, 1, 1, 1, 1};
+  int emd_budget[] = {2, 0, 3, 5, 9, 0};
+  bool quadratic[] = {false, false, false, true, true, false};
+  bool expected_reuse[] = {false, true, false, false, true, false};
+  int expected_emd[] = {2, 0, 3, 5, 9, 0};
+  double expected_amp_sum[] = {201.0, 2.0, 115.0, 110.0, 115.0, 101.0};
+
+  vector<emd_flow_args> args;
+  vector<string> outputs(kNumInstances);
+  for (int ii = 0; ii < kNumInstances; ++ii) {
+    emd_flow_args instance_args(x[ii]);
+    FillArgs(s[ii], emd_budget[ii], &instance_args);
+    if (quadratic[ii]) {
+      instance_args.outdegree_vertical_distance = 3;
+      instance_args.emd_costs = quadratic_costs;
+    }
+    instance_args.output_function = AppendToString;
+    instance_args.output_context = &outputs[ii];
+    args.push_back(instance_args);
+  }
+  vector<vector<vector<bool> > > supports(kNumInstances);
+  vector<emd_flow_result> results(kNumInstances);
+  vector<const emd_flow_args*> batch_args;
+  vector<emd_flow_result*> batch_results;
+  for (int ii = 0; ii < kNumInstances; ++ii) {
+    results[ii].support = &supports[ii];
+    batch_args.push_back(&args[ii]);
+    batch_results.push_back(&results[ii]);
+  }
+  emd_flow_batch(batch_args, batch_results, 1);
+
+  for (int ii = 0; ii < kNumInstances; ++ii) {
+    CheckResult(results[ii], expected_emd[ii], expected_amp_sum[ii]);
+    EXPECT_EQ(x[ii].size(), supports[ii].size());
+    EXPECT_EQ(expected_reuse[ii], outputs[ii].find(
+        "Updated the amplitudes of the previous graph.") != string::npos)
+        << "instance " << ii;
+  }
+}
+
+TEST(EMDFlowTest, SolverMatchesSingleCalls) {
+  srand(20);
+  const int kNumFrames = 6;
+  vector<vector<vector<double> > > x(kNumFrames);
+  for (int ii = 0; ii < kNumFrames; ++ii) {
+    x[ii] = RandomAmplitudes(6, 5);
+  }
+
+  emd_flow_args solver_args(x[0]);
+  FillArgs(2, 0, &solver_args);
+  solver_args.verbose = false;
+  solver_args.warm_start = true;
+  EMDFlowSolver solver(solver_args);
+  vector<vector<double> > wrong_shape(5, vector<double>(5));
+  EXPECT_FALSE(solver.set_amplitudes(wrong_shape));
+
+  for (int ii = 0; ii < kNumFrames; ++ii) {
+    int s = 1 + ii % 3;
+    int B = ii % 5;
+    ASSERT_TRUE(solver.set_amplitudes(x[ii]));
+    solver.set_sparsity(s);
+    vector<vector<bool> > solver_support;
+    emd_flow_result solver_result;
+    solver_result.support = &solver_support;
+    solver.solve(B, &solver_result);
+
+    emd_flow_args args(x[ii]);
+    FillArgs(s, B, &args);
+    args.verbose = false;
+    vector<vector<bool> > support;
+    emd_flow_result result;
+    result.support = &support;
+    emd_flow(args, &result);
+    EXPECT_EQ(result.emd_cost, solver_result.emd_cost);
+    EXPECT_DOUBLE_EQ(result.amp_sum, solver_result.amp_sum);
+    EXPECT_EQ(support, solver_support);
+  }
+}
+
+TEST(EMDFlowTest, SolverFollowsFrames) {
+  vector<vector<double> > x = ConvexInstance();
+  emd_flow_args args(x);
+  FillArgs(1, 0, &args);
+  args.outdegree_vertical_distance = 3;
+  args.emd_costs = list_of(0.0)(1.0)(4.0)(9.0);
+  args.verbose = false;
+  args.warm_start = true;
+  EMDFlowSolver solver(args);
+  vector<vector<bool> > support;
+  emd_flow_result result;
+  result.support = &support;
+
+  int emd_budgets[] = {9, 5, 4};
+  int expected_emd[] = {9, 5, 0};
+  double expected_amp_sum[] = {115.0, 110.0, 65.0};
+  for (int ii = 0; ii < 3; ++ii) {
+    solver.solve(emd_budgets[ii], &result);
+    CheckResult(result, expected_emd[ii], expected_amp_sum[ii]);
+  }
+
+  // A frame of a different size is rejected and the solver keeps the
+  // previous one.
+  EXPECT_FALSE(solver.set_amplitudes(TwoPathInstance()));
+  solver.solve(5, &result);
+  CheckResult(result, 5, 110.0);
+  ASSERT_EQ(4u, support.size());
+
+  // The next frame is the first one upside down, so the path moves up.
+  vector<vector<double> > y(x.rbegin(), x.rend());
+  ASSERT_TRUE(solver.set_amplitudes(y));
+  solver.solve(5, &result);
+  vector<vector<bool> > expected_support(4, vector<bool>(3, false));
+  expected_support[3][0] = true;
+  expected_support[2][1] = true;
+  expected_support[0][2] = true;
+  CheckResult(result, expected_support, 5, 110.0);
+  solver.set_sparsity(2);
+  solver.solve(0, &result);
+  expected_support[0] = list_of(1)(1)(1);
+  expected_support[2] = list_of(0)(0)(0);
+  expected_support[3] = list_of(1)(1)(1);
+  CheckResult(result, expected_support, 0, 115.0);
+}
+
+TEST(EMDFlowTest, SolverKeepsSearchCopies) {
+  vector<vector<double> > x = TwoPathInstance();
+  string output;
+  emd_flow_args args(x);
+  FillArgs(1, 2, &args);
+  args.output_function = AppendToString;
+  args.output_context = &output;
+  args.num_search_threads = 3;
+  EMDFlowSolver solver(args);
+  vector<vector<bool> > support;
+  emd_flow_result result;
+  result.support = &support;
+
+  solver.solve(2, &result);
+  CheckResult(result, 2, 201.0);
+  EXPECT_NE(string::npos, output.find("Built 2 copies"));
+
+  // The copies get the new amplitudes instead of being built again.
+  vector<vector<double> > y;
+  y.push_back(list_of(100.0)(0.0));
+  y.push_back(list_of(0.0)(0.0));
+  y.push_back(list_of(0.0)(101.0));
+  ASSERT_TRUE(solver.set_amplitudes(y));
+  output.clear();
+  solver.solve(2, &result);
+  CheckResult(result, 2, 201.0);
+  EXPECT_TRUE(support[0][0] && support[2][1]);
+  EXPECT_EQ(string::npos, output.find("Built"));
+  output.clear();
+  solver.solve(0, &result);
+  CheckResult(result, 0, 101.0);
+  EXPECT_EQ(string::npos, output.find("Built"));
+}
+
+// Workspace reallocations reported in the performance diagnostics of the last
+// emd_flow call in output.
+long long GetWorkspaceReallocations(const string& output) {
+  const string kPrefix = "Workspace vector reallocations in run_flow: ";
+  size_t pos = output.rfind(kPrefix);
+  if (pos == string::npos) {
+    return -1;
+  }
+  return atoll(output.c_str() + pos + kPrefix.size());
+}
+
+TEST(EMDFlowTest, RepeatedSolvesDoNotReallocate) {
+  srand(26);
+  vector<vector<double> > x = RandomAmplitudes(30, 20);
+  for (int warm_start = 0; warm_start < 2; ++warm_start) {
+    string output;
+    emd_flow_args args(x);
+    FillArgs(3, 40, &args);
+    args.output_function = AppendToString;
+    args.output_context = &output;
+    args.warm_start = (warm_start == 1);
+    EMDFlowSolver solver(args);
+    vector<vector<bool> > support;
+    emd_flow_result result;
+    result.support = &support;
+
+    solver.solve(40, &result);
+    long long first_reallocations = GetWorkspaceReallocations(output);
+    ASSERT_LE(0, first_reallocations);
+    output.clear();
+    solver.solve(40, &result);
+    EXPECT_EQ(first_reallocations, GetWorkspaceReallocations(output));
+  }
+}
+
+TEST(EMDFlowTest, BatchSolverReusesNetworksAcrossCalls) {
+  srand(24);
+  const int kNumInstances = 8;
+  vector<vector<vector<double> > > x(kNumInstances);
+  vector<emd_flow_args> args;
+  for (int ii = 0; ii < kNumInstances; ++ii) {
+    x[ii] = RandomAmplitudes(ii < 5 ? 6 : 4, 5);
+    emd_flow_args instance_args(x[ii]);
+    FillArgs(1 + ii % 3, ii % 5, &instance_args);
+    instance_args.verbose = false;
+    args.push_back(instance_args);
+  }
+
+  EMDFlowBatchSolver solver(2);
+  vector<vector<vector<bool> > > supports(kNumInstances);
+  vector<emd_flow_result> results(kNumInstances);
+  // three calls, so some networks are reused and some are rebuilt
+  for (int begin = 0; begin < kNumInstances; begin += 3) {
+    vector<const emd_flow_args*> chunk_args;
+    vector<emd_flow_result*> chunk_results;
+    for (int ii = begin; ii < min(begin + 3, kNumInstances); ++ii) {
+      results[ii].support = &supports[ii];
+      chunk_args.push_back(&args[ii]);
+      chunk_results.push_back(&results[ii]);
+    }
+    solver.solve(chunk_args, chunk_results);
+  }
+
+  for (int ii = 0; ii < kNumInstances; ++ii) {
+    vector<vector<bool> > support;
+    emd_flow_result result;
+    result.support = &support;
+    emd_flow(args[ii], &result);
+    EXPECT_EQ(result.emd_cost, results[ii].emd_cost);
+    EXPECT_DOUBLE_EQ(result.amp_sum, results[ii].amp_sum);
+    EXPECT_EQ(support, supports[ii]);
+    EXPECT_GE(results[ii].total_time, 0.0);
+  }
+}
+
+TEST(EMDFlowTest, BatchSolverKeepsNetworkBetweenCalls) {
+  // Mirrored columns of TwoPathInstance: the best path now moves down.
+  vector<vector<double> > y;
+  y.push_back(list_of(100.0)(0.0));
+  y.push_back(list_of(0.0)(0.0));
+  y.push_back(list_of(0.0)(101.0));
+  const int kNumCalls = 4;
+  vector<vector<double> > x[kNumCalls] = {TwoPathInstance(), y,
+      ConvexInstance(), ConvexInstance()};
+  int s[] = {1, 1, 1, 2};
+  int emd_budget[] = {2, 2, 3, 0};
+  bool expected_reuse[] = {false, true, false, true};
+  int expected_emd[] = {2, 2, 3, 0};
+  double expected_amp_sum[] = {201.0, 201.0, 115.0, 115.0};
+
+  // One instance per call, so only a network kept from the previous call
+  // can be reused.
+  EMDFlowBatchSolver solver(1);
+  for (int ii = 0; ii < kNumCalls; ++ii) {
+    string output;
+    emd_flow_args args(x[ii]);
+    FillArgs(s[ii], emd_budget[ii], &args);
+    args.output_function = AppendToString;
+    args.output_context = &output;
+    vector<vector<bool> > support;
+    emd_flow_result result;
+    result.support = &support;
+    solver.solve(vector<const emd_flow_args*>(1, &args),
+        vector<emd_flow_result*>(1, &result));
+    CheckResult(result, expected_emd[ii], expected_amp_sum[ii]);
+    EXPECT_EQ(expected_reuse[ii], output.find(
+        "Updated the amplitudes of the previous graph.") != string::npos)
+        << "call " << ii;
+  }
+}
+
+TEST(EMDFlowTest, StridedAmplitudesMatchNestedVectors) {
+  srand(21);
+  const int r = 7;
+  const int c = 5;
+  vector<vector<double> > x(r, vector<double>(c));
+  vector<double> row_major(r * c);
+  vector<float> column_major(r * c);
+  for (int row = 0; row < r; ++row) {
+    for (int col = 0; col < c; ++col) {
+      x[row][col] = rand() % 100 - 50;
+      row_major[row * c + col] = x[row][col];
+      column_major[row + col * r] = x[row][col];
+    }
+  }
+  AmplitudeMatrix views[] = {
+      AmplitudeMatrix(&row_major[0], r, c, c, 1),
+      AmplitudeMatrix(&column_major[0], r, c, 1, r)};
+
+  emd_flow_args args(x);
+  FillArgs(2, 4, &args);
+  args.verbose = false;
+  vector<vector<bool> > support;
+  emd_flow_result result;
+  result.support = &support;
+  emd_flow(args, &result);
+
+  for (int ii = 0; ii < 2; ++ii) {
+    EXPECT_EQ(r, views[ii].get_num_rows());
+    EXPECT_EQ(c, views[ii].get_num_columns());
+    EXPECT_EQ(x[r - 1][1], views[ii](r - 1, 1));
+    emd_flow_args view_args(args);
+    view_args.x = views[ii];
+    vector<vector<bool> > view_support;
+    emd_flow_result view_result;
+    view_result.support = &view_support;
+    emd_flow(view_args, &view_result);
+    EXPECT_EQ(result.emd_cost, view_result.emd_cost);
+    EXPECT_DOUBLE_EQ(result.amp_sum, view_result.amp_sum);
+    EXPECT_EQ(support, view_support);
+  }
+}
+
+// Best value of lambda * EMD - amplitude sum for a single path (s = 1),
+// computed with a simple dynamic program over the columns.
+double SinglePathOptimum(const vector<vector<double> >& x,
+                         const vector<double>& emd_costs,
+                         double lambda) {
+  int r = x.size();
+  int c = x[0].size();
+  vector<double> best(r);
+  for (int row = 0; row < r; ++row) {
+    best[row] = -x[row][0];
+  }
+  for (int col = 1; col < c; ++col) {
+    vector<double> next(r);
+    for (int row = 0; row < r; ++row) {
+      next[row] = best[0] + lambda * emd_costs[abs(row)];
+      for (int prev = 1; prev < r; ++prev) {
+        next[row] = min(next[row],
+            best[prev] + lambda * emd_costs[abs(row - prev)]);
+      }
+      next[row] -= x[row][col];
+    }
+    best = next;
+  }
+  return *min_element(best.begin(), best.end());
+}
+
+TEST(EMDFlowNetworkTest, ChainGadgetMatchesSinglePath) {
+  for (int trial = 0; trial < 50; ++trial) {
+    vector<vector<double> > x = RandomInstance(1700 + trial, 8, 6, 1);
+    int r = x.size();
+    vector<double> emd_costs;
+    for (int ii = 0; ii < r; ++ii) {
+      emd_costs.push_back(trial % 3 + ii * (trial % 4));
+    }
+
+    auto_ptr<EMDFlowNetwork> network =
+        EMDFlowNetworkFactory::create_EMD_flow_network(x, r - 1, emd_costs,
+            EMDFlowNetworkFactory::kShortestAugmentingPath);
+    network->set_sparsity(1);
+    double lambda = 0.25 * (trial % 8);
+    network->run_flow(lambda, 1.0);
+    EXPECT_DOUBLE_EQ(SinglePathOptimum(x, emd_costs, lambda),
+        lambda * network->get_EMD_used()
+        - network->get_supported_amplitude_sum());
+  }
+}
+
+TEST(EMDFlowNetworkTest, ChainGadgetLongMoves) {
+  // One 100 per column in rows 0, 5 and 2. With the affine costs 1 + d, the
+  // path through all three moves by five and three rows and pays 6 + 4.
+  vector<vector<double> > x(6, vector<double>(3, 0.0));
+  x[0][0] = 100.0;
+  x[5][1] = 100.0;
+  x[2][2] = 100.0;
+  vector<double> emd_costs;
+  for (int ii = 0; ii < 6; ++ii) {
+    emd_costs.push_back(1.0 + ii);
+  }
+  auto_ptr<EMDFlowNetwork> network =
+      EMDFlowNetworkFactory::create_EMD_flow_network(x, 5, emd_costs,
+          EMDFlowNetworkFactory::kShortestAugmentingPath);
+  // source, sink, two nodes per entry and one chain node per row and column gap
+  ASSERT_EQ(2 + 2 * 6 * 3 + 6 * 2, network->get_num_nodes());
+  network->set_sparsity(1);
+
+  network->run_flow(10.0, 1.0);
+  EXPECT_EQ(10, network->get_EMD_used());
+  EXPECT_DOUBLE_EQ(300.0, network->get_supported_amplitude_sum());
+  vector<vector<bool> > support;
+  network->get_support(&support);
+  EXPECT_TRUE(support[0][0] && support[5][1] && support[2][2]);
+  // The path skips the 100 in row 5 (cost 4 instead of 10).
+  network->run_flow(20.0, 1.0);
+  EXPECT_EQ(4, network->get_EMD_used());
+  EXPECT_DOUBLE_EQ(200.0, network->get_supported_amplitude_sum());
+  // Every path costs at least the offsets, 2.
+  network->run_flow(60.0, 1.0);
+  EXPECT_EQ(2, network->get_EMD_used());
+  EXPECT_DOUBLE_EQ(100.0, network->get_supported_amplitude_sum());
+}
+
+TEST(EMDFlowNetworkTest, ChainGadgetMatchesFullGraph) {
+  srand(25);
+  for (int trial = 0; trial < 50; ++trial) {
+    int r = 3 + rand() % 6;
+    int c = 2 + rand() % 5;
+    vector<vector<double> > x(r, vector<double>(c));
+    for (int row = 0; row < r; ++row) {
+      for (int col = 0; col < c; ++col) {
+        x[row][col] = (rand() % 10000) / 100.0;
+      }
+    }
+    // Non-integer affine costs. Perturbing the last cost slightly makes
+    // them non-affine, so the second network has explicit edges.
+    vector<double> emd_costs;
+    for (int ii = 0; ii < r; ++ii) {
+      emd_costs.push_back(0.5 * (ii + 1));
+    }
+    vector<double> perturbed_costs = emd_costs;
+    perturbed_costs.back() += 1e-9;
+
+    auto_ptr<EMDFlowNetwork> chain_network =
+        EMDFlowNetworkFactory::create_EMD_flow_network(x, r - 1, emd_costs,
+            EMDFlowNetworkFactory::kShortestAugmentingPath);
+    auto_ptr<EMDFlowNetwork> full_network =
+        EMDFlowNetworkFactory::create_EMD_flow_network(x, r - 1,
+            perturbed_costs, EMDFlowNetworkFactory::kShortestAugmentingPath);
+    ASSERT_GT(chain_network->get_num_nodes(), full_network->get_num_nodes());
+    int s = 2 + rand() % (r - 1);
+    double lambda = 0.1 + 0.37 * (trial % 8);
+    chain_network->set_sparsity(s);
+    full_network->set_sparsity(s);
+    chain_network->run_flow(lambda, 1.0);
+    full_network->run_flow(lambda, 1.0);
+    EXPECT_EQ(full_network->get_EMD_used(), chain_network->get_EMD_used());
+    EXPECT_NEAR(full_network->get_supported_amplitude_sum(),
+        chain_network->get_supported_amplitude_sum(), 1e-6);
+  }
+}
+
+TEST(EMDFlowNetworkTest, ConvexCostsChangeTheOptimum) {
+  vector<double> quadratic_costs = list_of(0.0)(1.0)(4.0)(9.0);
+  auto_ptr<EMDFlowNetwork> network =
+      EMDFlowNetworkFactory::create_EMD_flow_network(ConvexInstance(), 3,
+          quadratic_costs, EMDFlowNetworkFactory::kShortestAugmentingPath);
+  network->set_sparsity(1);
+  network->run_flow(2.0, 1.0);
+  EXPECT_EQ(5, network->get_EMD_used());
+  EXPECT_DOUBLE_EQ(110.0, network->get_supported_amplitude_sum());
+  vector<vector<bool> > support;
+  network->get_support(&support);
+  EXPECT_TRUE(support[0][0] && support[1][1] && support[3][2]);
+
+  // With the linear costs of the same outdegree, the direct jump by three
+  // rows is cheaper and wins.
+  vector<double> linear_costs = list_of(0.0)(1.0)(2.0)(3.0);
+  network = EMDFlowNetworkFactory::create_EMD_flow_network(ConvexInstance(), 3,
+      linear_costs, EMDFlowNetworkFactory::kShortestAugmentingPath);
+  network->set_sparsity(1);
+  network->run_flow(2.0, 1.0);
+  EXPECT_EQ(3, network->get_EMD_used());
+  EXPECT_DOUBLE_EQ(115.0, network->get_supported_amplitude_sum());
+}
+
+TEST(EMDFlowNetworkTest, ConvexCostsMatchSinglePath) {
+  for (int trial = 0; trial < 50; ++trial) {
+    vector<vector<double> > x = RandomInstance(2300 + trial, 8, 6, 1);
+    int r = x.size();
+    // Quadratic costs are convex but not affine. Distances beyond the
+    // outdegree get an infinite cost in the single path computation.
+    int outdegree = rand() % r;
+    vector<double> emd_costs;
+    vector<double> all_costs;
+    for (int ii = 0; ii < r; ++ii) {
+      if (ii <= outdegree) {
+        emd_costs.push_back(ii * ii);
+        all_costs.push_back(ii * ii);
+      } else {
+        all_costs.push_back(1e10);
+      }
+    }
+
+    auto_ptr<EMDFlowNetwork> network =
+        EMDFlowNetworkFactory::create_EMD_flow_network(x, outdegree, emd_costs,
+            EMDFlowNetworkFactory::kShortestAugmentingPath);
+    network->set_sparsity(1);
+    double lambda = 0.25 * (trial % 8) + 0.1;
+    network->run_flow(lambda, 1.0);
+    EXPECT_NEAR(SinglePathOptimum(x, all_costs, lambda),
+        lambda * network->get_EMD_used()
+        - network->get_supported_amplitude_sum(), 1e-9);
+  }
+}
+
+TEST(EMDFlowNetworkTest, WarmStartMatchesColdSolve) {
+  for (int trial = 0; trial < 40; ++trial) {
+    vector<vector<double> > x = RandomInstance(700 + trial, 11, 9);
+    int r = x.size();
+    // odd trials use the chain gadget
+    int outdegree = (trial % 2 == 1) ? r - 1 : rand() % r;
+    vector<double> emd_costs;
+    for (int ii = 0; ii <= outdegree; ++ii) {
+      emd_costs.push_back(trial % 2 == 1 ? ii : ii * ii);
+    }
+
+    auto_ptr<EMDFlowNetwork> cold =
+        EMDFlowNetworkFactory::create_EMD_flow_network(x, outdegree, emd_costs,
+            EMDFlowNetworkFactory::kShortestAugmentingPath);
+    auto_ptr<EMDFlowNetwork> warm =
+        EMDFlowNetworkFactory::create_EMD_flow_network(x, outdegree, emd_costs,
+            EMDFlowNetworkFactory::kShortestAugmentingPath);
+    warm->set_warm_start(true);
+    int s = 1 + rand() % r;
+    cold->set_sparsity(s);
+    warm->set_sparsity(s);
+
+    double emd_lambdas[] = {1.0, 0.5, 4.0, 2.0, 1.5, 0.0, 1.75, 1.625, 100.0};
+    double signal_lambdas[] = {0.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 1.0};
+    for (int ii = 0; ii < 9; ++ii) {
+      cold->run_flow(emd_lambdas[ii], signal_lambdas[ii]);
+      warm->run_flow(emd_lambdas[ii], signal_lambdas[ii]);
+      EXPECT_NEAR(signal_lambdas[ii] * cold->get_supported_amplitude_sum()
+              - emd_lambdas[ii] * cold->get_EMD_used(),
+          signal_lambdas[ii] * warm->get_supported_amplitude_sum()
+              - emd_lambdas[ii] * warm->get_EMD_used(), 1e-6);
+    }
+  }
+}
+
+TEST(EMDFlowNetworkTest, WarmStartFollowsLambdaChanges) {
+  vector<double> emd_costs = list_of(0.0)(1.0)(4.0)(9.0);
+  auto_ptr<EMDFlowNetwork> network =
+      EMDFlowNetworkFactory::create_EMD_flow_network(ConvexInstance(), 3,
+          emd_costs, EMDFlowNetworkFactory::kShortestAugmentingPath);
+  network->set_warm_start(true);
+  network->set_sparsity(1);
+  // The optimal path changes at lambda 9 and 1.25. The step from 8.5 to 8
+  // keeps the optimum and is repaired from the previous flow.
+  double emd_lambdas[] = {9.5, 8.5, 8.0, 1.5, 1.0};
+  int expected_emd[] = {0, 5, 5, 5, 9};
+  double expected_amp_sum[] = {65.0, 110.0, 110.0, 110.0, 115.0};
+  for (int ii = 0; ii < 5; ++ii) {
+    network->run_flow(emd_lambdas[ii], 1.0);
+    EXPECT_EQ(expected_emd[ii], network->get_EMD_used());
+    EXPECT_DOUBLE_EQ(expected_amp_sum[ii],
+        network->get_supported_amplitude_sum());
+  }
+
+  string output;
+  network->get_performance_diagnostics(&output);
+  const string kPrefix = "Warm starts: ";
+  size_t pos = output.find(kPrefix);
+  ASSERT_NE(string::npos, pos);
+  EXPECT_LE(1, atoll(output.c_str() + pos + kPrefix.size()));
+}
+
+TEST(EMDFlowNetworkTest, SetAmplitudesMatchesNewNetwork) {
+  for (int trial = 0; trial < 20; ++trial) {
+    vector<vector<double> > x = RandomInstance(1300 + trial, 11, 9);
+    int r = x.size();
+    vector<vector<double> > y = RandomAmplitudes(r, x[0].size());
+    // odd trials use the chain gadget
+    int outdegree = (trial % 2 == 1) ? r - 1 : rand() % r;
+    vector<double> emd_costs;
+    for (int ii = 0; ii <= outdegree; ++ii) {
+      emd_costs.push_back(trial % 2 == 1 ? ii : ii * ii);
+    }
+
+    auto_ptr<EMDFlowNetwork> reused =
+        EMDFlowNetworkFactory::create_EMD_flow_network(x, outdegree, emd_costs,
+            EMDFlowNetworkFactory::kShortestAugmentingPath);
+    reused->set_warm_start(trial % 4 >= 2);
+    int s = 1 + rand() % r;
+    reused->set_sparsity(s);
+    reused->run_flow(1.0, 1.0);
+    ASSERT_TRUE(reused->set_amplitudes(y));
+
+    auto_ptr<EMDFlowNetwork> fresh =
+        EMDFlowNetworkFactory::create_EMD_flow_network(y, outdegree, emd_costs,
+            EMDFlowNetworkFactory::kShortestAugmentingPath);
+    fresh->set_sparsity(s);
+    double emd_lambdas[] = {1.0, 0.5, 4.0, 0.0};
+    for (int ii = 0; ii < 4; ++ii) {
+      reused->run_flow(emd_lambdas[ii], 1.0);
+      fresh->run_flow(emd_lambdas[ii], 1.0);
+      EXPECT_NEAR(fresh->get_supported_amplitude_sum()
+              - emd_lambdas[ii] * fresh->get_EMD_used(),
+          reused->get_supported_amplitude_sum()
+              - emd_lambdas[ii] * reused->get_EMD_used(), 1e-6);
+    }
+  }
+}
+
+TEST(EMDFlowNetworkTest, ChainGadgetHasLinearlyManyEdges) {
+  const int r = 100;
+  const int c = 3;
+  vector<vector<double> > x(r, vector<double>(c, 1.0));
+  vector<double> emd_costs;
+  for (int ii = 0; ii < r; ++ii) {
+    emd_costs.push_back(ii);
+  }
+  auto_ptr<EMDFlowNetwork> network =
+      EMDFlowNetworkFactory::create_EMD_flow_network(x, r - 1, emd_costs,
+          EMDFlowNetworkFactory::kShortestAugmentingPath);
+  EXPECT_LT(network->get_num_edges(), 20 * r * c);
+}
+
+TEST(EMDFlowNetworkTest, IndexTypes) {
+  EXPECT_TRUE(EMDFlowNetworkSAP<uint32_t>::index_type_suffices(1000, 1000,
+      -1, vector<double>()));
+  EXPECT_FALSE(EMDFlowNetworkSAP<uint32_t>::index_type_suffices(5000, 5000,
+      4999, vector<double>()));
+  EXPECT_TRUE(EMDFlowNetworkSAP<uint64_t>::index_type_suffices(5000, 5000,
+      4999, vector<double>()));
+
+  vector<vector<double> > x;
+  x.push_back(list_of(0.0)(3.0)(1.0));
+  x.push_back(list_of(2.0)(0.0)(4.0));
+  x.push_back(list_of(1.0)(5.0)(0.0));
+  vector<double> emd_costs = list_of(0.0)(1.0)(4.0);
+  EMDFlowNetworkSAP<uint32_t> network32(x, 2, emd_costs);
+  EMDFlowNetworkSAP<uint64_t> network64(x, 2, emd_costs);
+  network32.set_sparsity(2);
+  network64.set_sparsity(2);
+  network32.run_flow(0.5, 1.0);
+  network64.run_flow(0.5, 1.0);
+  EXPECT_EQ(network32.get_EMD_used(), network64.get_EMD_used());
+  EXPECT_DOUBLE_EQ(network32.get_supported_amplitude_sum(),
+      network64.get_supported_amplitude_sum());
+}
+
+TEST(EMDFlowNetworkTest, PriorityQueuesAgree) {
+  vector<vector<double> > x(12, vector<double>(9));
+  srand(42);
+  for (size_t row = 0; row < x.size(); ++row) {
+    for (size_t col = 0; col < x[row].size(); ++col) {
+      x[row][col] = rand() % 1000;
+    }
+  }
+  vector<double> emd_costs = list_of(0.0)(1.0)(4.0)(9.0);
+
+  EMDFlowNetworkSAP<uint32_t, LazyBinaryHeap> lazy(x, 3, emd_costs);
+  EMDFlowNetworkSAP<uint32_t, IndexedFourAryHeap> four_ary(x, 3, emd_costs);
+  EMDFlowNetworkSAP<uint32_t, RadixHeap> radix(x, 3, emd_costs);
+  double lambdas[] = {0.0, 1.0, 10.0, 100.0};
+  for (int s = 1; s <= 4; ++s) {
+    lazy.set_sparsity(s);
+    four_ary.set_sparsity(s);
+    radix.set_sparsity(s);
+    for (int ii = 0; ii < 4; ++ii) {
+      lazy.run_flow(lambdas[ii], 1.0);
+      four_ary.run_flow(lambdas[ii], 1.0);
+      radix.run_flow(lambdas[ii], 1.0);
+      double objective = lazy.get_supported_amplitude_sum()
+          - lambdas[ii] * lazy.get_EMD_used();
+      EXPECT_DOUBLE_EQ(objective, four_ary.get_supported_amplitude_sum()
+          - lambdas[ii] * four_ary.get_EMD_used());
+      EXPECT_DOUBLE_EQ(objective, radix.get_supported_amplitude_sum()
+          - lambdas[ii] * radix.get_EMD_used());
+    }
+  }
+}
+
+TEST(EMDFlowNetworkFactoryTest, ParseType) {
+  EXPECT_EQ(EMDFlowNetworkFactory::kShortestAugmentingPath,
+      EMDFlowNetworkFactory::parse_type("sap"));
+  EXPECT_EQ(EMDFlowNetworkFactory::kShortestAugmentingPathFourAryHeap,
+      EMDFlowNetworkFactory::parse_type("sap-4ary-heap"));
+  EXPECT_EQ(EMDFlowNetworkFactory::kShortestAugmentingPathRadixHeap,
+      EMDFlowNetworkFactory::parse_type("sap-radix-heap"));
+  EXPECT_EQ(EMDFlowNetworkFactory::kUnknownType,
+      EMDFlowNetworkFactory::parse_type("dijkstra"));
+}
+
+TEST(EMDFlowParametricTest, ConvexCostBreakpoints) {
+  vector<double> emd_costs = list_of(0.0)(1.0)(4.0)(9.0);
+  auto_ptr<EMDFlowNetwork> network =
+      EMDFlowNetworkFactory::create_EMD_flow_network(ConvexInstance(), 3,
+          emd_costs, EMDFlowNetworkFactory::kShortestAugmentingPath);
+  network->set_sparsity(1);
+  EMDFlowParametricSolver solver(network.get());
+  solver.compute_breakpoints();
+  // The path 0, 0, 0 with EMD 0 and amplitude sum 65, then the paths of
+  // ConvexInstance. The line from the first to the last breakpoint lies
+  // below the middle one, so none of them is skipped.
+  const vector<emd_flow_breakpoint>& breakpoints = solver.get_breakpoints();
+  ASSERT_EQ(3u, breakpoints.size());
+  EXPECT_EQ(0, breakpoints[0].emd_cost);
+  EXPECT_DOUBLE_EQ(65.0, breakpoints[0].amp_sum);
+  EXPECT_DOUBLE_EQ(9.0, breakpoints[0].lambda_low);
+  EXPECT_EQ(5, breakpoints[1].emd_cost);
+  EXPECT_DOUBLE_EQ(110.0, breakpoints[1].amp_sum);
+  EXPECT_DOUBLE_EQ(1.25, breakpoints[1].lambda_low);
+  EXPECT_DOUBLE_EQ(9.0, breakpoints[1].lambda_high);
+  EXPECT_EQ(9, breakpoints[2].emd_cost);
+  EXPECT_DOUBLE_EQ(115.0, breakpoints[2].amp_sum);
+  EXPECT_DOUBLE_EQ(0.0, breakpoints[2].lambda_low);
+  EXPECT_DOUBLE_EQ(1.25, breakpoints[2].lambda_high);
+  EXPECT_EQ(-1, solver.find_breakpoint(-1));
+  EXPECT_EQ(0, solver.find_breakpoint(4));
+  EXPECT_EQ(1, solver.find_breakpoint(5));
+  EXPECT_EQ(1, solver.find_breakpoint(8));
+  EXPECT_EQ(2, solver.find_breakpoint(9));
+}
+
+TEST(EMDFlowParametricTest, BreakpointsAreOptimal) {
+  for (int trial = 0; trial < 20; ++trial) {
+    vector<vector<double> > x = RandomInstance(1100 + trial, 9, 7);
+    int r = x.size();
+    vector<double> emd_costs;
+    for (int ii = 0; ii < r; ++ii) {
+      emd_costs.push_back(trial % 2 == 1 ? ii : ii * ii);
+    }
+    int s = 1 + rand() % r;
+
+    auto_ptr<EMDFlowNetwork> network =
+        EMDFlowNetworkFactory::create_EMD_flow_network(x, r - 1, emd_costs,
+            EMDFlowNetworkFactory::kShortestAugmentingPath);
+    network->set_sparsity(s);
+    network->set_warm_start(trial % 4 < 2);
+    EMDFlowParametricSolver solver(network.get());
+    solver.compute_breakpoints();
+    const vector<emd_flow_breakpoint>& breakpoints = solver.get_breakpoints();
+    ASSERT_LT(0u, breakpoints.size());
+    EXPECT_GE(2 * static_cast<int>(breakpoints.size()) + 1,
+        solver.get_num_run_flow_calls());
+    EXPECT_DOUBLE_EQ(0.0, breakpoints.back().lambda_low);
+
+    auto_ptr<EMDFlowNetwork> reference =
+        EMDFlowNetworkFactory::create_EMD_flow_network(x, r - 1, emd_costs,
+            EMDFlowNetworkFactory::kShortestAugmentingPath);
+    reference->set_sparsity(s);
+    for (size_t ii = 0; ii < breakpoints.size(); ++ii) {
+      if (ii > 0) {
+        EXPECT_LT(breakpoints[ii - 1].emd_cost, breakpoints[ii].emd_cost);
+        EXPECT_LT(breakpoints[ii - 1].amp_sum, breakpoints[ii].amp_sum);
+        EXPECT_GT(breakpoints[ii - 1].lambda_low, breakpoints[ii].lambda_low);
+      }
+      EXPECT_EQ(static_cast<int>(ii),
+          solver.find_breakpoint(breakpoints[ii].emd_cost));
+
+      solver.solve_at_breakpoint(breakpoints[ii]);
+      EXPECT_EQ(breakpoints[ii].emd_cost, network->get_EMD_used());
+      EXPECT_DOUBLE_EQ(breakpoints[ii].amp_sum,
+          network->get_supported_amplitude_sum());
+
+      // At the ends of the interval, the relaxation has the same optimum as
+      // the breakpoint.
+      double lambda = breakpoints[ii].lambda_low;
+      reference->run_flow(lambda, 1.0);
+      EXPECT_NEAR(breakpoints[ii].amp_sum - lambda * breakpoints[ii].emd_cost,
+          reference->get_supported_amplitude_sum()
+              - lambda * reference->get_EMD_used(), 1e-9);
+    }
+    EXPECT_EQ(-1, solver.find_breakpoint(breakpoints[0].emd_cost - 1));
+
+    // The search for a single budget finds the same breakpoints.
+    for (int budget = breakpoints[0].emd_cost - 1;
+         budget <= breakpoints.back().emd_cost + 1; ++budget) {
+      int index = solver.find_breakpoint(budget);
+      emd_flow_breakpoint breakpoint;
+      ASSERT_EQ(index >= 0, solver.compute_breakpoint(budget, &breakpoint));
+      if (index < 0) {
+        EXPECT_EQ(breakpoints[0].emd_cost, breakpoint.emd_cost);
+        continue;
+      }
+      EXPECT_EQ(breakpoints[index].emd_cost, breakpoint.emd_cost);
+      EXPECT_DOUBLE_EQ(breakpoints[index].amp_sum, breakpoint.amp_sum);
+      EXPECT_DOUBLE_EQ(breakpoints[index].lambda_low, breakpoint.lambda_low);
+      EXPECT_DOUBLE_EQ(breakpoints[index].lambda_high, breakpoint.lambda_high);
+    }
+  }
+}
+
+TEST(EMDFlowIOTest, ReadsRawAndNpyFiles) {
+  const char* file_name = "emd_flow_test_input.tmp";
+  // 2 x 3 float32 matrix in a raw file
+  float raw_entries[] = {1, -2, 3, 4, 5, 6.5};
+  unsigned char raw_header[] = {'E', 'M', 'D', 'F', 4, 0, 0, 0,
+                                2, 0, 0, 0, 3, 0, 0, 0};
+  FILE* file = fopen(file_name, "wb");
+  fwrite(raw_header, 1, sizeof(raw_header), file);
+  fwrite(raw_entries, sizeof(float), 6, file);
+  fclose(file);
+
+  AmplitudeFile input;
+  string error;
+  ASSERT_TRUE(input.open(file_name, &error));
+  ASSERT_EQ(2, input.get_matrix().get_num_rows());
+  ASSERT_EQ(3, input.get_matrix().get_num_columns());
+  EXPECT_EQ(-2, input.get_matrix()(0, 1));
+  EXPECT_EQ(6.5, input.get_matrix()(1, 2));
+
+  // the same matrix as float64 in Fortran order in a .npy file
+  double npy_entries[] = {1, 4, -2, 5, 3, 6.5};
+  string header = "{'descr': '<f8', 'fortran_order': True, "
+      "'shape': (2, 3), }";
+  header.append(128 - 10 - header.size() - 1, ' ');
+  header += '\n';
+  file = fopen(file_name, "wb");
+  fwrite("\x93NUMPY\x01\x00", 1, 8, file);
+  unsigned char header_length[] = {static_cast<unsigned char>(header.size()),
+                                   0};
+  fwrite(header_length, 1, 2, file);
+  fwrite(header.data(), 1, header.size(), file);
+  fwrite(npy_entries, sizeof(double), 6, file);
+  fclose(file);
+
+  ASSERT_TRUE(input.open(file_name, &error));
+  ASSERT_EQ(2, input.get_matrix().get_num_rows());
+  ASSERT_EQ(3, input.get_matrix().get_num_columns());
+  EXPECT_EQ(-2, input.get_matrix()(0, 1));
+  EXPECT_EQ(4, input.get_matrix()(1, 0));
+  EXPECT_EQ(6.5, input.get_matrix()(1, 2));
+
+  // truncated data
+  file = fopen(file_name, "wb");
+  fwrite(raw_header, 1, sizeof(raw_header), file);
+  fwrite(raw_entries, sizeof(float), 5, file);
+  fclose(file);
+  EXPECT_FALSE(input.open(file_name, &error));
+
+  // more than INT_MAX rows
+  raw_header[11] = 0x80;
+  file = fopen(file_name, "wb");
+  fwrite(raw_header, 1, sizeof(raw_header), file);
+  fwrite(raw_entries, sizeof(float), 6, file);
+  fclose(file);
+  EXPECT_FALSE(input.open(file_name, &error));
+
+  // rows * cols * 8 bytes does not fit into 64 bits
+  header = "{'descr': '<f8', 'fortran_order': False, "
+      "'shape': (2147483647, 2147483647), }";
+  header.append(128 - 10 - header.size() - 1, ' ');
+  header += '\n';
+  file = fopen(file_name, "wb");
+  fwrite("\x93NUMPY\x01\x00", 1, 8, file);
+  header_length[0] = header.size();
+  fwrite(header_length, 1, 2, file);
+  fwrite(header.data(), 1, header.size(), file);
+  fwrite(npy_entries, sizeof(double), 6, file);
+  fclose(file);
+  EXPECT_FALSE(input.open(file_name, &error));
+  remove(file_name);
+}
+
+TEST(EMDFlowIOTest, WritesPackedSupport) {
+  const char* file_name = "emd_flow_test_output.tmp";
+  vector<vector<bool> > support(3, vector<bool>(3, false));
+  support[0][0] = true;
+  support[1][2] = true;
+  support[2][2] = true;
+  ASSERT_TRUE(write_support_packed(file_name, support));
+
+  unsigned char data[20];
+  FILE* file = fopen(file_name, "rb");
+  size_t size = fread(data, 1, sizeof(data), file);
+  fclose(file);
+  remove(file_name);
+  unsigned char expected[] = {'E', 'M', 'D', 'S', 3, 0, 0, 0, 3, 0, 0, 0,
+                              0x84, 0x80};
+  ASSERT_EQ(sizeof(expected), size);
+  for (size_t ii = 0; ii < size; ++ii) {
+    EXPECT_EQ(expected[ii], data[ii]);
+  }
+}
 
 int main(int argc, char **argv) {
   ::testing::InitGoogleTest(&argc, argv);                                       
@@ -2,8 +2,10 @@
 #include <cstdio>
 #include <cmath>
 #include <boost/program_options.hpp>
+#include <pthread.h>
 
 #include "emd_flow.h"
+#include "emd_flow_io.h"
 #include "emd_flow_network_factory.h"
 
 using namespace std;
@@ -15,80 +17,392 @@ int r, c;
 int s;
 // EMD bound
 int emd_bound;
-// amplitudes
+// amplitudes (read from stdin or, with --input, copied for squaring)
 std::vector<std::vector<double> > a;
+// amplitudes with --input
+AmplitudeFile input_file;
 // result
 std::vector<std::vector<bool> > support;
 
-void output_function(const char* s) {
+void output_function(const char* s, void*) {
   fprintf(stderr, s);
   fflush(stderr);
 }
 
+// Reads r x c amplitudes (absolute values) as text.
+bool read_amplitudes(FILE* input, int r, int c,
+    vector<vector<double> >* amplitudes) {
+  amplitudes->resize(r);
+  for (int ii = 0; ii < r; ++ii) {
+    (*amplitudes)[ii].resize(c);
+    for (int jj = 0; jj < c; ++jj) {
+      if (fscanf(input, "%lg", &((*amplitudes)[ii][jj])) != 1) {
+        return false;
+      }
+      (*amplitudes)[ii][jj] = abs((*amplitudes)[ii][jj]);
+    }
+  }
+  return true;
+}
+
+// An instance in batch mode
+struct batch_instance {
+  vector<vector<double> > a;
+  vector<vector<bool> > support;
+  emd_flow_args args;
+  emd_flow_result result;
+
+  batch_instance(const emd_flow_args& options) : args(options) { }
+};
+
+// Reads the next instance of the batch input: "r c s B" (or "r c s B_low
+// B_high" with emd_interval) followed by the amplitudes. Returns false at
+// the end of the input and sets *error if the instance is incomplete or
+// invalid.
+bool read_batch_instance(FILE* input, bool emd_interval, bool square,
+    batch_instance* instance, bool* error) {
+  int r = 0;
+  int c = 0;
+  int emd_bound_high = 0;
+  int num_read = fscanf(input, "%d %d %d %d", &r, &c, &instance->args.s,
+                        &instance->args.emd_bound_low);
+  if (num_read == EOF) {
+    *error = false;
+    return false;
+  }
+  *error = true;
+  if (num_read != 4
+      || (emd_interval && fscanf(input, "%d", &emd_bound_high) != 1)) {
+    return false;
+  }
+  if (!emd_interval) {
+    emd_bound_high = instance->args.emd_bound_low;
+  }
+  if (r <= 0 || c <= 0 || instance->args.s <= 0
+      || instance->args.emd_bound_low < 0
+      || emd_bound_high < instance->args.emd_bound_low
+      || !read_amplitudes(input, r, c, &instance->a)) {
+    return false;
+  }
+  instance->args.emd_bound_high = emd_bound_high;
+  if (square) {
+    for (int ii = 0; ii < r; ++ii) {
+      for (int jj = 0; jj < c; ++jj) {
+        instance->a[ii][jj] *= instance->a[ii][jj];
+      }
+    }
+  }
+  instance->args.x = instance->a;
+  instance->result.support = &instance->support;
+  *error = false;
+  return true;
+}
+
+// State shared by the threads of run_batch. Instance ii is stored in
+// instances[ii % instances.size()], so at most instances.size() instances
+// are read ahead of the last printed result.
+struct batch_state {
+  FILE* input;
+  bool emd_interval;
+  bool square;
+  FILE* text_output;
+  FILE* packed_output;
+  EMDFlowBatchSolver* solver;
+  vector<batch_instance> instances;
+  vector<bool> solved;
+  // number of instances read and printed
+  int num_read;
+  int num_printed;
+  bool end_of_input;
+  bool error;
+  // Guards reading the input. Held while waiting for a free slot, so the
+  // instances are read in order.
+  pthread_mutex_t input_mutex;
+  // Guards everything else and the output.
+  pthread_mutex_t mutex;
+  pthread_cond_t slot_freed;
+};
+
+// Prints the results of all solved instances that directly follow the last
+// printed one. state->mutex must be held.
+void print_solved_instances(batch_state* state) {
+  bool printed = false;
+  while (state->num_printed < state->num_read
+      && state->solved[state->num_printed % state->instances.size()]) {
+    int slot = state->num_printed % state->instances.size();
+    const emd_flow_result& result = state->instances[slot].result;
+    printf("%d %d %f %f\n", state->num_printed, result.emd_cost,
+        result.amp_sum, result.total_time);
+    if (state->text_output != NULL) {
+      write_support_text(*result.support, state->text_output);
+      fprintf(state->text_output, "\n");
+      fflush(state->text_output);
+    }
+    if (state->packed_output != NULL) {
+      write_support_packed(*result.support, state->packed_output);
+      fflush(state->packed_output);
+    }
+    state->solved[slot] = false;
+    ++state->num_printed;
+    printed = true;
+  }
+  if (printed) {
+    fflush(stdout);
+    pthread_cond_broadcast(&state->slot_freed);
+  }
+}
+
+// Reads and solves instances until the input ends.
+void batch_task(int worker, void* raw_state) {
+  batch_state* state = static_cast<batch_state*>(raw_state);
+  int num_slots = state->instances.size();
+  while (true) {
+    pthread_mutex_lock(&state->input_mutex);
+    pthread_mutex_lock(&state->mutex);
+    while (!state->end_of_input
+        && state->num_read - state->num_printed >= num_slots) {
+      pthread_cond_wait(&state->slot_freed, &state->mutex);
+    }
+    bool end_of_input = state->end_of_input;
+    int slot = state->num_read % num_slots;
+    pthread_mutex_unlock(&state->mutex);
+
+    bool error = false;
+    bool has_instance = (!end_of_input
+        && read_batch_instance(state->input, state->emd_interval,
+                               state->square, &state->instances[slot],
+                               &error));
+
+    pthread_mutex_lock(&state->mutex);
+    if (has_instance) {
+      ++state->num_read;
+    } else if (!end_of_input) {
+      state->end_of_input = true;
+      state->error = error;
+      pthread_cond_broadcast(&state->slot_freed);
+    }
+    pthread_mutex_unlock(&state->mutex);
+    pthread_mutex_unlock(&state->input_mutex);
+    if (!has_instance) {
+      return;
+    }
+
+    batch_instance& instance = state->instances[slot];
+    state->solver->solve(worker, instance.args, &instance.result);
+
+    pthread_mutex_lock(&state->mutex);
+    state->solved[slot] = true;
+    print_solved_instances(state);
+    pthread_mutex_unlock(&state->mutex);
+  }
+}
+
+// Solves a stream of instances on num_threads threads. Instances of the same
+// shape reuse the flow networks of the threads. For each instance, one line
+// "index emd_cost amp_sum time" is written to stdout, in input order and as
+// soon as the instance and all instances before it are solved. At most
+// queue_size instances are read ahead of the last printed result. The
+// supports are appended to text_output and packed_output (if not NULL).
+// Returns the exit code.
+int run_batch(FILE* input, bool emd_interval, bool square,
+    const emd_flow_args& options, int num_threads, int queue_size,
+    FILE* text_output, FILE* packed_output) {
+  num_threads = max(1, num_threads);
+  EMDFlowBatchSolver solver(num_threads);
+  batch_state state;
+  state.input = input;
+  state.emd_interval = emd_interval;
+  state.square = square;
+  state.text_output = text_output;
+  state.packed_output = packed_output;
+  state.solver = &solver;
+  state.instances.resize(max(num_threads, queue_size),
+                         batch_instance(options));
+  state.solved.resize(state.instances.size(), false);
+  state.num_read = 0;
+  state.num_printed = 0;
+  state.end_of_input = false;
+  state.error = false;
+  pthread_mutex_init(&state.input_mutex, NULL);
+  pthread_mutex_init(&state.mutex, NULL);
+  pthread_cond_init(&state.slot_freed, NULL);
+
+  solver.run_workers(batch_task, &state);
+
+  pthread_cond_destroy(&state.slot_freed);
+  pthread_mutex_destroy(&state.mutex);
+  pthread_mutex_destroy(&state.input_mutex);
+
+  if (state.error) {
+    fprintf(stderr, "Incomplete or invalid instance %d in the batch input, "
+        "exiting.\n", state.num_read);
+    return 1;
+  }
+  return 0;
+}
+
 int main(int argc, char** argv)
 {
   string alg_name;
+  string search_policy_name;
+  int num_search_threads;
+  int num_threads;
+  int batch_queue_size;
 
   po::options_description desc("Allowed options");
   desc.add_options()
+      ("input", po::value<string>(), "Binary amplitude file (.npy or raw "
+          "float64/float32, memory-mapped). Only s and the EMD bound are then "
+          "read from stdin")
       ("matrix_output", po::value<string>(), "File for binary output matrix")
+      ("npy_matrix_output", po::value<string>(), "File for the output matrix "
+          "as a .npy bool array")
+      ("packed_matrix_output", po::value<string>(), "File for the bit-packed "
+          "output matrix")
       ("square_amplitudes", "Square all input amplitudes")
       ("algorithm", po::value<string>(&alg_name)->default_value(
-          "shortest-augmenting-path"), "Min-cost max-flow algorithm")
+          "shortest-augmenting-path"), "Min-cost max-flow algorithm (sap, "
+          "sap-4ary-heap, sap-radix-heap, or lemon-costscaling, "
+          "lemon-networksimplex, lemon-capacityscaling if compiled with "
+          "LEMON)")
       ("print_support", po::value<string>(), "Print support to stderr")
       ("emd_interval", po::value<string>(), "Read both lower and upper EMD "
-          "bound from stdin");
+          "bound from stdin")
+      ("warm_start", "Start each flow computation from the previous flow")
+      ("parametric", "Search the breakpoints over lambda instead of "
+          "searching")
+      ("search_policy", po::value<string>(&search_policy_name)->default_value(
+          "bisection"), "Choice of lambda in the search (bisection, secant, "
+          "or hybrid)")
+      ("num_search_threads", po::value<int>(&num_search_threads)->default_value(
+          1), "Number of lambdas tried in parallel in the search")
+      ("batch", po::value<string>()->implicit_value("-"), "Solve a stream of "
+          "instances from the given file (default: stdin), each with its own "
+          "header")
+      ("num_threads", po::value<int>(&num_threads)->default_value(1),
+          "Number of threads solving instances in batch mode")
+      ("batch_queue_size", po::value<int>(&batch_queue_size)->default_value(
+          0), "Maximum number of instances read ahead of the printed results "
+          "in batch mode (at least num_threads)");
   po::variables_map vm;
   po::store(po::parse_command_line(argc, argv, desc), vm);
   po::notify(vm); 
 
+  EMDFlowNetworkFactory::EMDFlowNetworkType alg_type =
+      EMDFlowNetworkFactory::parse_type(alg_name);
+
+  if (alg_type == EMDFlowNetworkFactory::kUnknownType) {
+    fprintf(stderr, "Unknown algorithm \"%s\", exiting.\n", alg_name.c_str());
+    return 0;
+  }
+
+  emd_flow_search_policy search_policy =
+      parse_search_policy(search_policy_name);
+
+  if (search_policy == kUnknownSearchPolicy) {
+    fprintf(stderr, "Unknown search policy \"%s\", exiting.\n",
+        search_policy_name.c_str());
+    return 0;
+  }
+
+  AmplitudeMatrix x;
+  emd_flow_args args(x);
+  args.lambda_low = .5;
+  args.lambda_high = 1;
+  args.num_search_iterations = 10;
+  args.outdegree_vertical_distance = -1;
+  args.alg_type = alg_type;
+  args.output_function = output_function;
+  args.verbose = true;
+  args.warm_start = (vm.count("warm_start") > 0);
+  args.parametric = (vm.count("parametric") > 0);
+  args.search_policy = search_policy;
+  args.num_search_threads = num_search_threads;
+
+  if (vm.count("batch")) {
+    if (vm.count("input") || vm.count("npy_matrix_output")) {
+      fprintf(stderr, "--input and --npy_matrix_output are not supported in "
+          "batch mode, exiting.\n");
+      return 1;
+    }
+    string input_name = vm["batch"].as<string>();
+    FILE* input = (input_name == "-" ? stdin
+                                     : fopen(input_name.c_str(), "r"));
+    FILE* text_output = NULL;
+    FILE* packed_output = NULL;
+    if (vm.count("matrix_output")) {
+      text_output = fopen(vm["matrix_output"].as<string>().c_str(), "w");
+    }
+    if (vm.count("packed_matrix_output")) {
+      packed_output = fopen(
+          vm["packed_matrix_output"].as<string>().c_str(), "wb");
+    }
+    if (input == NULL || (vm.count("matrix_output") && text_output == NULL)
+        || (vm.count("packed_matrix_output") && packed_output == NULL)) {
+      fprintf(stderr, "Cannot open the batch input or output files, "
+          "exiting.\n");
+      return 1;
+    }
+    // The verbose output of several threads would interleave.
+    args.verbose = false;
+    int exit_code = run_batch(input, vm.count("emd_interval") > 0,
+        vm.count("square_amplitudes") > 0, args, num_threads,
+        batch_queue_size, text_output, packed_output);
+    if (input != stdin) {
+      fclose(input);
+    }
+    if (text_output != NULL) {
+      fclose(text_output);
+    }
+    if (packed_output != NULL) {
+      fclose(packed_output);
+    }
+    return exit_code;
+  }
+
   int emd_bound_low = 0;
   int emd_bound_high = 0;
 
-  scanf("%d %d %d %d", &r, &c, &s, &emd_bound_low);
+  if (vm.count("input")) {
+    string error;
+    if (!input_file.open(vm["input"].as<string>(), &error)) {
+      fprintf(stderr, "Cannot read input: %s, exiting.\n", error.c_str());
+      return 1;
+    }
+    x = input_file.get_matrix();
+    r = x.get_num_rows();
+    c = x.get_num_columns();
+    scanf("%d %d", &s, &emd_bound_low);
+  } else {
+    scanf("%d %d %d %d", &r, &c, &s, &emd_bound_low);
+  }
   if (vm.count("emd_interval")) {
     scanf("%d", &emd_bound_high);
   } else {
     emd_bound_high = emd_bound_low;
   }
 
-  a.resize(r);
-  for (int ii = 0; ii < r; ++ii) {
-    a[ii].resize(c);
-    for (int jj = 0; jj < c; ++jj) {
-      scanf("%lg", &(a[ii][jj]));
-      a[ii][jj] = abs(a[ii][jj]);
-    }
+  if (!vm.count("input")) {
+    read_amplitudes(stdin, r, c, &a);
+    x = a;
   }
 
   if (vm.count("square_amplitudes")) {
     fprintf(stderr, "Squaring all amplitudes ...\n");
+    a.resize(r);
     for (int ii = 0; ii < r; ++ii) {
+      a[ii].resize(c);
       for (int jj = 0; jj < c; ++jj) {
-        a[ii][jj] = a[ii][jj] * a[ii][jj];
+        a[ii][jj] = x(ii, jj) * x(ii, jj);
       }
     }
+    x = a;
   }
 
-  EMDFlowNetworkFactory::EMDFlowNetworkType alg_type =
-      EMDFlowNetworkFactory::parse_type(alg_name);
-
-  if (alg_type == EMDFlowNetworkFactory::kUnknownType) {
-    fprintf(stderr, "Unknown algorithm \"%s\", exiting.\n", alg_name.c_str());
-    return 0;
-  }
-
-  emd_flow_args args(a);
+  args.x = x;
   args.s = s;
   args.emd_bound_low = emd_bound_low;
   args.emd_bound_high = emd_bound_high;
-  args.lambda_low = .5;
-  args.lambda_high = 1;
-  args.num_search_iterations = 10;
-  args.outdegree_vertical_distance = -1;
-  args.alg_type = alg_type;
-  args.output_function = output_function;
-  args.verbose = true;
   
   emd_flow_result result;
   result.support = &support;
@@ -100,7 +414,8 @@ int main(int argc, char** argv)
       fprintf(stderr, "col %d:\n", jj + 1);
       for (int ii = 0; ii < r; ++ii) {
         if ((*result.support)[ii][jj]) {
-          fprintf(stderr, " row %d, amplitude %f\n", ii + 1, a[ii][jj]);
+          fprintf(stderr, " row %d, amplitude %f\n", ii + 1,
+              abs(x(ii, jj)));
         }
       }
     }
@@ -110,18 +425,23 @@ int main(int argc, char** argv)
 
   if (vm.count("matrix_output")) {
     string output_file_name = vm["matrix_output"].as<string>();
-    FILE* output_file = fopen(output_file_name.c_str(), "w");
-    for (int ii = 0; ii < r; ++ii) {
-      for (int jj = 0; jj < c; ++jj) {
-        if ((*result.support)[ii][jj]) {
-          fprintf(output_file, "1 ");
-        } else {
-          fprintf(output_file, "0 ");
-        }
-      }
-      fprintf(output_file, "\n");
+    if (!write_support_text(output_file_name, *result.support)) {
+      fprintf(stderr, "Cannot write %s.\n", output_file_name.c_str());
+    }
+  }
+
+  if (vm.count("npy_matrix_output")) {
+    string output_file_name = vm["npy_matrix_output"].as<string>();
+    if (!write_support_npy(output_file_name, *result.support)) {
+      fprintf(stderr, "Cannot write %s.\n", output_file_name.c_str());
+    }
+  }
+
+  if (vm.count("packed_matrix_output")) {
+    string output_file_name = vm["packed_matrix_output"].as<string>();
+    if (!write_support_packed(output_file_name, *result.support)) {
+      fprintf(stderr, "Cannot write %s.\n", output_file_name.c_str());
     }
-    fclose(output_file);
   }
 
   return 0;
@@ -7,6 +7,8 @@
 #include <vector>
 #include <string>
 
+#include "emd_flow_matrix.h"
+
 bool get_double(const mxArray* raw_data, double* data) {
   int numdims = mxGetNumberOfDimensions(raw_data);
   const mwSize* dims = mxGetDimensions(raw_data);
@@ -43,6 +45,19 @@ bool get_bool(const mxArray* raw_data, bool* data) {
   return true;
 }
 
+bool get_string(const mxArray* raw_data, std::string* data) {
+  if (!mxIsChar(raw_data)) {
+    return false;
+  }
+  char* tmp = mxArrayToString(raw_data);
+  if (tmp == NULL) {
+    return false;
+  }
+  *data = tmp;
+  mxFree(tmp);
+  return true;
+}
+
 bool get_double_row_vector(const mxArray* raw_data,
     std::vector<double>* data) {
   int numdims = mxGetNumberOfDimensions(raw_data);
@@ -80,29 +95,93 @@ bool get_double_interval_as_ints(const mxArray* raw_data, int* left,
   return true;
 }
 
-bool get_double_matrix(const mxArray* raw_data,
-    std::vector<std::vector<double> >* data) {
+// View of a two-dimensional double or single array (column major). The
+// entries are not copied.
+bool get_amplitude_matrix(const mxArray* raw_data, AmplitudeMatrix* data) {
   int numdims = mxGetNumberOfDimensions(raw_data);
   const mwSize* dims = mxGetDimensions(raw_data);
-  if (numdims != 2) {
+  if (numdims != 2 || mxIsComplex(raw_data)) {
     return false;
   }
-  if (!mxIsClass(raw_data, "double")) {
+  int r = dims[0];
+  int c = dims[1];
+  if (mxIsClass(raw_data, "double")) {
+    *data = AmplitudeMatrix(static_cast<const double*>(mxGetData(raw_data)),
+                            r, c, 1, r);
+  } else if (mxIsClass(raw_data, "single")) {
+    *data = AmplitudeMatrix(static_cast<const float*>(mxGetData(raw_data)),
+                            r, c, 1, r);
+  } else {
     return false;
   }
-  size_t r = dims[0];
-  size_t c = dims[1];
-  double* data_linear = static_cast<double*>(mxGetData(raw_data));
-  if (data->size() != r) {
-    data->resize(r);
+  return true;
+}
+
+// Views of the frames data(:, :, ii) of a three-dimensional double or single
+// array or of the two-dimensional arrays in a cell array (in linear order).
+// The entries are not copied.
+bool get_amplitude_matrices(const mxArray* raw_data,
+    std::vector<AmplitudeMatrix>* data) {
+  data->clear();
+  if (mxIsCell(raw_data)) {
+    size_t num_cells = mxGetNumberOfElements(raw_data);
+    for (size_t ii = 0; ii < num_cells; ++ii) {
+      const mxArray* cell = mxGetCell(raw_data, ii);
+      AmplitudeMatrix matrix;
+      if (cell == NULL || !get_amplitude_matrix(cell, &matrix)) {
+        return false;
+      }
+      data->push_back(matrix);
+    }
+    return true;
   }
-  for (size_t ir = 0; ir < r; ++ir) {
-    if ((*data)[ir].size() != c) {
-      (*data)[ir].resize(c);
+
+  int numdims = mxGetNumberOfDimensions(raw_data);
+  const mwSize* dims = mxGetDimensions(raw_data);
+  if (numdims != 3 || mxIsComplex(raw_data)) {
+    return false;
+  }
+  int r = dims[0];
+  int c = dims[1];
+  size_t num_frames = dims[2];
+  if (mxIsClass(raw_data, "double")) {
+    const double* frames = static_cast<const double*>(mxGetData(raw_data));
+    for (size_t ii = 0; ii < num_frames; ++ii) {
+      data->push_back(AmplitudeMatrix(frames + ii * r * c, r, c, 1, r));
     }
-    for (size_t ic = 0; ic < c; ++ic) {
-      (*data)[ir][ic] = data_linear[ir + ic * r];
+  } else if (mxIsClass(raw_data, "single")) {
+    const float* frames = static_cast<const float*>(mxGetData(raw_data));
+    for (size_t ii = 0; ii < num_frames; ++ii) {
+      data->push_back(AmplitudeMatrix(frames + ii * r * c, r, c, 1, r));
     }
+  } else {
+    return false;
+  }
+  return true;
+}
+
+// EMD bounds for num_frames frames. raw_data is a double array with one row
+// for all frames or num_frames rows (one per frame). Each row is either a
+// budget or an interval [low, high].
+bool get_emd_bounds(const mxArray* raw_data, size_t num_frames,
+    std::vector<int>* low, std::vector<int>* high) {
+  int numdims = mxGetNumberOfDimensions(raw_data);
+  const mwSize* dims = mxGetDimensions(raw_data);
+  if (numdims != 2 || !mxIsClass(raw_data, "double")) {
+    return false;
+  }
+  size_t r = dims[0];
+  size_t c = dims[1];
+  if ((r != 1 && r != num_frames) || (c != 1 && c != 2)) {
+    return false;
+  }
+  const double* data_linear = static_cast<double*>(mxGetData(raw_data));
+  low->resize(num_frames);
+  high->resize(num_frames);
+  for (size_t ii = 0; ii < num_frames; ++ii) {
+    size_t ir = (r == 1 ? 0 : ii);
+    (*low)[ii] = static_cast<int>(round(data_linear[ir]));
+    (*high)[ii] = static_cast<int>(round(data_linear[ir + (c - 1) * r]));
   }
   return true;
 }
@@ -175,6 +254,18 @@ bool get_bool_field(const mxArray* struc, const char* name, bool* data) {
   return get_bool(raw_data, data);
 }
 
+bool get_string_field(const mxArray* struc, const char* name,
+    std::string* data) {
+  if (!mxIsStruct(struc)) {
+    return false;
+  }
+  mxArray* raw_data = mxGetField(struc, 0, name);
+  if (raw_data == NULL) {
+    return false;
+  }
+  return get_string(raw_data, data);
+}
+
 void set_double(mxArray** raw_data, double data) {
   *raw_data = mxCreateDoubleMatrix(1, 1, mxREAL);
   *(static_cast<double*>(mxGetData(*raw_data))) = data;
@@ -197,19 +288,48 @@ void set_double_matrix(mxArray** raw_data,
     }
   }
 }
-void set_double_matrix(mxArray** raw_data,
-    const std::vector<std::vector<bool> >& data) {
-  std::vector<std::vector<double> > tmp_data;
-  size_t r = data.size();
-  size_t c = (r > 0 ? data[0].size() : 0);
-  tmp_data.resize(r);
-  for (size_t ir = 0; ir < r; ++ir) {
-    tmp_data[ir].resize(c);
-    for (size_t ic = 0; ic < c; ++ic) {
-      tmp_data[ir][ic] = data[ir][ic];
+
+void set_double_column_vector(mxArray** raw_data,
+    const std::vector<double>& data) {
+  *raw_data = mxCreateDoubleMatrix(data.size(), 1, mxREAL);
+  double* result_linear = static_cast<double*>(mxGetData(*raw_data));
+  for (size_t ii = 0; ii < data.size(); ++ii) {
+    result_linear[ii] = data[ii];
+  }
+}
+
+// Writes the r x c matrix data (column major) to result_linear.
+void copy_logical_matrix(const std::vector<std::vector<bool> >& data,
+    size_t r, size_t c, mxLogical* result_linear) {
+  if (data.size() != r) {
+    return;
+  }
+  for (size_t ic = 0; ic < c; ++ic) {
+    for (size_t ir = 0; ir < r; ++ir) {
+      result_linear[ir + ic * r] = data[ir][ic];
     }
   }
-  set_double_matrix(raw_data, tmp_data);
+}
+
+void set_logical_matrix(mxArray** raw_data,
+    const std::vector<std::vector<bool> >& data, size_t r, size_t c) {
+  *raw_data = mxCreateLogicalMatrix(r, c);
+  copy_logical_matrix(data, r, c, mxGetLogicals(*raw_data));
+}
+
+// r x c x data.size() logical array with data[ii] as frame ii.
+void set_logical_array(mxArray** raw_data,
+    const std::vector<std::vector<std::vector<bool> > >& data, size_t r,
+    size_t c) {
+  mwSize dims[3];
+  dims[0] = r;
+  dims[1] = c;
+  dims[2] = data.size();
+  *raw_data = mxCreateLogicalArray(3, dims);
+  mxLogical* result_linear = mxGetLogicals(*raw_data);
+  for (size_t ii = 0; ii < data.size(); ++ii) {
+    copy_logical_matrix(data[ii], r, c, result_linear + ii * r * c);
+  }
 }
 
 #endif
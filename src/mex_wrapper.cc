@@ -12,11 +12,88 @@
 
 using namespace std;
 
-void output_function(const char* s) {
+void output_function(const char* s, void*) {
   mexPrintf(s);
   mexEvalString("drawnow;");
 }
 
+// The Matlab API must only be called from the Matlab thread, so in batch
+// mode the output of each frame is collected and printed afterwards.
+void append_output(const char* s, void* output) {
+  static_cast<string*>(output)->append(s);
+}
+
+// Solves frames[ii] with the options in args and EMD bounds
+// [emd_bounds_low[ii], emd_bounds_high[ii]] for all ii on num_threads
+// threads and sets the outputs. The supports are returned in a cell array of
+// the same size as input if is_cell is true and in a three-dimensional
+// logical array otherwise. The other outputs are column vectors.
+void solve_batch(const emd_flow_args& args,
+    const vector<AmplitudeMatrix>& frames, const vector<int>& emd_bounds_low,
+    const vector<int>& emd_bounds_high, int num_threads, bool is_cell,
+    const mxArray* input, int nlhs, mxArray* plhs[]) {
+  size_t num_frames = frames.size();
+  // Each frame searches over lambda in a single thread, the frames are
+  // solved in parallel.
+  vector<emd_flow_args> frame_args(num_frames, args);
+  vector<vector<vector<bool> > > supports(num_frames);
+  vector<emd_flow_result> results(num_frames);
+  vector<string> messages(num_frames);
+  vector<const emd_flow_args*> batch_args(num_frames);
+  vector<emd_flow_result*> batch_results(num_frames);
+  for (size_t ii = 0; ii < num_frames; ++ii) {
+    frame_args[ii].x = frames[ii];
+    frame_args[ii].emd_bound_low = emd_bounds_low[ii];
+    frame_args[ii].emd_bound_high = emd_bounds_high[ii];
+    frame_args[ii].num_search_threads = 1;
+    frame_args[ii].output_function = append_output;
+    frame_args[ii].output_context = &messages[ii];
+    results[ii].support = &supports[ii];
+    batch_args[ii] = &frame_args[ii];
+    batch_results[ii] = &results[ii];
+  }
+
+  emd_flow_batch(batch_args, batch_results, num_threads);
+
+  for (size_t ii = 0; ii < num_frames; ++ii) {
+    if (!messages[ii].empty()) {
+      output_function(messages[ii].c_str(), NULL);
+    }
+  }
+
+  if (nlhs >= 1) {
+    if (is_cell) {
+      plhs[0] = mxCreateCellArray(mxGetNumberOfDimensions(input),
+          mxGetDimensions(input));
+      for (size_t ii = 0; ii < num_frames; ++ii) {
+        mxArray* support;
+        set_logical_matrix(&support, supports[ii], frames[ii].get_num_rows(),
+            frames[ii].get_num_columns());
+        mxSetCell(plhs[0], ii, support);
+      }
+    } else {
+      const mwSize* dims = mxGetDimensions(input);
+      set_logical_array(&(plhs[0]), supports, dims[0], dims[1]);
+    }
+  }
+
+  vector<double> values(num_frames);
+  for (int output = 1; output < nlhs; ++output) {
+    for (size_t ii = 0; ii < num_frames; ++ii) {
+      if (output == 1) {
+        values[ii] = results[ii].emd_cost;
+      } else if (output == 2) {
+        values[ii] = results[ii].amp_sum;
+      } else if (output == 3) {
+        values[ii] = results[ii].final_lambda_low;
+      } else {
+        values[ii] = results[ii].final_lambda_high;
+      }
+    }
+    set_double_column_vector(&(plhs[output]), values);
+  }
+}
+
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
   if (nrhs < 3) {
     mexErrMsgTxt("At least three input argument required (amplitudes, sparsity,"
@@ -30,9 +107,19 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     mexErrMsgTxt("Too many output arguments.");
   }
   
-  vector<vector<double> > a;
-  if (!get_double_matrix(prhs[0], &a)) {
-    mexErrMsgTxt("Amplitudes need to be a two-dimensional double array.");
+  // A three-dimensional array or a cell array is a batch of instances.
+  bool batch = (mxIsCell(prhs[0]) || mxGetNumberOfDimensions(prhs[0]) == 3);
+  AmplitudeMatrix a;
+  vector<AmplitudeMatrix> frames;
+  if (batch) {
+    if (!get_amplitude_matrices(prhs[0], &frames)) {
+      mexErrMsgTxt("A batch of amplitudes needs to be a three-dimensional "
+          "double or single array or a cell array of two-dimensional double "
+          "or single arrays.");
+    }
+  } else if (!get_amplitude_matrix(prhs[0], &a)) {
+    mexErrMsgTxt("Amplitudes need to be a two-dimensional double or single "
+        "array.");
   }
 
   int s = 0;
@@ -42,7 +129,15 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 
   int emd_bound_low = 0;
   int emd_bound_high = 0;
-  if (!get_double_as_int(prhs[2], &emd_bound_low)) {
+  vector<int> emd_bounds_low;
+  vector<int> emd_bounds_high;
+  if (batch) {
+    if (!get_emd_bounds(prhs[2], frames.size(), &emd_bounds_low,
+        &emd_bounds_high)) {
+      mexErrMsgTxt("EMD budget has to be a double scalar, a double interval "
+          "or have one row (scalar or interval) per instance.");
+    }
+  } else if (!get_double_as_int(prhs[2], &emd_bound_low)) {
     if (!get_double_interval_as_ints(prhs[2], &emd_bound_low,
         &emd_bound_high)) {
       mexErrMsgTxt("EMD budget has to be a double scalar or a double "
@@ -54,6 +149,11 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
 
   // optional parameters
   bool verbose = false;
+  bool warm_start = false;
+  bool parametric = false;
+  emd_flow_search_policy search_policy = kBisectionSearch;
+  int num_search_threads = 1;
+  int num_threads = 1;
   double lambda_low = 0.5;
   double lambda_high = 1.0;
   int num_iter = 10;
@@ -67,6 +167,11 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
     known_options.insert("num_iterations");
     known_options.insert("outdegree_vertical_distance");
     known_options.insert("emd_costs");
+    known_options.insert("warm_start");
+    known_options.insert("parametric");
+    known_options.insert("search_policy");
+    known_options.insert("num_search_threads");
+    known_options.insert("num_threads");
     vector<string> options;
     if (!get_fields(prhs[3], &options)) {
       mexErrMsgTxt("Cannot get fields from options argument.");
@@ -110,6 +215,39 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
         && !get_double_row_vector_field(prhs[3], "emd_costs", &emd_costs)) {
       mexErrMsgTxt("emd_costs field has to be a double row vector.");
     }
+
+    if (has_field(prhs[3], "warm_start")
+        && !get_bool_field(prhs[3], "warm_start", &warm_start)) {
+      mexErrMsgTxt("warm_start flag has to be a boolean scalar.");
+    }
+
+    if (has_field(prhs[3], "parametric")
+        && !get_bool_field(prhs[3], "parametric", &parametric)) {
+      mexErrMsgTxt("parametric flag has to be a boolean scalar.");
+    }
+
+    if (has_field(prhs[3], "search_policy")) {
+      string search_policy_name;
+      if (!get_string_field(prhs[3], "search_policy", &search_policy_name)) {
+        mexErrMsgTxt("search_policy field has to be a string.");
+      }
+      search_policy = parse_search_policy(search_policy_name);
+      if (search_policy == kUnknownSearchPolicy) {
+        mexErrMsgTxt("search_policy has to be \"bisection\", \"secant\" or "
+            "\"hybrid\".");
+      }
+    }
+
+    if (has_field(prhs[3], "num_search_threads")
+        && !get_double_field_as_int(prhs[3], "num_search_threads",
+                                    &num_search_threads)) {
+      mexErrMsgTxt("num_search_threads field has to be a double scalar.");
+    }
+
+    if (has_field(prhs[3], "num_threads")
+        && !get_double_field_as_int(prhs[3], "num_threads", &num_threads)) {
+      mexErrMsgTxt("num_threads field has to be a double scalar.");
+    }
   }
 
   emd_flow_args args(a);
@@ -124,6 +262,16 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
   args.alg_type = EMDFlowNetworkFactory::kShortestAugmentingPath;
   args.output_function = output_function;
   args.verbose = verbose;
+  args.warm_start = warm_start;
+  args.parametric = parametric;
+  args.search_policy = search_policy;
+  args.num_search_threads = num_search_threads;
+
+  if (batch) {
+    solve_batch(args, frames, emd_bounds_low, emd_bounds_high, num_threads,
+        mxIsCell(prhs[0]), prhs[0], nlhs, plhs);
+    return;
+  }
 
   std::vector<std::vector<bool> > support;
   emd_flow_result result;
@@ -132,7 +280,8 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
   emd_flow(args, &result);
 
   if (nlhs >= 1) {
-    set_double_matrix(&(plhs[0]), *(result.support));
+    set_logical_matrix(&(plhs[0]), *(result.support), a.get_num_rows(),
+        a.get_num_columns());
   }
 
   if (nlhs >= 2) {
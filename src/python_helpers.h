@@ -1,9 +1,408 @@
 #ifndef __EMDFLOW_PYTHON_HELPERS_H__
 #define __EMDFLOW_PYTHON_HELPERS_H__
 
+#include <Python.h>
+#include <numpy/arrayobject.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
-#include "emd_flow_network_sap.h"
+#include "emd_flow.h"
+#include "emd_flow_matrix.h"
+#include "emd_flow_network.h"
+#include "emd_flow_network_factory.h"
+
+// Writable view of a two-dimensional uint8 or bool array. Entry (row, col)
+// is data[row * row_stride + col * col_stride].
+struct support_matrix {
+  unsigned char* data;
+  int rows;
+  int cols;
+  npy_intp row_stride;
+  npy_intp col_stride;
+};
+
+// Returns true if array is a numpy array with num_dims dimensions and the
+// given element size whose entries can be accessed in place (aligned, native
+// byte order, strides that are multiples of the element size).
+bool is_usable_array(PyObject* array, int num_dims, int element_size) {
+  if (!PyArray_Check(array)) {
+    return false;
+  }
+  PyArrayObject* ary = reinterpret_cast<PyArrayObject*>(array);
+  if (PyArray_NDIM(ary) != num_dims || !PyArray_ISALIGNED(ary)
+      || !PyArray_ISNOTSWAPPED(ary)) {
+    return false;
+  }
+  for (int ii = 0; ii < num_dims; ++ii) {
+    if (PyArray_DIM(ary, ii) > INT_MAX
+        || PyArray_STRIDE(ary, ii) % element_size != 0) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Returns true if array is a float64 or float32 array with num_dims
+// dimensions that can be read in place.
+bool is_amplitude_array(PyObject* array, int num_dims) {
+  if (!PyArray_Check(array)) {
+    return false;
+  }
+  int type = PyArray_TYPE(reinterpret_cast<PyArrayObject*>(array));
+  if (type == NPY_DOUBLE) {
+    return is_usable_array(array, num_dims, sizeof(double));
+  } else if (type == NPY_FLOAT) {
+    return is_usable_array(array, num_dims, sizeof(float));
+  } else {
+    return false;
+  }
+}
+
+// Returns true if array is a writable uint8 or bool array with num_dims
+// dimensions.
+bool is_support_array(PyObject* array, int num_dims) {
+  if (!PyArray_Check(array)) {
+    return false;
+  }
+  PyArrayObject* ary = reinterpret_cast<PyArrayObject*>(array);
+  int type = PyArray_TYPE(ary);
+  return (type == NPY_UINT8 || type == NPY_BOOL) && PyArray_ISWRITEABLE(ary)
+      && is_usable_array(array, num_dims, 1);
+}
+
+// View of the matrix that starts offset bytes into the amplitude array ary.
+// Its rows and columns are the last two dimensions of ary.
+AmplitudeMatrix get_amplitude_view(PyArrayObject* ary, npy_intp offset) {
+  int nd = PyArray_NDIM(ary);
+  const char* data = static_cast<const char*>(PyArray_DATA(ary)) + offset;
+  int rows = PyArray_DIM(ary, nd - 2);
+  int cols = PyArray_DIM(ary, nd - 1);
+  npy_intp size = PyArray_ITEMSIZE(ary);
+  npy_intp row_stride = PyArray_STRIDE(ary, nd - 2) / size;
+  npy_intp col_stride = PyArray_STRIDE(ary, nd - 1) / size;
+  if (PyArray_TYPE(ary) == NPY_DOUBLE) {
+    return AmplitudeMatrix(reinterpret_cast<const double*>(data), rows, cols,
+                           row_stride, col_stride);
+  } else {
+    return AmplitudeMatrix(reinterpret_cast<const float*>(data), rows, cols,
+                           row_stride, col_stride);
+  }
+}
+
+// View of the matrix that starts offset bytes into the support array ary.
+support_matrix get_support_view(PyArrayObject* ary, npy_intp offset) {
+  int nd = PyArray_NDIM(ary);
+  support_matrix matrix;
+  matrix.data = static_cast<unsigned char*>(PyArray_DATA(ary)) + offset;
+  matrix.rows = PyArray_DIM(ary, nd - 2);
+  matrix.cols = PyArray_DIM(ary, nd - 1);
+  matrix.row_stride = PyArray_STRIDE(ary, nd - 2);
+  matrix.col_stride = PyArray_STRIDE(ary, nd - 1);
+  return matrix;
+}
+
+// View of a two-dimensional float64 or float32 numpy array in any memory
+// order. The entries are not copied.
+bool get_amplitude_matrix(PyObject* array, AmplitudeMatrix* matrix) {
+  if (!is_amplitude_array(array, 2)) {
+    return false;
+  }
+  *matrix = get_amplitude_view(reinterpret_cast<PyArrayObject*>(array), 0);
+  return true;
+}
+
+// Views of the matrices array[ii, :, :] of a three-dimensional float64 or
+// float32 numpy array.
+bool get_amplitude_stack(PyObject* array,
+                         std::vector<AmplitudeMatrix>* matrices) {
+  if (!is_amplitude_array(array, 3)) {
+    return false;
+  }
+  PyArrayObject* ary = reinterpret_cast<PyArrayObject*>(array);
+  matrices->clear();
+  for (npy_intp ii = 0; ii < PyArray_DIM(ary, 0); ++ii) {
+    matrices->push_back(get_amplitude_view(ary,
+                                           ii * PyArray_STRIDE(ary, 0)));
+  }
+  return true;
+}
+
+// View of a writable two-dimensional uint8 or bool numpy array in any
+// memory order.
+bool get_support_matrix(PyObject* array, support_matrix* matrix) {
+  if (!is_support_array(array, 2)) {
+    return false;
+  }
+  *matrix = get_support_view(reinterpret_cast<PyArrayObject*>(array), 0);
+  return true;
+}
+
+// Views of the matrices array[ii, :, :] of a writable three-dimensional
+// uint8 or bool numpy array.
+bool get_support_stack(PyObject* array,
+                       std::vector<support_matrix>* matrices) {
+  if (!is_support_array(array, 3)) {
+    return false;
+  }
+  PyArrayObject* ary = reinterpret_cast<PyArrayObject*>(array);
+  matrices->clear();
+  for (npy_intp ii = 0; ii < PyArray_DIM(ary, 0); ++ii) {
+    matrices->push_back(get_support_view(ary, ii * PyArray_STRIDE(ary, 0)));
+  }
+  return true;
+}
+
+// Copies a one-dimensional array (or any sequence of numbers) of EMD costs.
+bool get_emd_costs(PyObject* costs, std::vector<double>* emd_costs) {
+  PyObject* array = PyArray_FROMANY(costs, NPY_DOUBLE, 1, 1,
+      NPY_ARRAY_IN_ARRAY);
+  if (array == NULL) {
+    PyErr_Clear();
+    return false;
+  }
+  PyArrayObject* ary = reinterpret_cast<PyArrayObject*>(array);
+  const double* data = static_cast<const double*>(PyArray_DATA(ary));
+  emd_costs->assign(data, data + PyArray_DIM(ary, 0));
+  Py_DECREF(array);
+  return true;
+}
+
+// Copies an EMD bound for num_frames frames, given either as a single number
+// for all frames or as a sequence with one number per frame.
+void get_emd_bounds(PyObject* bound, int num_frames,
+                    std::vector<int>* bounds) {
+  PyObject* array = PyArray_FROMANY(bound, NPY_INT, 0, 1,
+      NPY_ARRAY_IN_ARRAY | NPY_ARRAY_FORCECAST);
+  if (array == NULL) {
+    PyErr_Clear();
+    throw std::invalid_argument("EMD bounds have to be an integer or a "
+        "one-dimensional array of integers.");
+  }
+  PyArrayObject* ary = reinterpret_cast<PyArrayObject*>(array);
+  const int* data = static_cast<const int*>(PyArray_DATA(ary));
+  if (PyArray_NDIM(ary) == 0) {
+    bounds->assign(num_frames, data[0]);
+  } else if (PyArray_DIM(ary, 0) == num_frames) {
+    bounds->assign(data, data + num_frames);
+  } else {
+    Py_DECREF(array);
+    throw std::invalid_argument("The number of EMD bounds must match the "
+        "number of frames.");
+  }
+  Py_DECREF(array);
+}
+
+// New one-dimensional numpy array with a copy of values.
+template <typename T>
+PyObject* create_array(const std::vector<T>& values, int type) {
+  npy_intp size = values.size();
+  PyObject* array = PyArray_SimpleNew(1, &size, type);
+  if (array != NULL && size > 0) {
+    std::copy(values.begin(), values.end(), static_cast<T*>(
+        PyArray_DATA(reinterpret_cast<PyArrayObject*>(array))));
+  }
+  return array;
+}
+
+void write_to_stdout(const char* s, void*) {
+  fputs(s, stdout);
+  fflush(stdout);
+}
+
+void write_support(const std::vector<std::vector<bool> >& support,
+                   const support_matrix& output) {
+  if (static_cast<int>(support.size()) != output.rows) {
+    return;
+  }
+  for (int ii = 0; ii < output.rows; ++ii) {
+    for (int jj = 0; jj < output.cols; ++jj) {
+      output.data[ii * output.row_stride + jj * output.col_stride] =
+          (support[ii][jj] ? 1 : 0);
+    }
+  }
+}
+
+// Sets the options of the Python interface in args.
+void set_options(int sparsity,
+                 const std::vector<double>& emd_costs,
+                 int outdegree_vertical_distance,
+                 double lambda_low,
+                 double lambda_high,
+                 int num_iterations,
+                 const char* search_policy,
+                 int num_search_threads,
+                 bool warm_start,
+                 bool parametric,
+                 bool verbose,
+                 emd_flow_args* args) {
+  args->s = sparsity;
+  args->lambda_low = lambda_low;
+  args->lambda_high = lambda_high;
+  args->num_search_iterations = num_iterations;
+  args->outdegree_vertical_distance = outdegree_vertical_distance;
+  args->emd_costs = emd_costs;
+  args->alg_type = EMDFlowNetworkFactory::kShortestAugmentingPath;
+  args->output_function = write_to_stdout;
+  args->verbose = verbose;
+  args->warm_start = warm_start;
+  args->parametric = parametric;
+  args->search_policy = parse_search_policy(search_policy);
+  if (args->search_policy == kUnknownSearchPolicy) {
+    throw std::invalid_argument("search_policy has to be \"bisection\", "
+        "\"secant\" or \"hybrid\".");
+  }
+  args->num_search_threads = num_search_threads;
+}
+
+// Runs emd_flow (including the search over lambda) and writes the support of
+// the solution into support (1 for entries in the support, 0 otherwise).
+// Returns the EMD cost and amplitude sum of the solution and the final
+// interval of lambdas in the output arguments. The optional arguments are
+// the fields of emd_flow_args with the same defaults as the Matlab module.
+// The GIL is released while the solution is computed, so several Python
+// threads can solve at the same time. The arrays must not be modified
+// during the call.
+void solve_emd_flow(const AmplitudeMatrix& amplitudes, int sparsity,
+                    int emd_bound_low, int emd_bound_high,
+                    const support_matrix& support,
+                    int* emd_cost, double* amp_sum,
+                    double* final_lambda_low, double* final_lambda_high,
+                    const std::vector<double>& emd_costs
+                        = std::vector<double>(),
+                    int outdegree_vertical_distance = -1,
+                    double lambda_low = 0.5,
+                    double lambda_high = 1.0,
+                    int num_iterations = 10,
+                    const char* search_policy = "bisection",
+                    int num_search_threads = 1,
+                    bool warm_start = false,
+                    bool parametric = false,
+                    bool verbose = false) {
+  int rows = amplitudes.get_num_rows();
+  int cols = amplitudes.get_num_columns();
+  if (rows == 0 || cols == 0) {
+    throw std::invalid_argument("Amplitudes must not be empty.");
+  }
+  if (support.rows != rows || support.cols != cols) {
+    throw std::invalid_argument("Output dimensions must match input "
+        "dimensions.");
+  }
+
+  emd_flow_args args(amplitudes);
+  set_options(sparsity, emd_costs, outdegree_vertical_distance, lambda_low,
+      lambda_high, num_iterations, search_policy, num_search_threads,
+      warm_start, parametric, verbose, &args);
+  args.emd_bound_low = emd_bound_low;
+  args.emd_bound_high = emd_bound_high;
+
+  std::vector<std::vector<bool> > result_support;
+  emd_flow_result result;
+  result.support = &result_support;
+
+  Py_BEGIN_ALLOW_THREADS
+  emd_flow(args, &result);
+  write_support(result_support, support);
+  Py_END_ALLOW_THREADS
+
+  *emd_cost = result.emd_cost;
+  *amp_sum = result.amp_sum;
+  *final_lambda_low = result.final_lambda_low;
+  *final_lambda_high = result.final_lambda_high;
+}
+
+// Runs emd_flow for each frame amplitudes[ii, :, :] of a three-dimensional
+// array and writes the support of frame ii into support[ii, :, :]. The EMD
+// bounds are either single numbers for all frames or one-dimensional arrays
+// with one entry per frame. The frames are solved by num_threads native
+// threads with emd_flow_batch, which builds the flow network once per
+// thread. Returns a tuple of arrays (emd_cost, amp_sum, final_lambda_low,
+// final_lambda_high) with one entry per frame. The other arguments are as
+// in solve_emd_flow. The GIL is released while the frames are solved.
+PyObject* solve_emd_flow_batch(const std::vector<AmplitudeMatrix>& amplitudes,
+                               int sparsity,
+                               PyObject* emd_bound_low,
+                               PyObject* emd_bound_high,
+                               const std::vector<support_matrix>& support,
+                               int num_threads = 1,
+                               const std::vector<double>& emd_costs
+                                   = std::vector<double>(),
+                               int outdegree_vertical_distance = -1,
+                               double lambda_low = 0.5,
+                               double lambda_high = 1.0,
+                               int num_iterations = 10,
+                               const char* search_policy = "bisection",
+                               bool warm_start = false,
+                               bool parametric = false,
+                               bool verbose = false) {
+  int num_frames = amplitudes.size();
+  if (static_cast<int>(support.size()) != num_frames) {
+    throw std::invalid_argument("Output dimensions must match input "
+        "dimensions.");
+  }
+  if (num_frames > 0 && (amplitudes[0].get_num_rows() == 0
+                         || amplitudes[0].get_num_columns() == 0)) {
+    throw std::invalid_argument("Amplitudes must not be empty.");
+  }
+  if (num_frames > 0
+      && (support[0].rows != amplitudes[0].get_num_rows()
+          || support[0].cols != amplitudes[0].get_num_columns())) {
+    throw std::invalid_argument("Output dimensions must match input "
+        "dimensions.");
+  }
+  std::vector<int> bounds_low;
+  std::vector<int> bounds_high;
+  get_emd_bounds(emd_bound_low, num_frames, &bounds_low);
+  get_emd_bounds(emd_bound_high, num_frames, &bounds_high);
+
+  // Each frame searches over lambda in a single thread, the frames are
+  // solved in parallel.
+  AmplitudeMatrix no_amplitudes;
+  emd_flow_args options(no_amplitudes);
+  set_options(sparsity, emd_costs, outdegree_vertical_distance, lambda_low,
+      lambda_high, num_iterations, search_policy, 1, warm_start, parametric,
+      verbose, &options);
+  std::vector<emd_flow_args> args(num_frames, options);
+  std::vector<std::vector<std::vector<bool> > > supports(num_frames);
+  std::vector<emd_flow_result> results(num_frames);
+  std::vector<const emd_flow_args*> batch_args(num_frames);
+  std::vector<emd_flow_result*> batch_results(num_frames);
+  for (int ii = 0; ii < num_frames; ++ii) {
+    args[ii].x = amplitudes[ii];
+    args[ii].emd_bound_low = bounds_low[ii];
+    args[ii].emd_bound_high = bounds_high[ii];
+    results[ii].support = &supports[ii];
+    batch_args[ii] = &args[ii];
+    batch_results[ii] = &results[ii];
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  emd_flow_batch(batch_args, batch_results, num_threads);
+  for (int ii = 0; ii < num_frames; ++ii) {
+    write_support(supports[ii], support[ii]);
+  }
+  Py_END_ALLOW_THREADS
+
+  std::vector<int> emd_cost(num_frames);
+  std::vector<double> amp_sum(num_frames);
+  std::vector<double> final_lambda_low(num_frames);
+  std::vector<double> final_lambda_high(num_frames);
+  for (int ii = 0; ii < num_frames; ++ii) {
+    emd_cost[ii] = results[ii].emd_cost;
+    amp_sum[ii] = results[ii].amp_sum;
+    final_lambda_low[ii] = results[ii].final_lambda_low;
+    final_lambda_high[ii] = results[ii].final_lambda_high;
+  }
+  return Py_BuildValue("(NNNN)", create_array(emd_cost, NPY_INT),
+                       create_array(amp_sum, NPY_DOUBLE),
+                       create_array(final_lambda_low, NPY_DOUBLE),
+                       create_array(final_lambda_high, NPY_DOUBLE));
+}
 
 void solve_relaxation(const double* data, int rows, int cols,
                       const double* emd_costs, int num_emd_costs,
@@ -18,25 +417,22 @@ void solve_relaxation(const double* data, int rows, int cols,
         "dimensions.");
   }
 
-  std::vector<std::vector<double> > input(rows);
   // numpy uses row major by default
-  for (int ii = 0; ii < rows; ++ii) {
-    input[ii].resize(cols);
-    for (int jj = 0; jj < cols; ++jj) {
-      input[ii][jj] = data[ii * cols + jj];
-    }
-  }
+  AmplitudeMatrix input(data, rows, cols, cols, 1);
   std::vector<double> emd_costs2(num_emd_costs);
   for (int ii = 0; ii < num_emd_costs; ++ii) {
     emd_costs2[ii] = emd_costs[ii];
   }
   std::vector<std::vector<bool> > result;
-  
-  EMDFlowNetworkSAP algo(input, num_emd_costs - 1, emd_costs2);
-  algo.set_sparsity(sparsity);
-  algo.run_flow(lambda, 1.0);
-  algo.get_support(&result);
-  
+
+  std::auto_ptr<EMDFlowNetwork> algo =
+      EMDFlowNetworkFactory::create_EMD_flow_network(input,
+          num_emd_costs - 1, emd_costs2,
+          EMDFlowNetworkFactory::kShortestAugmentingPath);
+  algo->set_sparsity(sparsity);
+  algo->run_flow(lambda, 1.0);
+  algo->get_support(&result);
+
   // numpy uses row major by default
   for (int ii = 0; ii < rows; ++ii) {
     for (int jj = 0; jj < cols; ++jj) {